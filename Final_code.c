@@ -1,4 +1,6 @@
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
+#endif
 #define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,1309 +10,1660 @@
 #include <time.h>
 #include <limits.h>
 #include <unistd.h>
-#include <math.h>
-#include "avl.h"
-
-#define MAX_ROWS 999
-#define MAX_COLS 18278
-#define VIEWPORT_SIZE 10
-
-// Status enumeration.
-typedef enum {
-    CMD_OK,
-    CMD_UNRECOGNIZED,
-    CMD_INVALID_CELL,
-    CMD_INVALID_RANGE,
-    CMD_CIRCULAR_REF,
-    CMD_RANGE_ERROR
-} CommandStatus;
-
-// Range structure: 4 shorts (8 bytes total)
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <signal.h>
+#include "sheet_internal.h"
+
+// One frame: header, VIEWPORT_SIZE rows of at most 11-character values and
+// the prompt, with room to spare.
+#define FRAME_BUFFER_SIZE 2048
+#define FRAME_LINE_SIZE 128 // one header or row line, without newline
+#define PROMPT_SIZE 64
+#define OUTPUT_RING_SIZE (1 << 20)
+
+/* ---------- Rendering ---------- */
+// What the terminal shows above the prompt, kept to redraw only changes.
 typedef struct {
-    short start_row;
-    short start_col;
-    short end_row;
-    short end_col;
-} Range;
-
-// Optimized Cell structure.
-// __attribute__((packed)) minimizes padding.
-typedef struct __attribute__((packed)) Cell {
-    AVLTree children;   // 8 bytes (AVL tree for children)
-    int cell1;           // Stores parent cell key or start of range or custom value
-    int cell2;           // Stores parent cell key or end of range or custom value
-    int value;          // stores the value of the cell
-    short formula;      // stores the formula code
-    bool error_state;  // 1 byte
-} Cell;
-// Formula codes
-// -1: No formula
-// 82: Simple cell reference
-// 10: Add with both cells 
-// 20: Sub ''
-// 30: Div ''
-// 40: Mult ''
-// 12: Add with single cell and custom value
-// 22: Sub ''
-// 32: Div ''
-// 42: Mult ''
-// 13: Add with custom value and single cell
-// 23: Sub ''
-// 33: Div '' 
-// 43: Mult ''
-// 5: SUM in Range cell1 to cell2
-// 6: AVG
-// 7: MIN
-// 8: MAX
-// 9: STDEV
-// 102: SLEEP with cell reference
-
-// Spreadsheet structure now uses a contiguous array for grid.
+    bool differential;      // draw in place with cursor movement
+    bool valid;             // lines match the terminal
+    int line_count;
+    int line_length[VIEWPORT_SIZE + 1];
+    char lines[VIEWPORT_SIZE + 1][FRAME_LINE_SIZE];
+} Screen;
+
+// A rendered viewport and prompt, captured before it is formatted for the
+// terminal so that formatting and writing can happen on another thread.
 typedef struct {
-    Cell* grid;    // Pointer to a contiguous block of Cells.
-    short rows;
-    short cols;
-    short viewport_row;
-    short viewport_col;
+    int line_count;
+    int line_length[VIEWPORT_SIZE + 1];
+    char lines[VIEWPORT_SIZE + 1][FRAME_LINE_SIZE];
+    int prompt_length;
+    char prompt[PROMPT_SIZE];
+} Frame;
+
+// Where the viewport is, as of the values being drawn.
+typedef struct {
+    short row;
+    short col;
     bool output_enabled;
-} Spreadsheet;
-
-// Function prototypes.
-char* get_column_name(int col);
-void parse_cell_reference(const char* cell, short* row, short* col);
-int column_name_to_number(const char* name);
-CommandStatus parse_range(const char* range_str, Range* range);
-CommandStatus set_cell_value(Spreadsheet* sheet, short row, short col, const char* expr, double* sleep_time);
-CommandStatus evaluate_formula(Spreadsheet* sheet, Cell* cell, short row, short col, const char* expr, double* sleep_time);
-CommandStatus reevaluate_formula(Spreadsheet* sheet, Cell* cell, double* sleep_time);
-
-/* ---------- Contiguous Grid Access ---------- */
-// Returns pointer to cell at (row, col).
-static inline Cell* get_cell(Spreadsheet* sheet, short row, short col) {
-    return &(sheet->grid[(int)(row * sheet->cols + col)]);
+} Viewport;
+
+// Number of lines the viewport occupies: the header plus visible rows.
+static int viewport_lines(const Spreadsheet* sheet, const Viewport* view) {
+    if (!view->output_enabled)
+        return 0;
+    int display_rows = (sheet->rows - view->row < VIEWPORT_SIZE) ? sheet->rows - view->row : VIEWPORT_SIZE;
+    return 1 + display_rows;
 }
 
-Cell* get_cell_check(Spreadsheet* sheet, int index){
-    return &(sheet->grid[index]);
+// Formats one viewport line (0 is the header) into out, without the
+// newline, and returns the end of the text. Values come from the published
+// plane when there is one.
+static char* render_line(const Spreadsheet* sheet, const Viewport* view, int line, char* out) {
+    short start_col = view->col;
+    int display_cols = (sheet->cols - start_col < VIEWPORT_SIZE) ? sheet->cols - start_col : VIEWPORT_SIZE;
+    char* p = out;
+    if (line == 0) {
+        memcpy(p, "    ", 4);
+        p += 4;
+        memcpy(p, sheet->column_labels[start_col], (size_t)display_cols * CELL_WIDTH);
+        return p + display_cols * CELL_WIDTH;
+    }
+    int i = view->row + line - 1;
+    p = format_int(p, i + 1, 4);
+    int key = i * sheet->cols + start_col;
+    for (int j = 0; j < display_cols; j++, key++) {
+        bool error;
+        int value;
+        if (sheet->plane) {
+            value = shown_value(sheet->plane, key, &error);
+        } else {
+            value = sheet->grid[key].value;
+            error = sheet->grid[key].error_state;
+        }
+        if (error) {
+            memcpy(p, "ERR     ", CELL_WIDTH);
+            p += CELL_WIDTH;
+        } else {
+            p = format_int(p, value, CELL_WIDTH);
+        }
+    }
+    return p;
 }
 
-// Helper: encode (row, col) as an integer key.
-static inline int encode_cell_key(short row, short col, short total_cols) {
-    return (int)(row * total_cols + col);
+// Appends the escape sequence that moves the cursor to 1-based (row, col).
+static char* move_cursor(char* p, int row, int col) {
+    *p++ = '\x1b';
+    *p++ = '[';
+    p = format_int(p, row, 0);
+    *p++ = ';';
+    p = format_int(p, col, 0);
+    *p++ = 'H';
+    return p;
 }
 
-void get_row_col(int index, short* row, short* col, short total_cols){
-    *col = index%total_cols;
-    *row = index/total_cols;
+// Appends what it takes to turn screen line `line` into text: nothing if
+// it is unchanged, otherwise the span from the first to the last differing
+// column. Lines that change length are rewritten up to their end.
+static char* diff_line(char* p, Screen* screen, int line, const char* text, int len) {
+    char* old = screen->lines[line];
+    int old_len = line < screen->line_count ? screen->line_length[line] : 0;
+    int first = 0;
+    while (first < len && first < old_len && text[first] == old[first])
+        first++;
+    if (first == len && len == old_len)
+        return p;
+    int last = len;
+    if (len == old_len) {
+        while (last > first && text[last - 1] == old[last - 1])
+            last--;
+    }
+    p = move_cursor(p, line + 1, first + 1);
+    memcpy(p, text + first, (size_t)(last - first));
+    p += last - first;
+    if (len < old_len) {
+        memcpy(p, "\x1b[K", 3);
+        p += 3;
+    }
+    memcpy(old, text, (size_t)len);
+    screen->line_length[line] = len;
+    return p;
 }
 
-// For children dependency, we use an AVL tree.
-// Adds a child key to the parent's children AVL tree.
-void add_child(Cell* parent, short row, short col, short total_cols) {
-    int key = encode_cell_key(row, col, total_cols);
-    parent->children = avl_insert(parent->children, key);
+// Decides once whether frames can be drawn in place: stdout must be a
+// terminal with room for the viewport, the prompt and the echoed newline.
+void screen_init(Screen* screen) {
+    screen->differential = isatty(STDOUT_FILENO);
+    screen->valid = false;
+    screen->line_count = 0;
+    struct winsize size;
+    if (screen->differential && ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0
+        && size.ws_row != 0 && size.ws_row < VIEWPORT_SIZE + 3)
+        screen->differential = false;
 }
 
-// Removes a child key from the parent's children AVL tree.
-void remove_child(Cell* parent, int key) {
-    parent->children = avl_delete(parent->children, key);
+// Renders the viewport (when output is enabled) and the prompt into frame.
+// With published values, the frame shows one published version throughout.
+void capture_frame(const Spreadsheet* sheet, Frame* frame, double last_time, const char* status) {
+    ValuePlane* plane = sheet->plane;
+    Viewport view;
+    unsigned sequence = 0;
+    if (plane)
+        pthread_rwlock_rdlock(&plane->lock);
+    else
+        view = (Viewport){ sheet->viewport_row, sheet->viewport_col, sheet->output_enabled };
+    do {
+        if (plane) {
+            sequence = read_begin(plane);
+            view.row = atomic_load_explicit(&plane->viewport_row, memory_order_relaxed);
+            view.col = atomic_load_explicit(&plane->viewport_col, memory_order_relaxed);
+            view.output_enabled = atomic_load_explicit(&plane->output_enabled, memory_order_relaxed);
+        }
+        frame->line_count = viewport_lines(sheet, &view);
+        for (int line = 0; line < frame->line_count; line++)
+            frame->line_length[line] = (int)(render_line(sheet, &view, line, frame->lines[line]) - frame->lines[line]);
+    } while (plane && read_retry(plane, sequence));
+    if (plane)
+        pthread_rwlock_unlock(&plane->lock);
+    int n = snprintf(frame->prompt, PROMPT_SIZE, "[%.1f] (%s) > ", last_time, status);
+    frame->prompt_length = (n < 0) ? 0 : (n < PROMPT_SIZE ? n : PROMPT_SIZE - 1);
 }
 
-// Removes all parents from a cell and the cell from every parent's children.
-void remove_all_parents(Spreadsheet *sheet, short row, short col){
-    int key = encode_cell_key(row, col, sheet->cols);
-    Cell* child = get_cell_check(sheet, key);
-    if(child->formula==-1){
-        return;
-    }
-    short rem = (short)(child->formula%10);
-    if(child->formula<=9 && child->formula>=5){
-        Range range;
-        range.start_row = child->cell1/sheet->cols;
-        range.start_col = child->cell1%sheet->cols;
-        range.end_row = child->cell2/sheet->cols;
-        range.end_col = child->cell2%sheet->cols;
-        for(int r=range.start_row; r<=range.end_row; r++){
-            for(int c=range.start_col; c<=range.end_col; c++){
-                Cell* ref_cell = get_cell(sheet, r, c);
-                remove_child(ref_cell, key);
-            }
+// Formats frame for the terminal into out, which must hold FRAME_BUFFER_SIZE
+// bytes, and returns the length. With a differential screen the viewport
+// stays in place at the top of the terminal and only changed spans are
+// rewritten; otherwise the frame is printed in full.
+size_t format_frame(Screen* screen, const Frame* frame, char* out) {
+    char* p = out;
+    int count = frame->line_count;
+    if (!screen->differential) {
+        for (int line = 0; line < count; line++) {
+            memcpy(p, frame->lines[line], (size_t)frame->line_length[line]);
+            p += frame->line_length[line];
+            *p++ = '\n';
         }
-    }
-    else if(rem==0){
-        Cell* ref_cell1 = get_cell(sheet, child->cell1/sheet->cols, child->cell1%sheet->cols);
-        Cell* ref_cell2 = get_cell(sheet, child->cell2/sheet->cols, child->cell2%sheet->cols);
-        remove_child(ref_cell1, key);
-        remove_child(ref_cell2, key);
-    }
-    else if(rem==2){
-        Cell* ref_cell1 = get_cell(sheet, child->cell1/sheet->cols, child->cell1%sheet->cols);
-        remove_child(ref_cell1, key);
-    }
-    else if(rem==3){
-        Cell* ref_cell2 = get_cell(sheet, child->cell2/sheet->cols, child->cell2%sheet->cols);
-        remove_child(ref_cell2, key);
-    }
+    } else {
+        if (!screen->valid) {
+            memcpy(p, "\x1b[H\x1b[2J", 7);
+            p += 7;
+            screen->line_count = 0;
+            screen->valid = true;
+        }
+        for (int line = 0; line < count; line++)
+            p = diff_line(p, screen, line, frame->lines[line], frame->line_length[line]);
+        screen->line_count = count;
+        // The prompt goes right below the viewport; clearing from there
+        // removes the echoed command and any lines of a taller frame.
+        p = move_cursor(p, count + 1, 1);
+        memcpy(p, "\x1b[J", 3);
+        p += 3;
+    }
+    memcpy(p, frame->prompt, (size_t)frame->prompt_length);
+    p += frame->prompt_length;
+    return (size_t)(p - out);
 }
 
-void add_children(Spreadsheet* sheet, int cell1, int cell2, short formula, short row, short col){
-    short rem = (int)(formula%10);
-    if(formula==-1)
-        return;
-    if(rem==0){
-        Cell* ref_cell1 = get_cell_check(sheet, cell1);
-        Cell* ref_cell2 = get_cell_check(sheet, cell2);
-        add_child(ref_cell1, row, col, sheet->cols);
-        add_child(ref_cell2, row, col, sheet->cols);
-    }
-    else if(rem==2){
-        Cell* ref_cell1 = get_cell_check(sheet, cell1);
-        add_child(ref_cell1, row, col, sheet->cols);
-    }
-    else if(rem==3){
-        Cell* ref_cell2 = get_cell_check(sheet, cell2);
-        add_child(ref_cell2, row, col, sheet->cols);
-    }
-    else if(formula>=5 && formula<=9){
-        Range range;
-        range.start_row = cell1/sheet->cols;
-        range.start_col = cell1%sheet->cols;
-        range.end_row = cell2/sheet->cols;
-        range.end_col = cell2%sheet->cols;
-        for(int r=range.start_row; r<=range.end_row; r++){
-            for(int c=range.start_col; c<=range.end_col; c++){
-                Cell* ref_cell = get_cell(sheet, r, c);
-                add_child(ref_cell, row, col, sheet->cols);
-            }
+/* ---------- Output Writer ---------- */
+// A thread that owns stdout. Stream output (the change feed) goes through a
+// byte ring: nothing is lost and producers block while it is full. Frames go
+// through a one-frame slot: with drop_frames set a newer frame replaces one
+// the writer has not picked up yet, otherwise the producer waits for the
+// slot. The writer diffs against the frame it last wrote, so dropping frames
+// never desynchronises a differential screen. If the thread cannot be
+// started everything is written synchronously.
+typedef struct {
+    int fd;
+    bool running;
+    bool stop;
+    bool drop_frames;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // signalled to the writer: data, frame or stop
+    pthread_cond_t space;       // signalled to producers: ring space or free slot
+    char* ring;
+    size_t ring_head;           // total bytes produced
+    size_t ring_tail;           // total bytes written
+    Frame frames[2];            // the slot and the frame being written
+    Frame* pending;
+    bool has_frame;
+    unsigned long dropped_frames;
+    Screen screen;              // touched only by whoever formats frames
+    char out[FRAME_BUFFER_SIZE];
+} OutputWriter;
+
+static void* writer_main(void* arg) {
+    OutputWriter* w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->ring_head == w->ring_tail && !w->has_frame && !w->stop)
+            pthread_cond_wait(&w->ready, &w->lock);
+        if (w->ring_head != w->ring_tail) {
+            // Write the contiguous part of the ring without holding the lock;
+            // producers only append beyond ring_head.
+            size_t offset = w->ring_tail % OUTPUT_RING_SIZE;
+            size_t len = w->ring_head - w->ring_tail;
+            if (len > OUTPUT_RING_SIZE - offset)
+                len = OUTPUT_RING_SIZE - offset;
+            pthread_mutex_unlock(&w->lock);
+            write_all(w->fd, w->ring + offset, len);
+            pthread_mutex_lock(&w->lock);
+            w->ring_tail += len;
+            pthread_cond_broadcast(&w->space);
+        } else if (w->has_frame) {
+            Frame* frame = w->pending;
+            w->pending = (frame == &w->frames[0]) ? &w->frames[1] : &w->frames[0];
+            w->has_frame = false;
+            pthread_cond_broadcast(&w->space);
+            pthread_mutex_unlock(&w->lock);
+            write_all(w->fd, w->out, format_frame(&w->screen, frame, w->out));
+            pthread_mutex_lock(&w->lock);
+        } else {
+            break;      // stopped and drained
         }
     }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
 }
 
-// Recursively collects all keys from an AVL tree in-order into a dynamic array.
-// keys: pointer to an int* (array of keys)
-// count: current count of keys
-// capacity: current capacity of the array
-// Helper: recursively collects keys from an AVL tree.
-static void avl_collect_keys(AVLTree root, int **keys, int *count, int *capacity) {
-    if (root==NULL)
+void writer_start(OutputWriter* w, int fd, bool drop_frames) {
+    w->fd = fd;
+    w->stop = false;
+    w->drop_frames = drop_frames;
+    w->ring_head = w->ring_tail = 0;
+    w->pending = &w->frames[0];
+    w->has_frame = false;
+    w->dropped_frames = 0;
+    screen_init(&w->screen);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->ready, NULL);
+    pthread_cond_init(&w->space, NULL);
+    w->ring = malloc(OUTPUT_RING_SIZE);
+    w->running = w->ring && pthread_create(&w->thread, NULL, writer_main, w) == 0;
+}
+
+// Queues len bytes of stream output, blocking while the ring is full.
+void writer_write(OutputWriter* w, const char* data, size_t len) {
+    if (!w->running) {
+        write_all(w->fd, data, len);
         return;
-    avl_collect_keys(root->left, keys, count, capacity);
-    if (*count >= *capacity) {
-        *capacity *= 2;
-        *keys = realloc(*keys, (*capacity) * sizeof(int));
     }
-    (*keys)[(*count)++] = root->key;
-    avl_collect_keys(root->right, keys, count, capacity);
+    pthread_mutex_lock(&w->lock);
+    while (len > 0) {
+        while (w->ring_head - w->ring_tail == OUTPUT_RING_SIZE)
+            pthread_cond_wait(&w->space, &w->lock);
+        size_t offset = w->ring_head % OUTPUT_RING_SIZE;
+        size_t n = OUTPUT_RING_SIZE - (w->ring_head - w->ring_tail);
+        if (n > OUTPUT_RING_SIZE - offset)
+            n = OUTPUT_RING_SIZE - offset;
+        if (n > len)
+            n = len;
+        memcpy(w->ring + offset, data, n);
+        w->ring_head += n;
+        data += n;
+        len -= n;
+        pthread_cond_signal(&w->ready);
+    }
+    pthread_mutex_unlock(&w->lock);
 }
 
-// Revised reevaluate_topologically using in-degree (Kahn’s algorithm) and encoded keys.
-// Prototype: void reevaluate_topologically(Spreadsheet* sheet, short modRow, short modCol)
-void reevaluate_topologically(Spreadsheet* sheet, short modRow, short modCol, double* sleep_time) {
-    int total_cells = sheet->rows * sheet->cols;
-    
-    // Allocate a visited array (one bool per cell) indexed by key.
-    bool *visited = calloc(total_cells, sizeof(bool));
-    if (!visited) {
-        fprintf(stderr, "Failed to allocate visited array\n");
+// Hands a frame to the writer, replacing or waiting for an unwritten one.
+void writer_publish_frame(OutputWriter* w, const Frame* frame) {
+    if (!w->running) {
+        write_all(w->fd, w->out, format_frame(&w->screen, frame, w->out));
         return;
     }
-    
-    // Allocate a DFS stack (storing int keys) for affected cells.
-    int *stack = malloc(total_cells * sizeof(int));
-    if (!stack) { free(visited); return; }
-    int stackTop = 0;
-    
-    // Instead of starting from the modified cell itself,
-    // we retrieve the modified cell’s children and push them onto the stack.
-    Cell* modCell = get_cell(sheet, modRow, modCol);
-    
-    // Get children keys from modCell’s AVL tree.
-    int capacity = 8, count = 0;
-    int *childKeys = malloc(capacity * sizeof(int));
-    if (childKeys) {
-        avl_collect_keys(modCell->children, &childKeys, &count, &capacity);
-        for (int i = 0; i < count; i++) {
-            int childKey = childKeys[i];
-            if (childKey >= 0 && childKey < total_cells && !visited[childKey])
-                stack[stackTop++] = childKey;
+    pthread_mutex_lock(&w->lock);
+    if (w->has_frame) {
+        if (w->drop_frames) {
+            w->dropped_frames++;
+        } else {
+            while (w->has_frame)
+                pthread_cond_wait(&w->space, &w->lock);
         }
-        free(childKeys);
     }
-    
-    // Allocate an array to hold affected cell keys.
-    int *affected = malloc(total_cells * sizeof(int));
-    if (!affected) { free(stack); free(visited); return; }
-    int affectedCount = 0;
-    
-    // DFS: collect all affected (descendant) cell keys.
-    while (stackTop > 0) {
-        int curKey = stack[--stackTop];
-        // Ensure key is valid.
-        if (curKey < 0 || curKey >= total_cells)
-            continue;
-        if (!visited[curKey]) {
-            visited[curKey] = true;
-            affected[affectedCount++] = curKey;
-            short curRow = curKey / sheet->cols;
-            short curCol = curKey % sheet->cols;
-            Cell* curCell = get_cell(sheet, curRow, curCol);
-            // Traverse children stored in the AVL tree.
-            int *childKeys = malloc(8 * sizeof(int));
-            if (!childKeys) continue;  // If allocation fails, skip this cell.
-            int childCount = 0, childCapacity = 8;
-            avl_collect_keys(curCell->children, &childKeys, &childCount, &childCapacity);
-            for (int i = 0; i < childCount; i++){
-                int childKey = childKeys[i];
-                if (childKey >= 0 && childKey < total_cells && !visited[childKey])
-                    stack[stackTop++] = childKey;
-            }
-            free(childKeys);
+    memcpy(w->pending, frame, sizeof(Frame));
+    w->has_frame = true;
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Writes out everything queued and stops the thread.
+void writer_stop(OutputWriter* w) {
+    if (w->running) {
+        pthread_mutex_lock(&w->lock);
+        w->stop = true;
+        pthread_cond_signal(&w->ready);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        w->running = false;
+    }
+    pthread_cond_destroy(&w->ready);
+    pthread_cond_destroy(&w->space);
+    pthread_mutex_destroy(&w->lock);
+    free(w->ring);
+}
+
+/* ---------- Headless Script Runner ---------- */
+static inline long long elapsed_ns(const struct timespec* start, const struct timespec* end) {
+    return (long long)(end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+static int compare_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile over an ascending array of latencies.
+static long long percentile(const long long* sorted, int count, int pct) {
+    int rank = (int)(((long long)pct * count + 99) / 100);
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+// Runs every command of a script file without prompts or rendering and prints
+// a latency / status summary at the end. The file is mapped read-only and each
+// line is copied into a stack buffer for handle_command. SLEEP durations are
+// summed and reported but not slept, so runs are reproducible.
+int run_script(Spreadsheet* sheet, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    const char* data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return 1;
         }
+        madvise((void*)data, size, MADV_SEQUENTIAL);
     }
-    free(stack);
-    
-    // Build a lookup table mapping each cell key to its index in the affected array.
-    int *lookup = malloc(total_cells * sizeof(int));
-    if (!lookup) { free(affected); free(visited); return; }
-    for (int i = 0; i < total_cells; i++)
-        lookup[i] = -1;
-    for (int i = 0; i < affectedCount; i++) {
-        lookup[affected[i]] = i;
+    close(fd);
+
+    int capacity = 1024, count = 0;
+    long long* latencies = malloc(capacity * sizeof(long long));
+    if (!latencies) {
+        if (data) munmap((void*)data, size);
+        return 1;
     }
-    
-    // Compute in-degree for each affected cell.
-    int *inDegree = calloc(affectedCount, sizeof(int));
-    if (!inDegree) { free(lookup); free(affected); free(visited); return; }
-    for (int i = 0; i < affectedCount; i++) {
-        int key = affected[i];
-        short r = (short)(key / sheet->cols);
-        short c = (short)(key % sheet->cols);
-        Cell* cell = get_cell(sheet, r, c);
-        // For arithmetic formulas (codes 1-4), check dependencies stored in cell->cell1 and cell->cell2.
-        short rem = cell->formula % 10;
-        if (rem == 0) {
-            if (lookup[cell->cell1] != -1)
-                inDegree[i]++;
-            if (lookup[cell->cell2] != -1)
-                inDegree[i]++;
-        } else if (rem == 2) {
-            if (lookup[cell->cell1] != -1)
-                inDegree[i]++;
-        } else if (rem == 3) {
-            if (lookup[cell->cell2] != -1)
-                inDegree[i]++;
+    int status_counts[CMD_STATUS_COUNT] = {0};
+    double total_sleep = 0.0;
+    char input[INPUT_SIZE];
+    struct timespec run_start, run_end, start, end;
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+
+    size_t pos = 0;
+    while (pos < size) {
+        const char* line = data + pos;
+        const char* nl = memchr(line, '\n', size - pos);
+        size_t len = nl ? (size_t)(nl - line) : size - pos;
+        pos += len + 1;
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+        if (len == 0)
+            continue;
+
+        CommandStatus status;
+        double sleep_time = 0.0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (len >= sizeof(input)) {
+            // The interactive loop cannot accept such a line either.
+            status = CMD_UNRECOGNIZED;
+        } else {
+            memcpy(input, line, len);
+            input[len] = '\0';
+            if (strcmp(input, "q") == 0)
+                break;
+            status = handle_command(sheet, input, &sleep_time);
         }
-        // For range formulas (codes 5-9), iterate over the range.
-        else if (cell->formula >= 5 && cell->formula <= 9) {
-            short startRow = cell->cell1 / sheet->cols;
-            short startCol = cell->cell1 % sheet->cols;
-            short endRow   = cell->cell2 / sheet->cols;
-            short endCol   = cell->cell2 % sheet->cols;
-            for (short rr = startRow; rr <= endRow; rr++) {
-                for (short cc = startCol; cc <= endCol; cc++) {
-                    int parentKey = (int)(rr * sheet->cols + cc);
-                    if (lookup[parentKey] != -1)
-                        inDegree[i]++;
-                }
-            }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (count == capacity) {
+            capacity *= 2;
+            long long* grown = realloc(latencies, capacity * sizeof(long long));
+            if (!grown) break;
+            latencies = grown;
         }
+        latencies[count++] = elapsed_ns(&start, &end);
+        status_counts[status]++;
+        total_sleep += sleep_time;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &run_end);
+    if (data) munmap((void*)data, size);
+
+    double wall_ms = elapsed_ns(&run_start, &run_end) / 1e6;
+    long long busy = 0;
+    for (int i = 0; i < count; i++)
+        busy += latencies[i];
+    qsort(latencies, count, sizeof(long long), compare_ll);
+
+    printf("commands: %d\n", count);
+    printf("wall time: %.3f ms (%.3f ms in handle_command)\n", wall_ms, busy / 1e6);
+    if (count > 0) {
+        printf("latency us: mean %.2f  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+               busy / 1e3 / count,
+               percentile(latencies, count, 50) / 1e3,
+               percentile(latencies, count, 90) / 1e3,
+               percentile(latencies, count, 99) / 1e3,
+               latencies[count - 1] / 1e3);
+    }
+    if (total_sleep > 0)
+        printf("sleep requested: %.1f s (skipped)\n", total_sleep);
+    for (int i = 0; i < CMD_STATUS_COUNT; i++)
+        printf("%s: %d\n", status_message((CommandStatus)i), status_counts[i]);
+    free(latencies);
+    return 0;
+}
+
+/* ---------- Evaluation Microbenchmark ---------- */
+// Fills the first ten columns with a mix of every formula kind, then times
+// reevaluate_formula per formula code and over the whole mix.
+int run_eval_benchmark(Spreadsheet* sheet) {
+    if (sheet->cols < 10) {
+        fprintf(stderr, "--bench-eval needs at least 10 columns\n");
+        return 1;
     }
-    
-    // Prepare queue for Kahn's algorithm.
-    int *queue = malloc(affectedCount * sizeof(int));
-    if (!queue) { free(inDegree); free(lookup); free(affected); free(visited); return; }
-    int qFront = 0, qRear = 0;
-    for (int i = 0; i < affectedCount; i++) {
-        if (inDegree[i] == 0)
-            queue[qRear++] = affected[i];
-    }
-    
-    // Process cells in topological order.
-    while (qFront < qRear) {
-        int curKey = queue[qFront++];
-        short r = curKey / sheet->cols;
-        short c = curKey % sheet->cols;
-        Cell* curCell = get_cell(sheet, r, c);
-        reevaluate_formula(sheet, curCell, sleep_time);
-        // For every affected cell, if it depends on curKey, decrement its in-degree.
-        for (int i = 0; i < affectedCount; i++) {
-            int key = affected[i];
-            Cell* cell = get_cell(sheet, key / sheet->cols, key % sheet->cols);
-            bool depends = false;
-            short rem = cell->formula % 10;
-            if (rem == 0) {
-                if (cell->cell1 == curKey || cell->cell2 == curKey)
-                    depends = true;
-            } else if (rem == 2) {
-                if (cell->cell1 == curKey)
-                    depends = true;
-            } else if (rem == 3) {
-                if (cell->cell2 == curKey)
-                    depends = true;
-            }
-            else if (cell->formula >= 5 && cell->formula <= 9) {
-                short startRow = cell->cell1 / sheet->cols;
-                short startCol = cell->cell1 % sheet->cols;
-                short endRow   = cell->cell2 / sheet->cols;
-                short endCol   = cell->cell2 % sheet->cols;
-                if (r >= startRow && r <= endRow && c >= startCol && c <= endCol)
-                    depends = true;
-            }
-            if (depends) {
-                inDegree[i]--;
-                if (inDegree[i] == 0)
-                    queue[qRear++] = affected[i];
-            }
+    static const char* layout[10] = {
+        "A%d=%d", "B%d=A%d*2", "C%d=A%d+B%d", "D%d=7-C%d", "E%d=C%d/B%d", "F%d=A%d",
+        "G%d=MAX(A%d:E%d)", "H%d=SUM(A%d:A%d)", "I%d=(A%d+B%d)*C%d-D%d/2", "J%d=STDEV(A%d:E%d)"
+    };
+    char input[INPUT_SIZE];
+    double sleep_time = 0.0;
+    for (int r = 1; r <= sheet->rows; r++) {
+        for (int c = 0; c < 10; c++) {
+            if (c == 7)
+                snprintf(input, sizeof(input), layout[c], r, r > 10 ? r - 9 : 1, r);
+            else
+                snprintf(input, sizeof(input), layout[c], r, r, r, r, r);
+            handle_command(sheet, input, &sleep_time);
         }
     }
 
-    free(queue);
-    free(inDegree);
-    free(lookup);
-    free(affected);
-    free(visited);
+    // Group the formula cells by code.
+    int total = sheet->rows * 10;
+    int* keys = malloc(total * sizeof(int));
+    int* order = malloc(total * sizeof(int));
+    if (!keys || !order) { free(keys); free(order); return 1; }
+    int formula_count = 0;
+    for (int r = 0; r < sheet->rows; r++)
+        for (int c = 0; c < 10; c++)
+            if (get_cell(sheet, r, c)->formula != -1)
+                order[formula_count++] = encode_cell_key(r, c, sheet->cols);
+
+    struct timespec start, end;
+    printf("formula   cells   Mevals/s\n");
+    for (int c = 1; c < 10; c++) {
+        int count = 0;
+        for (int r = 0; r < sheet->rows; r++)
+            keys[count++] = encode_cell_key(r, c, sheet->cols);
+        int passes = 2000000 / count + 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int p = 0; p < passes; p++)
+            for (int i = 0; i < count; i++)
+                reevaluate_formula(sheet, get_cell_check(sheet, keys[i]), &sleep_time);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%-8d %6d %10.2f\n", get_cell_check(sheet, keys[0])->formula, count,
+               (double)passes * count / elapsed_ns(&start, &end) * 1e3);
+    }
+    int passes = 5000000 / formula_count + 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int p = 0; p < passes; p++)
+        for (int i = 0; i < formula_count; i++)
+            reevaluate_formula(sheet, get_cell_check(sheet, order[i]), &sleep_time);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("mixed    %6d %10.2f\n", formula_count,
+           (double)passes * formula_count / elapsed_ns(&start, &end) * 1e3);
+    free(keys);
+    free(order);
+    return 0;
 }
 
-bool detect_cycle_range(Spreadsheet *sheet, short rStart, short cStart, short rEnd, short cEnd, short tRow, short tCol) {
-    int totalCells = (int)(sheet->rows * sheet->cols);
-    // Encode the target cell (the one being updated).
-    int targetKey = encode_cell_key(tRow, tCol, sheet->cols);
-    // Allocate a DFS stack (an array of cell keys); worst-case, every cell of the sheet.
-    int *stack = malloc(totalCells * sizeof(int));
-    if (!stack) {
-        return false;
-    }
-    int stackTop = 0;
-    stack[stackTop++] = targetKey;  // Start from the target cell.
-    bool cycleFound = false;
-    // Process the DFS stack.
-    while (stackTop > 0) {
-        int curKey = stack[--stackTop];
-        // Compute row and column of the current cell.
-        short curRow = (short)(curKey / sheet->cols);
-        short curCol = (short)(curKey % sheet->cols);
-        if(curRow <= rEnd && curRow >= rStart && curCol <= cEnd && curCol >= cStart){
-            return true;
+/* ---------- Change Feed ---------- */
+// Instead of frames, feed mode writes what each command changed. Text
+// records are "<cell> <value>" or "<cell> ERR" lines closed by a
+// "> <status>" line. Binary records are a FeedHeader followed by count
+// FeedRecords, packed and in host byte order.
+typedef enum {
+    FEED_TEXT,
+    FEED_BINARY
+} FeedFormat;
+
+typedef struct __attribute__((packed)) {
+    uint32_t count;     // records that follow
+    uint8_t status;     // CommandStatus
+} FeedHeader;
+
+typedef struct __attribute__((packed)) {
+    uint16_t row;       // 0-based
+    uint16_t col;
+    int32_t value;      // meaningless when error is set
+    uint8_t error;
+} FeedRecord;
+
+#define FEED_BUFFER_SIZE 65536
+
+// Writes the drained change list of one command through buf, which holds
+// FEED_BUFFER_SIZE bytes and is handed to the writer whenever it runs low.
+static void emit_changes(Spreadsheet* sheet, OutputWriter* writer, FeedFormat format, CommandStatus status, char* buf) {
+    char* p = buf;
+    if (format == FEED_BINARY) {
+        FeedHeader header = { (uint32_t)sheet->change_count, (uint8_t)status };
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+    }
+    for (int i = 0; i < sheet->change_count; i++) {
+        if (FEED_BUFFER_SIZE - (p - buf) < 64) {
+            writer_write(writer, buf, (size_t)(p - buf));
+            p = buf;
         }
-        // Get the current cell.
-        Cell* curCell = get_cell_check(sheet, curKey);
-
-        // Retrieve child dependency keys from the cell's AVL tree.
-        int capacity = 8, count = 0;
-        int *childKeys = malloc(capacity * sizeof(int));
-        if (childKeys) {
-            avl_collect_keys(curCell->children, &childKeys, &count, &capacity);
-            for (int i = 0; i < count; i++) {
-                int childKey = childKeys[i];
-                stack[stackTop++] = childKey;
-            }
-            free(childKeys);
+        const Cell* cell = &sheet->grid[sheet->changes[i]];
+        short row, col;
+        get_row_col(sheet->changes[i], &row, &col, sheet->cols);
+        if (format == FEED_BINARY) {
+            FeedRecord record = { (uint16_t)row, (uint16_t)col, cell->value, cell->error_state };
+            memcpy(p, &record, sizeof(record));
+            p += sizeof(record);
+            continue;
         }
+        get_column_name(col + 1, p);
+        p += strlen(p);
+        p = format_int(p, row + 1, 0);
+        *p++ = ' ';
+        if (cell->error_state) {
+            memcpy(p, "ERR", 3);
+            p += 3;
+        } else {
+            p = format_int(p, cell->value, 0);
+        }
+        *p++ = '\n';
     }
-    free(stack);
-    return cycleFound;
+    if (format == FEED_TEXT)
+        p += sprintf(p, "> %s\n", status_message(status));
+    writer_write(writer, buf, (size_t)(p - buf));
+    sheet->change_count = 0;
 }
 
-static int detect_cycle_helper(Spreadsheet *sheet, int currentKey, int sourceKey, short *visited) {
-    // If we've reached the source cell, a cycle exists.
-    if (currentKey == sourceKey)
-        return 1;
-    
-    // If this cell is already in the recursion stack, cycle detected.
-    if (visited[currentKey] == 1)
+// Reads commands from stdin like the REPL, sleeping the same way, and emits
+// each command's changes instead of a frame.
+int run_feed(Spreadsheet* sheet, FeedFormat format) {
+    char* buf = malloc(FEED_BUFFER_SIZE);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate feed buffer\n");
         return 1;
-
-    // If already completely processed, no cycle from this node.
-    if (visited[currentKey] == 2)
-        return 0;
-    
-    // Mark this cell as “being processed.”
-    visited[currentKey] = 1;
-    
-    bool cycleFound = 0;
-    Cell *cell = get_cell_check(sheet, currentKey);
-    
-    // If this is a literal (no formula), there are no dependencies.
-    if (cell->formula == -1) {
-        visited[currentKey] = 2;
-        return 0;
     }
-    
-    int rem = cell->formula % 10;
-    
-    if (rem == 0) {
-        cycleFound = detect_cycle_helper(sheet, cell->cell1, sourceKey, visited);
-        if (!cycleFound)
-            cycleFound = detect_cycle_helper(sheet, cell->cell2, sourceKey, visited);
+    OutputWriter* writer = malloc(sizeof(OutputWriter));
+    if (!writer) {
+        free(buf);
+        fprintf(stderr, "Failed to allocate feed buffer\n");
+        return 1;
     }
-    else if (rem == 2) {
-        cycleFound = detect_cycle_helper(sheet, cell->cell1, sourceKey, visited);
+    writer_start(writer, STDOUT_FILENO, false);
+    char input[INPUT_SIZE];
+    double sleep_time = 0.0;
+    sheet->track_changes = true;
+    while (fgets(input, sizeof(input), stdin)) {
+        input[strcspn(input, "\n")] = 0;
+        if (strcmp(input, "q") == 0) break;
+        clock_t start = clock();
+        CommandStatus status = handle_command(sheet, input, &sleep_time);
+        double command_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (sleep_time > command_time)
+            sleep(sleep_time - command_time);
+        sleep_time = 0.0;
+        emit_changes(sheet, writer, format, status, buf);
     }
-    else if (rem == 3) {
-        cycleFound = detect_cycle_helper(sheet, cell->cell2, sourceKey, visited);
+    writer_stop(writer);
+    free(writer);
+    free(buf);
+    return 0;
+}
+
+// Runs batches from stdin until it ends, writing each reply to stdout.
+// SLEEP delays only the REPL's display, so nothing sleeps here.
+int run_binary(Spreadsheet* sheet) {
+    uint8_t* records = malloc(BINARY_BATCH_SIZE);
+    uint8_t* reply = malloc(BINARY_REPLY_SIZE);
+    if (!records || !reply) {
+        free(records);
+        free(reply);
+        fprintf(stderr, "Failed to allocate batch buffers\n");
+        return 1;
     }
-    // Handle range formulas (formula codes 5-9)
-    else if (cell->formula >= 5 && cell->formula <= 9) {
-        int cols = sheet->cols;
-        int startKey = cell->cell1, endKey = cell->cell2;
-        short startRow = (short)(startKey / cols), startCol = (short)(startKey % cols);
-        short endRow = (short)(endKey / cols), endCol = (short)(endKey % cols);
-        for (short r = startRow; r <= endRow && !cycleFound; r++) {
-            for (short c = startCol; c <= endCol && !cycleFound; c++) {
-                cycleFound = detect_cycle_helper(sheet, (int)(r*sheet->cols + c), sourceKey, visited);
-            }
+    BinaryBatch header;
+    int rc = 0;
+    while (fread(&header, sizeof(header), 1, stdin) == 1) {
+        if (!batch_valid(&header) || fread(records, 1, header.size, stdin) != header.size) {
+            fprintf(stderr, "Malformed binary batch\n");
+            rc = 1;
+            break;
+        }
+        size_t length = run_batch(sheet, records, &header, reply);
+        if (!write_all(STDOUT_FILENO, (const char*)reply, length)) {
+            rc = 1;
+            break;
         }
     }
-    
-    // Mark this cell as completely processed.
-    visited[currentKey] = 2;
-    return cycleFound;
+    free(records);
+    free(reply);
+    return rc;
 }
 
-bool detect_cycle_recursive(Spreadsheet *sheet, short srcRow, short srcCol, short targetRow, short targetCol) {
-    int totalCells = sheet->rows * sheet->cols;
-    int sourceKey = srcRow * sheet->cols + srcCol;
-    int targetKey = targetRow * sheet->cols + targetCol;
-    
-    // Allocate an array to track visited cells.
-    short *visited = (short *)calloc(totalCells, sizeof(short));
-    if (!visited) {
-        fprintf(stderr, "Failed to allocate visited array\n");
-        return false;
-    }
-    
-    bool cycle = detect_cycle_helper(sheet, sourceKey, targetKey, visited);
-    free(visited);
-    return cycle;
+/* ---------- Line Input ---------- */
+// Reads stdin in blocks so the REPL can tell whether a whole line is
+// already buffered before it blocks. Lines split as with fgets into
+// INPUT_SIZE bytes: at a newline or after INPUT_SIZE - 1 characters.
+typedef struct {
+    int fd;
+    bool eof;
+    size_t start;
+    size_t end;
+    char data[4096];
+} LineReader;
+
+static bool line_buffered(const LineReader* r) {
+    size_t n = r->end - r->start;
+    return r->eof || n >= INPUT_SIZE - 1 || memchr(r->data + r->start, '\n', n);
 }
 
-// get_column_name 
-char* get_column_name(int col) {
-    char* name = malloc(4);
-    int i = 0;
-    while (col > 0) {
-        name[i++] = 'A' + (col - 1) % 26;
-        col = (col - 1) / 26;
-    }
-    name[i] = '\0';
-    for (int j = 0; j < i / 2; j++) {
-        char temp = name[j];
-        name[j] = name[i - 1 - j];
-        name[i - 1 - j] = temp;
-    }
-    return name;
+// Reads whatever input is available into r, blocking until some is.
+static void fill_line(LineReader* r) {
+    if (r->start > 0) {
+        memmove(r->data, r->data + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    ssize_t n;
+    do
+        n = read(r->fd, r->data + r->end, sizeof(r->data) - r->end);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        r->eof = true;
+    else
+        r->end += (size_t)n;
 }
 
-int column_name_to_number(const char* name) {
-    int result = 0;
-    for (int i = 0; name[i] != '\0'; i++) {
-        result *= 26;
-        result += (toupper(name[i]) - 'A' + 1);
-    }
-    return result - 1;
+// Copies the next line, without its newline, into line (INPUT_SIZE bytes).
+// Returns false at the end of input.
+static bool read_line(LineReader* r, char* line) {
+    while (!line_buffered(r))
+        fill_line(r);
+    size_t n = r->end - r->start;
+    if (n == 0)
+        return false;
+    size_t limit = (n < INPUT_SIZE - 1) ? n : INPUT_SIZE - 1;
+    const char* nl = memchr(r->data + r->start, '\n', limit);
+    size_t len = nl ? (size_t)(nl - (r->data + r->start)) : limit;
+    memcpy(line, r->data + r->start, len);
+    line[len] = '\0';
+    r->start += len + (nl != NULL);
+    return true;
 }
 
-void parse_cell_reference(const char* cell, short* row, short* col) {
-    char col_name[4] = {0};
-    int i = 0;
-    while (cell[i] != '\0' && isupper(cell[i])) {
-        if (i >= 3) { *row = *col = -1; return; }
-        col_name[i] = cell[i];
-        i++;
-    }
-    if (cell[i] == '\0' || !isdigit(cell[i])) { *row = *col = -1; return; }
-    *col = (short)column_name_to_number(col_name);
-    *row = (short)(atoi(cell + i) - 1);
-    while (cell[i] != '\0') {
-        if (!isdigit(cell[i])) { *row = *col = -1; return; }
-        i++;
-    }
-}
+/* ---------- Socket Server ---------- */
+// --listen serves the command language on a Unix domain socket next to the
+// REPL, so several clients share one sheet. One thread runs an epoll loop
+// over the listening socket and every connection. Each line a client sends
+// is a request and gets one reply line, in order, however many requests it
+// pipelines: the status message, followed for get <cell> by the value or
+// ERR. q closes the connection, and binary switches it to binary batches.
+//
+// The loop answers get itself from the published values, so it never
+// waits for a command, however long its recalculation. Commands go to a
+// worker thread that runs them through handle_command holding the command
+// lock, one at a time with the REPL's. A connection has at most one command
+// with the worker and reads nothing further until it is answered, so its
+// requests still take effect in order. A batch of gets is answered from
+// the published values like get; any other batch goes to the worker as a
+// whole. SLEEP delays only the REPL's display, so the server does not sleep.
+#define SERVER_READ_SIZE BINARY_BATCH_SIZE   // holds a whole binary batch
+#define SERVER_OUTPUT_LIMIT (1 << 20)   // stop reading a client that does not read its replies
+
+typedef struct Connection {
+    int fd;
+    struct Connection* prev;
+    struct Connection* next;
+    bool closing;           // the client sent q or stopped sending
+    bool discarding;        // dropping the rest of an overlong line
+    bool busy;              // command is with the worker
+    bool binary;            // requests are binary batches
+    size_t in_length;
+    char* in;               // received requests not yet answered
+    char* out;              // replies not yet sent
+    size_t out_start;
+    size_t out_length;
+    size_t out_capacity;
+    uint32_t events;        // what epoll is waiting for
+    char command[INPUT_SIZE];
+    CommandStatus status;
+    uint8_t* batch;         // binary: the batch at the worker, with its header
+    uint8_t* reply;         // binary: the reply to a batch
+    size_t reply_length;
+    struct Connection* next_job;
+} Connection;
 
-// parse_range remains unchanged.
-CommandStatus parse_range(const char* range_str, Range* range) {
-    char* colon = strchr(range_str, ':');
-    if (!colon || colon == range_str || colon[1] == '\0')
-        return CMD_INVALID_RANGE;
-    char start_cell[20];
-    char end_cell[20];
-    strncpy(start_cell, range_str, colon - range_str);
-    start_cell[colon - range_str] = '\0';
-    strcpy(end_cell, colon + 1);
-    parse_cell_reference(start_cell, &range->start_row, &range->start_col);
-    if (range->start_row < 0 || range->start_col < 0)
-        return CMD_INVALID_CELL;
-    parse_cell_reference(end_cell, &range->end_row, &range->end_col);
-    if (range->end_row < 0 || range->end_col < 0)
-        return CMD_INVALID_CELL;
-    if (range->start_row > range->end_row || range->start_col > range->end_col)
-        return CMD_INVALID_RANGE;
-    return CMD_OK;
+typedef struct {
+    Spreadsheet* sheet;
+    pthread_mutex_t* lock;  // held around every command
+    char* path;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;            // eventfd: stop the loop
+    int done_fd;            // eventfd: the worker answered commands
+    Connection* connections;
+    pthread_t thread;
+    // Commands handed to the worker, and those it has answered.
+    pthread_t worker;
+    pthread_mutex_t jobs_lock;
+    pthread_cond_t jobs_ready;
+    Connection* jobs;
+    Connection* jobs_tail;
+    Connection* done;
+    bool stop;
+} Server;
+
+static bool connection_append(Connection* conn, const void* data, size_t len) {
+    if (conn->out_length + len > conn->out_capacity) {
+        size_t capacity = conn->out_capacity ? conn->out_capacity : 4096;
+        while (capacity < conn->out_length + len)
+            capacity *= 2;
+        char* grown = realloc(conn->out, capacity);
+        if (!grown)
+            return false;
+        conn->out = grown;
+        conn->out_capacity = capacity;
+    }
+    memcpy(conn->out + conn->out_length, data, len);
+    conn->out_length += len;
+    return true;
 }
 
-CommandStatus sum_value(Spreadsheet* sheet, Cell *cell){
-        int sum = 0;
-        short row1, col1, row2, col2;
-        get_row_col(cell->cell1, &row1, &col1, sheet->cols);
-        get_row_col(cell->cell2, &row2, &col2, sheet->cols);
-        for(int i=row1; i<=row2; i++){
-            for(int j=col1; j<=col2; j++){
-                Cell* ref_cell = get_cell_check(sheet, i*sheet->cols+j);
-                if(ref_cell->error_state){
-                    cell->error_state = 1;
-                    return CMD_OK;
-                }
-                sum += ref_cell->value;
-            }
-        }
-        cell->value = sum;
-        cell->error_state = 0;
-        return CMD_OK;
+static bool connection_reply(Connection* conn, const char* text) {
+    return connection_append(conn, text, strlen(text)) && connection_append(conn, "\n", 1);
 }
 
-CommandStatus variance(Spreadsheet* sheet, Cell *cell){
-    double variance = 0.0;
-    int count = 0;
-    short row1, col1, row2, col2;
-    get_row_col(cell->cell1, &row1, &col1, sheet->cols);
-    get_row_col(cell->cell2, &row2, &col2, sheet->cols);
-    count = (row2-row1+1)*(col2-col1+1);
-    sum_value(sheet, cell);
-    cell->value = cell->value / count;
-    for(int i=row1; i<=row2; i++){
-        for(int j=col1; j<=col2; j++){
-            Cell* ref_cell = get_cell_check(sheet, i*sheet->cols+j);
-            if(ref_cell->error_state){
-                cell->error_state = 1;
-                return CMD_OK;
-            }
-            variance += (ref_cell->value - cell->value) * (ref_cell->value - cell->value);
-        }
+static void* worker_main(void* arg) {
+    Server* server = arg;
+    pthread_mutex_lock(&server->jobs_lock);
+    for (;;) {
+        while (!server->jobs && !server->stop)
+            pthread_cond_wait(&server->jobs_ready, &server->jobs_lock);
+        if (!server->jobs)
+            break;
+        Connection* conn = server->jobs;
+        server->jobs = conn->next_job;
+        pthread_mutex_unlock(&server->jobs_lock);
+
+        double sleep_time = 0.0;
+        pthread_mutex_lock(server->lock);
+        if (conn->binary)
+            conn->reply_length = run_batch(server->sheet, conn->batch + sizeof(BinaryBatch),
+                                           (const BinaryBatch*)conn->batch, conn->reply);
+        else
+            conn->status = handle_command(server->sheet, conn->command, &sleep_time);
+        pthread_mutex_unlock(server->lock);
+
+        pthread_mutex_lock(&server->jobs_lock);
+        conn->next_job = server->done;
+        server->done = conn;
+        uint64_t one = 1;
+        write_all(server->done_fd, (const char*)&one, sizeof(one));
     }
-    variance /= count;
-    cell->value = (int)round(sqrt(variance));
-    cell->error_state = 0;
-    return CMD_OK;
+    pthread_mutex_unlock(&server->jobs_lock);
+    return NULL;
 }
 
-CommandStatus min_max(Spreadsheet* sheet, Cell* cell, bool is_min){
-    int max = INT_MIN;
-    int min = INT_MAX; 
-    short row1, col1, row2, col2;
-    get_row_col(cell->cell1, &row1, &col1, sheet->cols);
-    get_row_col(cell->cell2, &row2, &col2, sheet->cols);
-    for(int i=row1; i<=row2; i++){
-        for(int j=col1; j<=col2; j++){
-            Cell* ref_cell = get_cell(sheet, i, j);
-            if(ref_cell->error_state){
-                cell->error_state = 1;
-                return CMD_OK;
-            }
-            if(ref_cell->value>max){
-                max = ref_cell->value;
-            }
-            if(ref_cell->value<min){
-                min = ref_cell->value;
-            }
-        }
-    }
-    cell->value = is_min ? min : max;
-    cell->error_state = 0;
-    return CMD_OK;
+// Hands the connection's command, or its batch, to the worker.
+static void submit_command(Server* server, Connection* conn) {
+    conn->busy = true;
+    conn->next_job = NULL;
+    pthread_mutex_lock(&server->jobs_lock);
+    if (server->jobs)
+        server->jobs_tail->next_job = conn;
+    else
+        server->jobs = conn;
+    server->jobs_tail = conn;
+    pthread_cond_signal(&server->jobs_ready);
+    pthread_mutex_unlock(&server->jobs_lock);
 }
 
-// For Cell references only (opcode 102)
-CommandStatus sleep_prog(Spreadsheet* sheet, Cell *current, double* sleep_time){
-    Cell* ref_cell = get_cell_check(sheet, current->cell1);
-    current->value = ref_cell->value;
-    if (ref_cell->error_state){
-        current->error_state = true;
-        return CMD_OK;
-    }
-    if(ref_cell->value < 0){
-        return CMD_OK;
+static void serve_get(Server* server, Connection* conn, const char* cell) {
+    ValuePlane* plane = server->sheet->plane;
+    char reply[PROMPT_SIZE];
+    short row, col;
+    const char* end = scan_cell(cell, &row, &col);
+    pthread_rwlock_rdlock(&plane->lock);
+    if (!end || *end != '\0' || row < 0 || row >= plane->rows || col < 0 || col >= plane->cols) {
+        snprintf(reply, sizeof(reply), "%s", status_message(CMD_INVALID_CELL));
+    } else {
+        int value;
+        bool error;
+        unsigned sequence;
+        do {
+            sequence = read_begin(plane);
+            value = shown_value(plane, row * plane->cols + col, &error);
+        } while (read_retry(plane, sequence));
+        if (error)
+            snprintf(reply, sizeof(reply), "%s ERR", status_message(CMD_OK));
+        else
+            snprintf(reply, sizeof(reply), "%s %d", status_message(CMD_OK), value);
     }
-    current->error_state = 0;
-    *sleep_time = +current->value;
-    return CMD_OK;
+    pthread_rwlock_unlock(&plane->lock);
+    if (!connection_reply(conn, reply))
+        conn->closing = true;
 }
 
-CommandStatus handle_sleep(Spreadsheet* sheet, short row, short col, const char* expr, double* sleep_time) {
-    size_t len = strlen(expr);
-    // Must be at least "SLEEP(x)" (7 characters)
-    if (len < 7 || len > 18){
-        return CMD_UNRECOGNIZED;
-    }
-    // Verify the expression starts with "SLEEP(" and ends with ")"
-    if (expr[len - 1] != ')'){
-        return CMD_UNRECOGNIZED;
-    }
+// Switches the connection to binary batches once "ok" is sent.
+static void start_binary(Connection* conn) {
+    conn->batch = malloc(BINARY_BATCH_SIZE);
+    conn->reply = malloc(BINARY_REPLY_SIZE);
+    if (!conn->batch || !conn->reply || !connection_reply(conn, status_message(CMD_OK)))
+        conn->closing = true;
+    conn->binary = true;
+}
 
-    // Remove "SLEEP(" from the beginning and ")" from the end
-    char* sleep_arg = malloc(strlen(expr) - 6);
-    strncpy(sleep_arg, expr + 6, strlen(expr) - 7);
-    sleep_arg[strlen(expr) - 7] = '\0';
-
-    int value = 0;
-    Cell* current = get_cell(sheet, row, col);
-
-    // If the inner argument begins with an alphabetic character, treat it as a cell reference.
-    if (isalpha((unsigned char)sleep_arg[0])) {
-        short ref_row, ref_col;
-        parse_cell_reference(sleep_arg, &ref_row, &ref_col);
-        free(sleep_arg);
-        if (ref_row < 0 || ref_row >= sheet->rows || ref_col < 0 || ref_col >= sheet->cols)
-            return CMD_INVALID_CELL;
-        
-        // Store the reference in the cell1 field.
-        int cell1 = current->cell1 = encode_cell_key(ref_row, ref_col, sheet->cols);
-        int cell2 = current->cell2;
-        short old_formula = current->formula;
-
-        // Remove any existing dependency links.
-        remove_all_parents(sheet, row, col);
-        Cell* ref_cell = get_cell(sheet, ref_row, ref_col);
-        // Establish dependency: add current cell as a child of the referenced cell.
-        add_child(ref_cell, row, col, sheet->cols);
-        // Update current cell's cell1 field to store the reference.
-        current->cell1 = encode_cell_key(ref_row, ref_col, sheet->cols);
-        current->formula = 102;
-        
-        // *** CYCLE DETECTION ***
-        if (detect_cycle_recursive(sheet, ref_row, ref_col, row, col)){
-            // Restore the previous state and return a circular reference error.
-            current->formula = old_formula;
-            current->cell1 = cell1;
-            current->cell2 = cell2;
-            add_children(sheet, cell1, cell2, old_formula, row, col);
-            return CMD_CIRCULAR_REF;
+// Answers the binary batch at pos, or hands it to the worker, and moves pos
+// past it. Returns false if the batch is not all there yet.
+static bool serve_batch(Server* server, Connection* conn, size_t* pos) {
+    BinaryBatch header;
+    size_t available = conn->in_length - *pos;
+    if (available < sizeof(header))
+        return false;
+    memcpy(&header, conn->in + *pos, sizeof(header));
+    if (!batch_valid(&header)) {
+        conn->closing = true;
+        return false;
+    }
+    size_t size = sizeof(header) + header.size;
+    if (available < size)
+        return false;
+    const uint8_t* records = (const uint8_t*)conn->in + *pos + sizeof(header);
+    if (batch_reads_only(records, &header)) {
+        size_t length = read_batch(server->sheet, records, &header, conn->reply);
+        if (!connection_append(conn, conn->reply, length)) {
+            conn->closing = true;
+            return false;
         }
-        value = ref_cell->value;
-        sleep_prog(sheet, current, sleep_time);
     } else {
-        // Use strtol() to strictly parse a numeric argument.
-        char* endptr;
-        long num = strtol(sleep_arg, &endptr, 10);
-        // If any non-numeric characters remain, return an error.
-        if (*endptr != '\0') {
-            free(sleep_arg);
-            return CMD_UNRECOGNIZED;
-        }
-        free(sleep_arg);
-        value = (int)num;
-        remove_all_parents(sheet, row, col);
-        current->formula = -1;
-        *sleep_time += value;
+        memcpy(conn->batch, conn->in + *pos, size);
+        submit_command(server, conn);
     }
-    current->value = value;
-    return CMD_OK;
+    *pos += size;
+    return true;
 }
 
-/* ---------- (Stub) Reevaluate Formula ---------- */
-CommandStatus reevaluate_formula(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
-    short msb = cell->formula/10;
-    short rem = cell->formula%10;
-    CommandStatus status = CMD_OK;
-    if (cell->formula==-1) 
-        return status;   
-    // Both are cell references
-    if (rem==0){
-        Cell* ref_cell1 = get_cell_check(sheet, cell->cell1);
-        Cell* ref_cell2 = get_cell_check(sheet, cell->cell2);
-        if(ref_cell1->error_state || ref_cell2->error_state){
-            cell->error_state = 1;
-            return CMD_OK;
-        }
-        if(msb==1){
-            cell->value = ref_cell1->value + ref_cell2->value;
-        }
-        else if(msb==2){
-            cell->value = ref_cell1->value - ref_cell2->value;
-        }
-        else if(msb==3){
-            if(ref_cell2->value==0){
-                cell->error_state = 1;
-                return CMD_OK;
-            }
-            cell->value = ref_cell1->value / ref_cell2->value;
-        }
-        else if(msb==4){
-            cell->value = ref_cell1->value * ref_cell2->value;
-        }
-        cell->error_state = 0;
-    }
-    // Single cell and custom value
-    else if (rem==2){
-        Cell* ref_cell1 = get_cell_check(sheet, cell->cell1);
-        if(ref_cell1->error_state){
-            cell->error_state = 1;
-            return CMD_OK;
-        }
-        if(msb==1){
-            cell->value = ref_cell1->value + cell->cell2;
-        }
-        else if(msb==2){
-            cell->value = ref_cell1->value - cell->cell2;
-        }
-        else if(msb==3){
-            if(cell->cell2==0){
-                cell->error_state = 1;
-                return CMD_OK;
-            }
-            cell->value = ref_cell1->value / cell->cell2;
-        }
-        else if(msb==4){
-            cell->value = ref_cell1->value * cell->cell2;
-        }
-        else if (msb==8){
-            cell->value = ref_cell1->value;
-        }
-        else{
-            status=sleep_prog(sheet, cell, sleep_time);
-        }
-        cell->error_state = 0;
-    }
-    // Custom value and single cell
-    else if (rem==3){
-        Cell* ref_cell2 = get_cell_check(sheet, cell->cell2);
-        if(ref_cell2->error_state){
-            cell->error_state = 1;
-            return CMD_OK;
-        }
-        if(msb==1){
-            cell->value = cell->cell1 + ref_cell2->value;
+// Answers buffered requests up to the first command, which goes to the
+// worker. Lines longer than a command are answered as unrecognized.
+static void serve_requests(Server* server, Connection* conn) {
+    size_t pos = 0;
+    while (pos < conn->in_length && !conn->busy && !conn->closing) {
+        if (conn->binary) {
+            if (!serve_batch(server, conn, &pos))
+                break;
+            continue;
         }
-        else if(msb==2){
-            cell->value = cell->cell1 - ref_cell2->value;
+        char* line = conn->in + pos;
+        size_t available = conn->in_length - pos;
+        char* nl = memchr(line, '\n', available);
+        if (conn->discarding) {
+            conn->discarding = (nl == NULL);
+            pos += nl ? (size_t)(nl - line) + 1 : available;
+            continue;
         }
-        else if(msb==3){
-            if(ref_cell2->value==0){
-                cell->error_state = 1;
-                return CMD_OK;
-            }
-            cell->value = cell->cell1 / ref_cell2->value;
+        size_t len = nl ? (size_t)(nl - line) : available;
+        if (len >= INPUT_SIZE) {
+            if (!connection_reply(conn, status_message(CMD_UNRECOGNIZED)))
+                conn->closing = true;
+            conn->discarding = (nl == NULL);
+            pos += nl ? len + 1 : available;
+            continue;
         }
-        else if(msb==4){
-            cell->value = cell->cell1 * ref_cell2->value;
+        if (!nl)
+            break;      // wait for the rest of the line
+        pos += len + 1;
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+        line[len] = '\0';
+        if (strcmp(line, "q") == 0)
+            conn->closing = true;
+        else if (strncmp(line, "get ", 4) == 0)
+            serve_get(server, conn, line + 4);
+        else if (strcmp(line, "binary") == 0)
+            start_binary(conn);
+        else {
+            strcpy(conn->command, line);
+            submit_command(server, conn);
         }
-        cell->error_state = 0;
-    } 
-    // SUM
-    else if(rem==5){
-        status = sum_value(sheet, cell);
     }
-    // AVG
-    else if(rem==6){
-        status = sum_value(sheet, cell);
-        int count = 0;
-        short row1, col1, row2, col2;
-        get_row_col(cell->cell1, &row1, &col1, sheet->cols);
-        get_row_col(cell->cell2, &row2, &col2, sheet->cols);
-        count = (row2-row1+1)*(col2-col1+1);
-        cell->value = cell->value /count;
-    }
-    // MIN
-    else if(rem==7){
-        status = min_max(sheet, cell, true);
-    }
-    // MAX
-    else if(rem==8){
-        status = min_max(sheet, cell, false);
-    }
-    // STDEV
-    else if(rem==9){
-        status = variance(sheet, cell);
-    }
-
-    return status;
+    memmove(conn->in, conn->in + pos, conn->in_length - pos);
+    conn->in_length -= pos;
 }
 
-// Updated evaluate_formula:
-// The parameters: sheet, pointer to the current cell, its position (row, col), 
-// the expression string, and a sleep_time pointer.
-// We assume that if a cell has no formula, cell->formula is -1.
-CommandStatus evaluate_formula(Spreadsheet* sheet, Cell* cell, short row, short col, const char* expr, double* sleep_time) {
-    int expr_len = strlen(expr);
-    if(expr_len == 0) {
-        return CMD_UNRECOGNIZED;
-    }
-
-    bool is_avg = (strncmp(expr, "AVG(", 4) == 0);
-    bool is_min = (strncmp(expr, "MIN(", 4) == 0);
-    bool is_max = (strncmp(expr, "MAX(", 4) == 0);
-    bool is_stdev = (strncmp(expr, "STDEV(", 6) == 0);
-    bool is_sum = (strncmp(expr, "SUM(", 4) == 0);
-    // === Range-based functions: SUM, AVG, MIN, MAX, STDEV ===
-    if (is_avg || is_min || is_max || is_stdev || is_sum) {
-        int prefix_len = is_stdev ? 6 : 4;
-
-        if(expr[expr_len - 1] != ')')
-            return CMD_UNRECOGNIZED;
-
-        char* range_str = strndup(expr + prefix_len, expr_len - prefix_len - 1);
-        if (!range_str)
-            return CMD_UNRECOGNIZED;
-        Range range;
-        CommandStatus rstatus = parse_range(range_str, &range);
-        free(range_str);
-        if(rstatus != CMD_OK)
-            return rstatus;
-        
-        // Old Parents and formula code store
-        int parent1 = cell->cell1;
-        int parent2 = cell->cell2;
-        short old_formula = cell->formula;
-        remove_all_parents(sheet, row, col);
-
-        // For each cell in the range, add the current cell as a dependent and update cells parent and formula code.
-        if(is_sum)
-            cell->formula = 5;
-        else if(is_avg)
-            cell->formula = 6;
-        else if(is_min)
-            cell->formula = 7;
-        else if(is_max)
-            cell->formula = 8;
-        else
-            cell->formula = 9;
-
-        cell->cell1 = encode_cell_key(range.start_row, range.start_col, sheet->cols);
-        cell->cell2 = encode_cell_key(range.end_row, range.end_col, sheet->cols);
-
-        // *** CYCLE CHECK for range dependencies ***
-        if(detect_cycle_range(sheet, range.start_row, range.start_col, range.end_row, range.end_col, row, col)) {
-            cell->cell1 = parent1;
-            cell->cell2 = parent2;
-            cell->formula = old_formula;
-            add_children(sheet, parent1, parent2, old_formula, row, col);
-            return CMD_CIRCULAR_REF;
-        }
+static void close_connection(Server* server, Connection* conn) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        server->connections = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    free(conn->in);
+    free(conn->out);
+    free(conn->batch);
+    free(conn->reply);
+    free(conn);
+}
 
-        add_children(sheet, cell->cell1, cell->cell2, cell->formula, row, col);
-
-        // Set the formula code and perform evaluation.
-        if (is_stdev) {
-            variance(sheet, cell);
-        } else if (is_max) {
-            min_max(sheet, cell, false);
-        } else if (is_min) {
-            min_max(sheet, cell, true);
-        } else if (is_avg) {
-            sum_value(sheet, cell);
-            int count = (range.end_row - range.start_row + 1) * (range.end_col - range.start_col + 1);
-            cell->value = cell->value / count;
-        } else {
-            sum_value(sheet, cell);
+// Sends what it can of the pending replies, then waits for whatever the
+// connection needs next. Returns false once it is done with; one with a
+// command at the worker is kept until the answer comes back.
+static bool flush_connection(Server* server, Connection* conn) {
+    while (conn->out_start < conn->out_length) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_start, conn->out_length - conn->out_start,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            conn->closing = true;
+            conn->out_start = conn->out_length;
+            break;
         }
-        return CMD_OK;
-    }
-   
-    // === SLEEP function (if implemented) ===
-    else if (strncmp(expr, "SLEEP(", 6) == 0) {
-        return handle_sleep(sheet, row, col, expr, sleep_time);
-    }
-
-    // === Pure integer literal ===
-    char* endptr;
-    long number = strtol(expr, &endptr, 10);
-    if(*endptr == '\0') {
-        remove_all_parents(sheet, row, col);
-        cell->value = (int)number;
-        cell->formula = -1;
-        cell->error_state = false;
-        return CMD_OK;
+        conn->out_start += (size_t)n;
     }
+    if (conn->out_start == conn->out_length)
+        conn->out_start = conn->out_length = 0;
+    bool pending = conn->out_length > 0;
+    if (conn->closing && !pending && !conn->busy)
+        return false;
+    uint32_t events = 0;
+    if (!conn->closing && !conn->busy && conn->out_length < SERVER_OUTPUT_LIMIT)
+        events |= EPOLLIN;
+    if (pending)
+        events |= EPOLLOUT;
+    if (events != conn->events) {
+        // Hangups are reported whatever the mask, so a connection waiting on
+        // the worker leaves the epoll set until its answer comes back.
+        struct epoll_event ev = { .events = events, .data.ptr = conn };
+        int op = !events ? EPOLL_CTL_DEL : !conn->events ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        epoll_ctl(server->epoll_fd, op, conn->fd, &ev);
+        conn->events = events;
+    }
+    return true;
+}
 
-    // === Simple cell reference (all alphanumeric) ===
-    bool all_alnum = true;
-    for (int i = 0; i < expr_len; i++) {
-        if (!isalnum((unsigned char)expr[i])) {
-            all_alnum = false;
-            break;
-        }
+static void read_connection(Server* server, Connection* conn) {
+    if (!conn->in)
+        conn->in = malloc(SERVER_READ_SIZE);
+    if (!conn->in) {
+        conn->closing = true;
+        return;
     }
-    if (all_alnum) {
-        short ref_row, ref_col;
-        parse_cell_reference(expr, &ref_row, &ref_col);
-        if(ref_row < 0 || ref_row >= sheet->rows || ref_col < 0 || ref_col >= sheet->cols)
-            return CMD_INVALID_CELL;
-        
-        int parent1 = cell->cell1;
-        int parent2 = cell->cell2;
-        short old_formula = cell->formula;
-        remove_all_parents(sheet, row, col);
-        int ref_cell_key = encode_cell_key(ref_row, ref_col, sheet->cols);
-        cell->cell1 = ref_cell_key;           // Save the ref cell key as parent
-        cell->formula = 82;  // Code for simple cell reference.
-        Cell* ref_cell = get_cell_check(sheet, ref_cell_key);
-        // Add current cell as dependent of ref_cell.
-        add_child(ref_cell, row, col, sheet->cols);
-
-        // *** CYCLE DETECTION ***
-        if (detect_cycle_recursive(sheet, ref_row, ref_col, row, col)) {
-            cell->cell1 = parent1;            // Restore old parent values.
-            cell->cell2 = parent2;            // Restore old parent values.
-            cell->formula = old_formula;          // Restore old formula code.
-            add_children(sheet,parent1,parent2,old_formula,row,col);       // Restore old dependencies.
-            return CMD_CIRCULAR_REF;
-        }
-        if(ref_cell->error_state)
-            cell->error_state = true;
-        else{
-            cell->value = ref_cell->value;
-            cell->error_state = false;
-        }
-        return CMD_OK;
+    ssize_t n = read(conn->fd, conn->in + conn->in_length, SERVER_READ_SIZE - conn->in_length);
+    if (n > 0) {
+        conn->in_length += (size_t)n;
+        serve_requests(server, conn);
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        conn->closing = true;
     }
+}
 
-    // === Binary arithmetic expression ===
-    // Find operator starting at index 1 to avoid confusion with a leading minus sign.
-    int op_index = -1;
-    char op_char = '\0';
-    for (int i = 1; i < expr_len; i++) {
-        char c = expr[i];
-        if(c == '+' || c == '-' || c == '*' || c == '/') {
-            op_char = c;
-            op_index = i;
-            break;
-        }
-    }
-    if(op_index == -1)
-        return CMD_UNRECOGNIZED;
-
-    // Split into left and right operands.
-    char* left_str = strndup(expr, op_index);
-    char* right_str = strdup(expr + op_index + 1);
-    if (!left_str || !right_str) {
-        free(left_str);
-        free(right_str);
-        return CMD_UNRECOGNIZED;
+// Replies to the commands the worker has answered and carries on with
+// the requests that waited behind them.
+static void collect_answers(Server* server) {
+    uint64_t count;
+    ssize_t n = read(server->done_fd, &count, sizeof(count));
+    (void)n;
+    pthread_mutex_lock(&server->jobs_lock);
+    Connection* done = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->jobs_lock);
+    while (done) {
+        Connection* conn = done;
+        done = conn->next_job;
+        conn->busy = false;
+        bool replied = conn->binary ? connection_append(conn, conn->reply, conn->reply_length)
+                                    : connection_reply(conn, status_message(conn->status));
+        if (!replied)
+            conn->closing = true;
+        serve_requests(server, conn);
+        if (!flush_connection(server, conn))
+            close_connection(server, conn);
     }
-    int left_val = 0, right_val = 0;
-    bool left_is_cell = false, right_is_cell = false;
-    bool error_found = false;
-    short left_row = -1, left_col = -1, right_row = -1, right_col = -1;
-
-    // Evaluate left operand.
-    char* left_endptr;
-    long left_num = strtol(left_str, &left_endptr, 10);
-    int ref_cell_left = -1;
-    if (*left_endptr == '\0') {
-        left_val = (int)left_num;
-    } else {
-        parse_cell_reference(left_str, &left_row, &left_col);
-        if(left_row < 0 || left_row >= sheet->rows || left_col < 0 || left_col >= sheet->cols) {
-            free(left_str); free(right_str);
-            return CMD_INVALID_CELL;
+}
+
+static void accept_connections(Server* server) {
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        Connection* conn = calloc(1, sizeof(Connection));
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+        if (!conn || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            free(conn);
+            close(fd);
+            continue;
         }
-        left_is_cell = true;
-        Cell* ref_cell = get_cell(sheet, left_row, left_col);
-        if(ref_cell->error_state)
-            error_found = true;
-        ref_cell_left = encode_cell_key(left_row, left_col, sheet->cols);
-        left_val = ref_cell->value;
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+        conn->next = server->connections;
+        if (conn->next)
+            conn->next->prev = conn;
+        server->connections = conn;
     }
+}
 
-    // Evaluate right operand.
-    int ref_cell_right = -1;
-    char* right_endptr;
-    long right_num = strtol(right_str, &right_endptr, 10);
-    if (*right_endptr == '\0') {
-        right_val = (int)right_num;
-    } else {
-        parse_cell_reference(right_str, &right_row, &right_col);
-        if(right_row < 0 || right_row >= sheet->rows || right_col < 0 || right_col >= sheet->cols) {
-            free(left_str); free(right_str);
-            return CMD_INVALID_CELL;
+static void* server_main(void* arg) {
+    Server* server = arg;
+    struct epoll_event events[64];
+    bool running = true;
+    while (running) {
+        int count = epoll_wait(server->epoll_fd, events, 64, -1);
+        for (int i = 0; i < count; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &server->wake_fd) {
+                running = false;
+            } else if (ptr == &server->listen_fd) {
+                accept_connections(server);
+            } else if (ptr == &server->done_fd) {
+                collect_answers(server);
+            } else {
+                Connection* conn = ptr;
+                if (!conn->busy && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    read_connection(server, conn);
+                if (!flush_connection(server, conn))
+                    close_connection(server, conn);
+            }
         }
-        right_is_cell = true;
-        Cell* ref_cell = get_cell(sheet, right_row, right_col);
-        if(ref_cell->error_state)
-            error_found = true;
-        ref_cell_right = encode_cell_key(right_row, right_col, sheet->cols);
-        right_val = ref_cell->value;
     }
+    // Let the worker finish what it has, then drop every connection.
+    pthread_mutex_lock(&server->jobs_lock);
+    server->stop = true;
+    pthread_cond_signal(&server->jobs_ready);
+    pthread_mutex_unlock(&server->jobs_lock);
+    pthread_join(server->worker, NULL);
+    while (server->connections)
+        close_connection(server, server->connections);
+    return NULL;
+}
 
-    free(left_str); free(right_str);
+// Starts serving sheet, which must publish its values, on a socket at path,
+// replacing a stale socket file. The caller takes lock around everything
+// it does with the sheet other than drawing frames.
+Server* server_start(Spreadsheet* sheet, pthread_mutex_t* lock, const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+    strcpy(addr.sun_path, path);
+    Server* server = calloc(1, sizeof(Server));
+    if (!server)
+        return NULL;
+    server->sheet = sheet;
+    server->lock = lock;
+    server->path = strdup(path);
+    pthread_mutex_init(&server->jobs_lock, NULL);
+    pthread_cond_init(&server->jobs_ready, NULL);
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->wake_fd = eventfd(0, EFD_CLOEXEC);
+    server->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    struct epoll_event listen_ev = { .events = EPOLLIN, .data.ptr = &server->listen_fd };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &server->wake_fd };
+    struct epoll_event done_ev = { .events = EPOLLIN, .data.ptr = &server->done_fd };
+    bool ok = server->path && server->listen_fd >= 0 && server->epoll_fd >= 0
+              && server->wake_fd >= 0 && server->done_fd >= 0
+              && bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0
+              && listen(server->listen_fd, SOMAXCONN) == 0
+              && epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &listen_ev) == 0
+              && epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wake_fd, &wake_ev) == 0
+              && epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->done_fd, &done_ev) == 0;
+    bool worker = ok && pthread_create(&server->worker, NULL, worker_main, server) == 0;
+    if (worker && pthread_create(&server->thread, NULL, server_main, server) == 0)
+        return server;
+    if (worker) {
+        server->stop = true;
+        pthread_cond_signal(&server->jobs_ready);
+        pthread_join(server->worker, NULL);
+    }
+    if (server->listen_fd >= 0) close(server->listen_fd);
+    if (server->epoll_fd >= 0) close(server->epoll_fd);
+    if (server->wake_fd >= 0) close(server->wake_fd);
+    if (server->done_fd >= 0) close(server->done_fd);
+    pthread_mutex_destroy(&server->jobs_lock);
+    pthread_cond_destroy(&server->jobs_ready);
+    free(server->path);
+    free(server);
+    return NULL;
+}
 
-    // Back up old dependency info.
-    int oldCell1 = cell->cell1;
-    int oldCell2 = cell->cell2;
-    short oldFormula = cell->formula;
+// Closes every connection and removes the socket.
+void server_stop(Server* server) {
+    uint64_t one = 1;
+    write_all(server->wake_fd, (const char*)&one, sizeof(one));
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    close(server->epoll_fd);
+    close(server->wake_fd);
+    close(server->done_fd);
+    pthread_mutex_destroy(&server->jobs_lock);
+    pthread_cond_destroy(&server->jobs_ready);
+    unlink(server->path);
+    free(server->path);
+    free(server);
+}
 
-    // Remove old dependencies from the graph.
-    remove_all_parents(sheet, row, col);
-    // For each operand that is a cell, add the new dependency edge.
-    if (left_is_cell) {
-        add_child(get_cell(sheet, left_row, left_col), row, col, sheet->cols);
-        cell->cell1 = ref_cell_left;
-    }
-    else {
-        cell->cell1 = left_val;
-    }
-    if (right_is_cell) {
-        add_child(get_cell(sheet, right_row, right_col), row, col, sheet->cols);
-        cell->cell2 = ref_cell_right;
-    }
-    else {
-        cell->cell2 = right_val;
-    }
-    
-    // Set formula code based on operator and whether operands were cells.
-    switch (op_char) {
-        case '+':
-            cell->formula = 10;
-            break;
-        case '-':
-            cell->formula = 20;
-            break;
-        case '*':
-            cell->formula = 40;
-            break;
-        case '/':
-            cell->formula = 30;
-            break;
-    }
+/* ---------- Update Ingestion ---------- */
+// --ingest applies a stream of updates next to the REPL, read from a named
+// pipe, or from a file from its start and then as it grows. An update is a
+// line "<cell>=<integer>". Within a window of --ingest-window milliseconds,
+// counted from its first update, only the last value for each cell is
+// kept, and the window is applied as one write with a single recalculation
+// of everything that depends on its cells. Any other line is a command: the
+// window so far is applied first and the command runs on its own, so
+// updates still take effect in order. Updates to cells outside the sheet
+// are dropped.
+#define INGEST_READ_SIZE 65536
+#define INGEST_WINDOW_LIMIT (1 << 20)   // apply a window early once it holds this many cells
 
-    if(left_is_cell && right_is_cell) {
-        cell->formula += 0;
-    } else if(left_is_cell) {
-        cell->formula += 2;
-    } else if(right_is_cell) {
-        cell->formula += 3;
-    }
+typedef struct {
+    Spreadsheet* sheet;
+    pthread_mutex_t* lock;  // held around every command
+    int fd;
+    bool fifo;              // fd is a pipe; otherwise a file to follow
+    int wake_fd;            // eventfd: stop
+    int window_ms;
+    pthread_t thread;
+    // The window: count distinct cells, as row << 16 | col, with their
+    // latest values. slots is an open-addressed table of 2 * capacity
+    // entries, each 1 + the index of its cell or 0 if unused.
+    uint32_t* cells;
+    int* values;
+    int* keys;              // scratch for applying the window
+    int* slots;
+    int count;
+    int capacity;
+    struct timespec opened; // when the window got its first update
+    char line[INPUT_SIZE];
+    size_t line_length;
+    bool discarding;        // dropping the rest of an overlong line
+} Ingest;
+
+static bool ingest_grow(Ingest* ingest) {
+    int capacity = ingest->capacity ? ingest->capacity * 2 : 4096;
+    uint32_t* cells = realloc(ingest->cells, (size_t)capacity * sizeof(uint32_t));
+    if (!cells)
+        return false;
+    ingest->cells = cells;
+    int* values = realloc(ingest->values, (size_t)capacity * sizeof(int));
+    if (!values)
+        return false;
+    ingest->values = values;
+    int* keys = realloc(ingest->keys, (size_t)capacity * sizeof(int));
+    if (!keys)
+        return false;
+    ingest->keys = keys;
+    int* slots = calloc((size_t)capacity * 2, sizeof(int));
+    if (!slots)
+        return false;
+    free(ingest->slots);
+    ingest->slots = slots;
+    ingest->capacity = capacity;
+    unsigned mask = (unsigned)capacity * 2 - 1;
+    for (int i = 0; i < ingest->count; i++) {
+        unsigned h = (ingest->cells[i] * 2654435761u) & mask;
+        while (slots[h])
+            h = (h + 1) & mask;
+        slots[h] = i + 1;
+    }
+    return true;
+}
 
-    // Now, perform cycle detection for each new dependency edge.
-    if (left_is_cell) {
-        // Check if starting from the new dependency (left operand) we can reach (row,col)
-        if (detect_cycle_recursive(sheet,left_row, left_col, row, col)) {
-            // Restore old dependencies.
-            cell->cell1 = oldCell1;
-            cell->cell2 = oldCell2;
-            cell->formula = oldFormula;
-            add_children(sheet, oldCell1, oldCell2, oldFormula, row, col);
-            return CMD_CIRCULAR_REF;
-        }
-    }
-    if (right_is_cell) {
-        if (detect_cycle_recursive(sheet, right_row, right_col, row, col)) {
-            cell->cell1 = oldCell1;
-            cell->cell2 = oldCell2;
-            cell->formula = oldFormula;
-            add_children(sheet, oldCell1, oldCell2, oldFormula, row, col);
-            return CMD_CIRCULAR_REF;
+// Applies the window, then empties it.
+static void ingest_apply(Ingest* ingest) {
+    if (ingest->count == 0)
+        return;
+    Spreadsheet* sheet = ingest->sheet;
+    pthread_mutex_lock(ingest->lock);
+    int count = 0;
+    for (int i = 0; i < ingest->count; i++) {
+        int row = (int)(ingest->cells[i] >> 16);
+        int col = (int)(ingest->cells[i] & 0xFFFF);
+        if (cell_in_sheet(sheet, row, col)) {
+            ingest->keys[count] = encode_cell_key((short)row, (short)col, sheet->cols);
+            ingest->values[count++] = ingest->values[i];
         }
     }
-    
-    // Set error state if any operand is an error.
-    if (error_found) {
-        cell->error_state = true;
-    } else {
-        cell->error_state = false;          // Reset error state if no error.
-    }
-
-    // Set formula code based on operator and whether operands were cells.
-    switch(op_char) {
-        case '+': 
-            cell->value = left_val + right_val;
-            break;
-        case '-': 
-            cell->value = left_val - right_val;
-            break;
-        case '*': 
-            cell->value = left_val * right_val;
-            break;
-        case '/':
-            if(right_val == 0) {
-                cell->error_state = true;
-                return CMD_OK;
-            }
-            if(!error_found)
-                cell->value = left_val / right_val;
-            break;
+    if (count > 0) {
+        write_cells(sheet, ingest->keys, ingest->values, count);
+        if (sheet->plane)
+            publish_values(sheet);
     }
-    return CMD_OK;
+    pthread_mutex_unlock(ingest->lock);
+    memset(ingest->slots, 0, (size_t)ingest->capacity * 2 * sizeof(int));
+    ingest->count = 0;
 }
 
-/* ---------- Command Handling (Simplified) ---------- */
-CommandStatus set_cell_value(Spreadsheet* sheet, short row, short col, const char* expr, double* sleep_time) {
-    Cell* cell = get_cell(sheet, row, col);
-    // Evaluate as a formula.
-    CommandStatus status = evaluate_formula(sheet, cell, row, col, expr, sleep_time);
-    reevaluate_topologically(sheet, row, col, sleep_time);
-    return status;
+static void ingest_update(Ingest* ingest, short row, short col, int value) {
+    uint32_t cell = (uint32_t)row << 16 | (uint32_t)col;
+    unsigned mask = (unsigned)ingest->capacity * 2 - 1;
+    unsigned h = (cell * 2654435761u) & mask;
+    for (; ingest->slots[h]; h = (h + 1) & mask) {
+        if (ingest->cells[ingest->slots[h] - 1] == cell) {
+            ingest->values[ingest->slots[h] - 1] = value;
+            return;
+        }
+    }
+    if (ingest->count == ingest->capacity) {
+        if (ingest->capacity >= INGEST_WINDOW_LIMIT || !ingest_grow(ingest))
+            ingest_apply(ingest);
+        mask = (unsigned)ingest->capacity * 2 - 1;
+        for (h = (cell * 2654435761u) & mask; ingest->slots[h]; h = (h + 1) & mask)
+            ;
+    }
+    if (ingest->count == 0)
+        clock_gettime(CLOCK_MONOTONIC, &ingest->opened);
+    ingest->cells[ingest->count] = cell;
+    ingest->values[ingest->count] = value;
+    ingest->slots[h] = ++ingest->count;
 }
 
-// Function to scroll to a cell
-// version 5
-CommandStatus scroll_to_cell(Spreadsheet* sheet, const char* cell) {
+static void ingest_line(Ingest* ingest, char* line) {
+    if (*line == '\0')
+        return;
     short row, col;
-    parse_cell_reference(cell, &row, &col);
-    if (row < 0 || row >= sheet->rows || col < 0 || col >= sheet->cols) {
-        return CMD_INVALID_CELL;
+    const char* p = scan_cell(line, &row, &col);
+    if (p && *p == '=' && row >= 0 && row < MAX_ROWS && col < MAX_COLS) {
+        p++;
+        bool negative = (*p == '-');
+        if (*p == '-' || *p == '+')
+            p++;
+        long long value = 0;
+        int digits = 0;
+        for (; isdigit((unsigned char)*p) && digits < 11; p++, digits++)
+            value = value * 10 + (*p - '0');
+        if (negative)
+            value = -value;
+        if (*p == '\0' && digits > 0 && value >= INT_MIN && value <= INT_MAX) {
+            ingest_update(ingest, row, col, (int)value);
+            return;
+        }
     }
-    sheet->viewport_row = row;
-    sheet->viewport_col = col;
-    return CMD_OK;
+    // A command sees every update before it.
+    ingest_apply(ingest);
+    double sleep_time = 0.0;
+    pthread_mutex_lock(ingest->lock);
+    handle_command(ingest->sheet, line, &sleep_time);
+    pthread_mutex_unlock(ingest->lock);
 }
 
-// Function to scroll the viewport
-void scroll_viewport(Spreadsheet* sheet, char direction) {
-    switch (direction) {
-        case 'w': // up
-            sheet->viewport_row = (sheet->viewport_row > 10) ? sheet->viewport_row - 10 : 0;
-            break;
-        case 's': // down
-            if (sheet->viewport_row + VIEWPORT_SIZE < sheet->rows) {
-                sheet->viewport_row = (sheet->viewport_row + 10 + VIEWPORT_SIZE <= sheet->rows) ? sheet->viewport_row + 10 : sheet->rows - VIEWPORT_SIZE;
+static void ingest_bytes(Ingest* ingest, const char* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (c == '\n') {
+            if (!ingest->discarding) {
+                size_t n = ingest->line_length;
+                if (n > 0 && ingest->line[n - 1] == '\r')
+                    n--;
+                ingest->line[n] = '\0';
+                ingest_line(ingest, ingest->line);
             }
-            break;
-        case 'a': // left 
-            sheet->viewport_col = (sheet->viewport_col > 10) ? sheet->viewport_col - 10 : 0;
-            break;
-        case 'd': // right
-            if (sheet->viewport_col + VIEWPORT_SIZE < sheet->cols) {
-                sheet->viewport_col = (sheet->viewport_col + 10 + VIEWPORT_SIZE <= sheet->cols) ? sheet->viewport_col + 10 : sheet->cols - VIEWPORT_SIZE;
-            }
-            break;
+            ingest->line_length = 0;
+            ingest->discarding = false;
+        } else if (ingest->line_length < INPUT_SIZE - 1) {
+            ingest->line[ingest->line_length++] = c;
+        } else {
+            ingest->discarding = true;
+        }
     }
 }
 
-CommandStatus handle_command(Spreadsheet* sheet, const char* cmd, double* sleep_time) {
-// CommandStatus handle_command(Spreadsheet* sheet, const char* cmd) {
-    if (strcmp(cmd, "disable_output") == 0) {
-        sheet->output_enabled = false;
-        return CMD_OK;
-    } else if (strcmp(cmd, "enable_output") == 0) {
-        sheet->output_enabled = true;
-        return CMD_OK;
-    } else if (strlen(cmd) == 1 && strchr("wasd", cmd[0])) {
-        scroll_viewport(sheet, cmd[0]);
-        return CMD_OK;
-    } else if (strncmp(cmd, "scroll_to ", 10) == 0) {
-        return scroll_to_cell(sheet, cmd + 10);
-    } 
-    // Handle cell assignments
-    char* eq = strchr(cmd, '=');
-    if(eq != NULL) {
-        // Split into cell and expression
-        char cell_ref[10];
-        strncpy(cell_ref, cmd, eq - cmd);
-        cell_ref[eq - cmd] = '\0';        
-        short row, col;
-        parse_cell_reference(cell_ref, &row, &col);        
-        if(row < 0 || row >= sheet->rows || col < 0 || col >= sheet->cols) {
-            return CMD_INVALID_CELL;
-        }        
-        const char* expr = eq + 1;
-        return set_cell_value(sheet, row, col, expr, sleep_time);
-    }
-    return CMD_UNRECOGNIZED;
+static long long window_left_ms(const Ingest* ingest) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ingest->window_ms - elapsed_ns(&ingest->opened, &now) / 1000000;
 }
 
-void print_spreadsheet(Spreadsheet* sheet) {
-    if (!sheet->output_enabled) return;
-    short start_row = sheet->viewport_row;
-    short start_col = sheet->viewport_col;
-    int display_rows = (sheet->rows - start_row < VIEWPORT_SIZE) ? sheet->rows - start_row : VIEWPORT_SIZE;
-    int display_cols = (sheet->cols - start_col < VIEWPORT_SIZE) ? sheet->cols - start_col : VIEWPORT_SIZE;
-    printf("    ");
-    for (int j = start_col; j < start_col + display_cols; j++) {
-        char* col_name = get_column_name(j + 1);
-        printf("%-8s", col_name);
-        free(col_name);
-    }
-    printf("\n");
-    for (int i = start_row; i < start_row + display_rows; i++) {
-        printf("%-4d", i + 1);
-        for (int j = start_col; j < start_col + display_cols; j++) {
-            Cell* cell = get_cell(sheet, i, j);
-            if (cell->error_state)
-                printf("%-8s", "ERR");
-            else
-                printf("%-8d", cell->value);
+static void* ingest_main(void* arg) {
+    Ingest* ingest = arg;
+    char buf[INGEST_READ_SIZE];
+    for (;;) {
+        ssize_t n = read(ingest->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n > 0)
+            ingest_bytes(ingest, buf, (size_t)n);
+        long long left = ingest->count > 0 ? window_left_ms(ingest) : -1;
+        if (ingest->count > 0 && left <= 0) {
+            ingest_apply(ingest);
+            left = -1;
         }
-        printf("\n");
+        if (n > 0)
+            continue;
+        // Caught up: wait for more, the end of the window or the stop. A
+        // file gives no notice of growth and is looked at again each window.
+        int timeout = (int)left;
+        if (!ingest->fifo && (timeout < 0 || timeout > ingest->window_ms))
+            timeout = ingest->window_ms;
+        struct pollfd fds[2] = { { ingest->wake_fd, POLLIN, 0 }, { ingest->fd, POLLIN, 0 } };
+        if (poll(fds, ingest->fifo ? 2 : 1, timeout) > 0 && fds[0].revents)
+            break;
     }
+    ingest_apply(ingest);
+    return NULL;
 }
 
-/* ---------- Spreadsheet Creation ---------- */
-Spreadsheet* create_spreadsheet(short rows, short cols) {
-    if (rows < 1 || rows > MAX_ROWS || cols < 1 || cols > MAX_COLS) {
-        fprintf(stderr, "Invalid spreadsheet dimensions\n");
+static void ingest_free(Ingest* ingest) {
+    if (ingest->fd >= 0) close(ingest->fd);
+    if (ingest->wake_fd >= 0) close(ingest->wake_fd);
+    free(ingest->cells);
+    free(ingest->values);
+    free(ingest->keys);
+    free(ingest->slots);
+    free(ingest);
+}
+
+// Starts applying the updates at path, a named pipe or a file, to sheet.
+// The caller takes lock around everything it does with the sheet other
+// than drawing frames.
+Ingest* ingest_start(Spreadsheet* sheet, pthread_mutex_t* lock, const char* path, int window_ms) {
+    struct stat st;
+    if (stat(path, &st) != 0)
         return NULL;
-    }
-    Spreadsheet* sheet = (Spreadsheet*)malloc(sizeof(Spreadsheet));
-    sheet->rows = rows;
-    sheet->cols = cols;
-    sheet->viewport_row = 0;
-    sheet->viewport_col = 0;
-    sheet->output_enabled = true;
-    // Allocate one contiguous block for all cells.
-    sheet->grid = (Cell*)malloc(rows * cols * sizeof(Cell));
-    if (!sheet->grid) {
-        fprintf(stderr, "Failed to allocate grid\n");
-        free(sheet);
+    Ingest* ingest = calloc(1, sizeof(Ingest));
+    if (!ingest)
         return NULL;
-    }
-    // Initialize each cell.
-    int total = rows * cols;
-    for (int i = 0; i < total; i++) {
-            Cell* cell = sheet->grid+i;
-            cell->formula = -1;
-            // cell->children = NULL;
-            cell->value = 0;
-            cell->error_state = false;
-            cell->cell1 = 0;
-            cell->cell2 = 0;
-    }
-    return sheet;
+    ingest->sheet = sheet;
+    ingest->lock = lock;
+    ingest->window_ms = window_ms;
+    ingest->fifo = S_ISFIFO(st.st_mode);
+    // Holding the pipe open for writing too means it never reaches end of
+    // file, however many writers come and go.
+    ingest->fd = open(path, (ingest->fifo ? O_RDWR | O_NONBLOCK : O_RDONLY) | O_CLOEXEC);
+    ingest->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (ingest->fd >= 0 && ingest->wake_fd >= 0 && ingest_grow(ingest)
+        && pthread_create(&ingest->thread, NULL, ingest_main, ingest) == 0)
+        return ingest;
+    ingest_free(ingest);
+    return NULL;
 }
 
-void free_spreadsheet(Spreadsheet* sheet) {
-    if (!sheet) return;
-    int total = sheet->rows * sheet->cols;
-    for (int i = 0; i < total; i++) {
-        Cell* cell = &sheet->grid[i];
-        avl_free(cell->children);
-    }
-    free(sheet->grid);
-    free(sheet);
+// Applies what has been read so far and stops.
+void ingest_stop(Ingest* ingest) {
+    uint64_t one = 1;
+    write_all(ingest->wake_fd, (const char*)&one, sizeof(one));
+    pthread_join(ingest->thread, NULL);
+    ingest_free(ingest);
+}
+
+static int shutdown_pipe[2] = { -1, -1 };
+
+static void request_shutdown(int sig) {
+    (void)sig;
+    char byte = 0;
+    ssize_t n = write(shutdown_pipe[1], &byte, 1);
+    (void)n;
+}
+
+// Blocks until SIGINT or SIGTERM, which then only wake this thread.
+static void wait_for_shutdown(void) {
+    if (pipe(shutdown_pipe) != 0)
+        return;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_shutdown;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    char byte;
+    while (read(shutdown_pipe[0], &byte, 1) < 0 && errno == EINTR)
+        ;
+    close(shutdown_pipe[0]);
+    close(shutdown_pipe[1]);
 }
 
 /* ----- main: Convert command line arguments to short ----- */
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <rows> <columns>\n", argv[0]);
+    const char* script_path = NULL;
+    bool bench_eval = false;
+    const char* feed = NULL;
+    bool drop_frames = isatty(STDOUT_FILENO);   // a terminal only needs the latest frame
+    const char* load_path = NULL;
+    const char* journal_path = NULL;
+    int commit_every = 64;
+    int commit_ms = 10;
+    int checkpoint_every = 0;   // seconds, 0 for no timed checkpoints
+    const char* listen_path = NULL;
+    const char* ingest_path = NULL;
+    int ingest_window = 10;
+    bool binary = false;
+    int argi = 1;
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--script") == 0 && argi + 1 < argc) {
+            script_path = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--bench-eval") == 0) {
+            bench_eval = true;
+            argi++;
+        } else if (strcmp(argv[argi], "--feed") == 0 && argi + 1 < argc
+                   && (strcmp(argv[argi + 1], "text") == 0 || strcmp(argv[argi + 1], "binary") == 0)) {
+            feed = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--binary") == 0) {
+            binary = true;
+            argi++;
+        } else if (strcmp(argv[argi], "--drop-frames") == 0) {
+            drop_frames = true;
+            argi++;
+        } else if (strcmp(argv[argi], "--load") == 0 && argi + 1 < argc) {
+            load_path = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--journal") == 0 && argi + 1 < argc) {
+            journal_path = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--commit-every") == 0 && argi + 1 < argc && atoi(argv[argi + 1]) > 0) {
+            commit_every = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--commit-ms") == 0 && argi + 1 < argc && atoi(argv[argi + 1]) > 0) {
+            commit_ms = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--listen") == 0 && argi + 1 < argc) {
+            listen_path = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--ingest") == 0 && argi + 1 < argc) {
+            ingest_path = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--ingest-window") == 0 && argi + 1 < argc && atoi(argv[argi + 1]) > 0) {
+            ingest_window = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "--checkpoint-every") == 0 && argi + 1 < argc && atoi(argv[argi + 1]) > 0) {
+            checkpoint_every = atoi(argv[argi + 1]);
+            argi += 2;
+        } else {
+            argi = argc;    // unknown flag: fall through to usage
+        }
+    }
+    // With --load the dimensions come from the snapshot.
+    if (argc - argi != 2 && !(load_path && argc == argi)) {
+        fprintf(stderr, "Usage: %s [--script FILE | --bench-eval | --feed text|binary | --binary] [--drop-frames]\n"
+                        "       [--journal FILE [--commit-every N] [--commit-ms MS]] [--checkpoint-every SECONDS]\n"
+                        "       [--listen SOCKET] [--ingest FILE [--ingest-window MS]]\n"
+                        "       [--load SNAPSHOT | <rows> <columns>]\n", argv[0]);
         return 1;
     }
-    short rows = (short)atoi(argv[1]);
-    short cols = (short)atoi(argv[2]);
     double last_time = 0.0;
     double command_time = 0.0;
     clock_t start, end;
     start = clock();
-    Spreadsheet* sheet = create_spreadsheet(rows, cols);
+    Spreadsheet* sheet;
+    if (load_path) {
+        sheet = sheet_load(load_path);
+        if (!sheet)
+            fprintf(stderr, "Failed to load snapshot %s\n", load_path);
+    } else {
+        sheet = sheet_create(atoi(argv[argi]), atoi(argv[argi + 1]));
+        if (!sheet)
+            fprintf(stderr, "Invalid spreadsheet dimensions\n");
+    }
     end = clock();
     command_time = (double)(end - start) / CLOCKS_PER_SEC;
     last_time = command_time;
     if (!sheet) return 1;
+    // Replaying the journal brings the sheet to where the last run stopped.
+    Journal* journal = NULL;
+    if (journal_path) {
+        off_t length = replay_journal(sheet, journal_path);
+        journal = length >= 0 ? journal_open(journal_path, length, commit_every, commit_ms) : NULL;
+        if (!journal) {
+            fprintf(stderr, "Failed to open journal %s\n", journal_path);
+            sheet_free(sheet);
+            return 1;
+        }
+        sheet->journal = journal;
+    }
+
+    if (script_path || bench_eval) {
+        int rc = script_path ? run_script(sheet, script_path) : run_eval_benchmark(sheet);
+        sheet_free(sheet);
+        return rc;
+    }
+    if (feed) {
+        int rc = run_feed(sheet, strcmp(feed, "binary") == 0 ? FEED_BINARY : FEED_TEXT);
+        sheet_free(sheet);
+        return rc;
+    }
+    if (binary) {
+        int rc = run_binary(sheet);
+        sheet_free(sheet);
+        return rc;
+    }
     
-    char input[128];
+    char input[INPUT_SIZE];
+    Frame frame;
+    OutputWriter* writer = malloc(sizeof(OutputWriter));
+    if (!writer) {
+        sheet_free(sheet);
+        return 1;
+    }
+    // Commands from the REPL, socket clients and ingestion take turns;
+    // frames are drawn from published values without waiting.
+    pthread_mutex_t command_lock = PTHREAD_MUTEX_INITIALIZER;
+    Server* server = NULL;
+    if (listen_path) {
+        if (create_plane(sheet))
+            server = server_start(sheet, &command_lock, listen_path);
+        if (!server) {
+            fprintf(stderr, "Failed to listen on %s\n", listen_path);
+            free(writer);
+            sheet_free(sheet);
+            return 1;
+        }
+    }
+    Ingest* ingest = NULL;
+    if (ingest_path) {
+        if (sheet->plane || create_plane(sheet))
+            ingest = ingest_start(sheet, &command_lock, ingest_path, ingest_window);
+        if (!ingest) {
+            fprintf(stderr, "Failed to ingest %s\n", ingest_path);
+            if (server)
+                server_stop(server);
+            free(writer);
+            sheet_free(sheet);
+            return 1;
+        }
+    }
+    writer_start(writer, STDOUT_FILENO, drop_frames);
+    LineReader reader;
+    reader.fd = STDIN_FILENO;
+    reader.eof = false;
+    reader.start = reader.end = 0;
     const char* last_status = "ok";
+    char checkpoint_note[40];
+    char status_text[PROMPT_SIZE];
+    struct timespec last_checkpoint, now;
+    clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
     double sleep_time = 0.0;
-    CommandStatus status;
+    CommandStatus status = CMD_OK;
+    bool quit = false;
     while (1) {
         command_time = 0.0;
-        print_spreadsheet(sheet);
-        printf("[%.1f] (%s) > ", last_time, last_status);
-        
-        if (!fgets(input, sizeof(input), stdin)) break;
-        input[strcspn(input, "\n")] = 0;
-        if (strcmp(input, "q") == 0) break;
+        capture_frame(sheet, &frame, last_time, last_status);
+        writer_publish_frame(writer, &frame);
+
+        // Until a whole line is buffered, wait on stdin together with a
+        // running checkpoint, reporting it as soon as it finishes, and the
+        // timer for the next one.
+        for (;;) {
+            int timeout = -1;
+            pthread_mutex_lock(&command_lock);
+            if (checkpoint_every > 0 && sheet->snapshot_path && sheet->checkpoint_pid == 0 && sheet->dirty_count > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                long long waited = elapsed_ns(&last_checkpoint, &now) / 1000000;
+                if (waited >= checkpoint_every * 1000LL) {
+                    start_checkpoint(sheet, sheet->snapshot_path);
+                    last_checkpoint = now;
+                } else {
+                    timeout = (int)(checkpoint_every * 1000LL - waited);
+                }
+            }
+            struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { sheet->checkpoint_fd, POLLIN, 0 } };
+            int count = sheet->checkpoint_pid ? 2 : 1;
+            pthread_mutex_unlock(&command_lock);
+            if (line_buffered(&reader))
+                break;
+            if (count == 2 || timeout >= 0) {
+                if (poll(fds, count, timeout) <= 0)
+                    continue;
+            } else {
+                fds[0].revents = POLLIN;
+            }
+            if (fds[0].revents)
+                fill_line(&reader);
+            pthread_mutex_lock(&command_lock);
+            if (finish_checkpoint(sheet, false, checkpoint_note, sizeof(checkpoint_note))) {
+                snprintf(status_text, sizeof(status_text), "%s, %s", status_message(status), checkpoint_note);
+                last_status = status_text;
+                capture_frame(sheet, &frame, last_time, last_status);
+                writer_publish_frame(writer, &frame);
+            }
+            pthread_mutex_unlock(&command_lock);
+        }
+        if (!read_line(&reader, input)) break;
+        if (strcmp(input, "q") == 0) {
+            quit = true;
+            break;
+        }
         
         start = clock();
+        pthread_mutex_lock(&command_lock);
         status = handle_command(sheet, input, &sleep_time);
+        pthread_mutex_unlock(&command_lock);
         end = clock();
         
         command_time = (double)(end - start) / CLOCKS_PER_SEC;
@@ -1325,16 +1678,18 @@ int main(int argc, char* argv[]) {
             sleep(sleep_time);
         }
         sleep_time = 0.0;
-        switch (status) {
-            case CMD_OK: last_status = "ok"; break;
-            case CMD_UNRECOGNIZED: last_status = "unrecognized cmd"; break;
-            case CMD_INVALID_CELL: last_status = "invalid cell"; break;
-            case CMD_INVALID_RANGE: last_status = "invalid range"; break;
-            case CMD_CIRCULAR_REF: last_status = "circular ref"; break;
-            case CMD_RANGE_ERROR: last_status = "range error"; break;
-            default: last_status = "error";
-        }
-    }
-    free_spreadsheet(sheet);
+        last_status = status_message(status);
+    }
+    // Once stdin ends the server and ingestion keep going until told to stop.
+    if ((server || ingest) && !quit)
+        wait_for_shutdown();
+    if (ingest)
+        ingest_stop(ingest);
+    if (server)
+        server_stop(server);
+    pthread_mutex_destroy(&command_lock);
+    writer_stop(writer);
+    free(writer);
+    sheet_free(sheet);
     return 0;
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "avl.h"
+#include <stdbool.h>
 #include <stdlib.h>
 
 static int max_int(int a, int b) {
@@ -9,10 +10,12 @@ int avl_get_height(AVLTree root) {
     return root ? root->height : 0;
 }
 
-static AVLTree new_node(int key) {
+static AVLTree new_node(int key, int length, int stride) {
     AVLTree node = malloc(sizeof(AVLNode));
     if (!node) return NULL;
     node->key = key;
+    node->length = length;
+    node->stride = stride;
     node->left = node->right = NULL;
     node->height = 1; // New node is a leaf
     return node;
@@ -48,14 +51,20 @@ static int get_balance(AVLTree root) {
     return root ? avl_get_height(root->left) - avl_get_height(root->right) : 0;
 }
 
-AVLTree avl_insert(AVLTree root, int key) {
+// Last key of a run.
+static int last_key(const AVLNode* run) {
+    return run->key + (run->length - 1) * run->stride;
+}
+
+// Inserts a run that starts at key and overlaps none already in the tree.
+static AVLTree insert_node(AVLTree root, int key, int length, int stride) {
     if (root == NULL)
-        return new_node(key);
+        return new_node(key, length, stride);
     
     if (key < root->key)
-        root->left = avl_insert(root->left, key);
+        root->left = insert_node(root->left, key, length, stride);
     else if (key > root->key)
-        root->right = avl_insert(root->right, key);
+        root->right = insert_node(root->right, key, length, stride);
     else
         return root; // Duplicate keys not allowed
 
@@ -88,14 +97,15 @@ static AVLNode* min_value_node(AVLNode* node) {
     return current;
 }
 
-AVLTree avl_delete(AVLTree root, int key) {
+// Deletes the run starting at key.
+static AVLTree delete_node(AVLTree root, int key) {
     if (root == NULL)
         return root;
     
     if (key < root->key)
-        root->left = avl_delete(root->left, key);
+        root->left = delete_node(root->left, key);
     else if (key > root->key)
-        root->right = avl_delete(root->right, key);
+        root->right = delete_node(root->right, key);
     else {
         if ((root->left == NULL) || (root->right == NULL)) {
             AVLTree temp = root->left ? root->left : root->right;
@@ -109,7 +119,9 @@ AVLTree avl_delete(AVLTree root, int key) {
         } else {
             AVLNode* temp = min_value_node(root->right);
             root->key = temp->key;
-            root->right = avl_delete(root->right, temp->key);
+            root->length = temp->length;
+            root->stride = temp->stride;
+            root->right = delete_node(root->right, temp->key);
         }
     }
     if (root == NULL)
@@ -134,10 +146,148 @@ AVLTree avl_delete(AVLTree root, int key) {
     return root;
 }
 
-AVLNode* avl_search(AVLTree root, int key) {
-    if (root == NULL || root->key == key)
+// The run with the greatest first key not above key, or NULL.
+static AVLNode* floor_node(AVLTree root, int key) {
+    AVLNode* floor = NULL;
+    while (root) {
+        if (root->key <= key) {
+            floor = root;
+            root = root->right;
+        } else {
+            root = root->left;
+        }
+    }
+    return floor;
+}
+
+// The run with the least first key above key, or NULL.
+static AVLNode* next_node(AVLTree root, int key) {
+    AVLNode* next = NULL;
+    while (root) {
+        if (root->key > key) {
+            next = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+    return next;
+}
+
+// Joins the neighbouring runs before and after into one when the gap
+// between them is the stride of both. A run of one key fits any stride.
+static AVLTree join_runs(AVLTree root, AVLNode* before, AVLNode* after) {
+    if (!before || !after)
+        return root;
+    int gap = after->key - last_key(before);
+    if ((before->length > 1 && before->stride != gap) || (after->length > 1 && after->stride != gap))
+        return root;
+    before->stride = gap;
+    before->length += after->length;
+    return delete_node(root, after->key);
+}
+
+AVLTree avl_insert(AVLTree root, int key) {
+    AVLNode* before = floor_node(root, key);
+    if (before && key <= last_key(before)) {
+        int offset = key - before->key;
+        if (offset % before->stride == 0)
+            return root; // Duplicate keys not allowed
+        // key falls between two keys of the run: split the run around it.
+        int kept = offset / before->stride + 1;
+        int rest_length = before->length - kept;
+        before->length = kept;
+        root = insert_node(root, before->key + kept * before->stride, rest_length, before->stride);
+        return insert_node(root, key, 1, 1);
+    }
+    // Prefer continuing a run at its stride; otherwise pair with a single key.
+    AVLNode* after = next_node(root, key);
+    bool extends = before && before->length > 1 && key - last_key(before) == before->stride;
+    bool precedes = after && after->length > 1 && after->key - key == after->stride;
+    if (extends || (!precedes && before && before->length == 1)) {
+        if (before->length == 1)
+            before->stride = key - before->key;
+        before->length++;
+        return join_runs(root, before, after);
+    }
+    if (precedes || (after && after->length == 1)) {
+        if (after->length == 1)
+            after->stride = after->key - key;
+        after->key = key;
+        after->length++;
+        return join_runs(root, before, after);
+    }
+    return insert_node(root, key, 1, 1);
+}
+
+AVLTree avl_delete(AVLTree root, int key) {
+    AVLNode* run = avl_search(root, key);
+    if (!run)
         return root;
-    return (key < root->key) ? avl_search(root->left, key) : avl_search(root->right, key);
+    if (run->length == 1)
+        return delete_node(root, run->key);
+    int index = (key - run->key) / run->stride;
+    if (index == 0) {
+        run->key += run->stride;
+    } else if (index < run->length - 1) {
+        int rest_length = run->length - index - 1;
+        run->length = index;
+        return insert_node(root, key + run->stride, rest_length, run->stride);
+    }
+    run->length--;
+    return root;
+}
+
+AVLNode* avl_search(AVLTree root, int key) {
+    AVLNode* run = floor_node(root, key);
+    if (!run || key > last_key(run) || (key - run->key) % run->stride != 0)
+        return NULL;
+    return run;
+}
+
+// Builds a balanced tree from count ascending, non-overlapping runs.
+static AVLTree build_runs(const AVLNode* runs, int count) {
+    if (count <= 0)
+        return NULL;
+    int mid = count / 2;
+    AVLTree root = new_node(runs[mid].key, runs[mid].length, runs[mid].stride);
+    if (!root) return NULL;
+    root->left = build_runs(runs, mid);
+    root->right = build_runs(runs + mid + 1, count - mid - 1);
+    if ((mid > 0 && !root->left) || (count - mid - 1 > 0 && !root->right)) {
+        avl_free(root->left);
+        avl_free(root->right);
+        free(root);
+        return NULL;
+    }
+    root->height = 1 + max_int(avl_get_height(root->left), avl_get_height(root->right));
+    return root;
+}
+
+AVLTree avl_build_sorted(const int* keys, int count) {
+    if (count <= 0)
+        return NULL;
+    AVLNode* runs = malloc(count * sizeof(AVLNode));
+    if (!runs) return NULL;
+    // Each run takes the stride of its first two keys and as many as follow it.
+    int run_count = 0;
+    for (int i = 0; i < count; ) {
+        int length = 1, stride = 1;
+        if (i + 1 < count) {
+            stride = keys[i + 1] - keys[i];
+            length = 2;
+            while (i + length < count && keys[i + length] - keys[i + length - 1] == stride)
+                length++;
+        }
+        runs[run_count].key = keys[i];
+        runs[run_count].length = length;
+        runs[run_count].stride = stride;
+        run_count++;
+        i += length;
+    }
+    AVLTree root = build_runs(runs, run_count);
+    free(runs);
+    return root;
 }
 
 void avl_free(AVLTree root) {
@@ -1,24 +1,36 @@
 #ifndef AVL_H
 #define AVL_H
 
+// A set of keys (for example, encoded as row*total_cols + col), stored as
+// an AVL tree of runs. A run holds the keys key, key + stride, ... up to
+// length of them, so a column or row of dependents filled from one formula
+// takes a single node. Runs do not overlap: every key of a run lies below
+// the first key of the next, and an in-order walk yields ascending keys.
 typedef struct AVLNode {
-    int key;                   // key (for example, encoded as row*total_cols + col)
+    int key;                   // first key of the run
+    int length;                // keys in the run, at least 1
+    int stride;                // step between them, at least 1
+    int height;
     struct AVLNode* left;
     struct AVLNode* right;
-    int height;
 } AVLNode;
 
 typedef AVLNode* AVLTree;
 
-// Inserts key into the AVL tree rooted at root.
+// Inserts key into the set rooted at root, extending or joining runs
+// where it continues them.
 AVLTree avl_insert(AVLTree root, int key);
 
-// Deletes key from the AVL tree rooted at root.
+// Deletes key from the set rooted at root, splitting its run if needed.
 AVLTree avl_delete(AVLTree root, int key);
 
-// Searches for a node with key in the AVL tree.
+// Returns the run holding key, or NULL if key is not in the set.
 AVLNode* avl_search(AVLTree root, int key);
 
+// Builds a balanced set from count strictly ascending keys.
+// Returns NULL if count is 0 or allocation fails.
+AVLTree avl_build_sorted(const int* keys, int count);
+
 // Frees all nodes in the AVL tree.
 void avl_free(AVLTree root);
 
@@ -0,0 +1,246 @@
+#include "depset.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG_MASK 3
+#define TAG_TREE 0
+#define TAG_ONE 1
+#define TAG_VECTOR 2
+#define TAG_TWO 3
+
+typedef struct {
+    int count;
+    int capacity;
+    int keys[];     // ascending
+} DepVector;
+
+static DepSet one_key(int key) {
+    return (DepSet)key << 2 | TAG_ONE;
+}
+
+static DepSet two_keys(int low, int high) {
+    return (DepSet)high << 33 | (DepSet)low << 2 | TAG_TWO;
+}
+
+static int first_key(DepSet set) {
+    return (int)(set >> 2 & 0x7fffffff);
+}
+
+static int second_key(DepSet set) {
+    return (int)(set >> 33);
+}
+
+static DepVector* vector_of(DepSet set) {
+    return (DepVector*)(uintptr_t)(set & ~(DepSet)TAG_MASK);
+}
+
+static AVLTree tree_of(DepSet set) {
+    return (AVLTree)(uintptr_t)set;
+}
+
+static DepVector* new_vector(int capacity) {
+    DepVector* vector = malloc(sizeof(DepVector) + capacity * sizeof(int));
+    if (!vector) return NULL;
+    vector->count = 0;
+    vector->capacity = capacity;
+    return vector;
+}
+
+// Index of the first key in vector not below key.
+static int lower_bound(const DepVector* vector, int key) {
+    int low = 0, high = vector->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (vector->keys[mid] < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static DepSet vector_insert(DepSet set, int key) {
+    DepVector* vector = vector_of(set);
+    int at = lower_bound(vector, key);
+    if (at < vector->count && vector->keys[at] == key)
+        return set;
+    if (vector->count == DEPSET_VECTOR_MAX) {
+        AVLTree tree = avl_build_sorted(vector->keys, vector->count);
+        if (!tree) return set;
+        free(vector);
+        return (DepSet)(uintptr_t)avl_insert(tree, key);
+    }
+    if (vector->count == vector->capacity) {
+        int capacity = vector->capacity * 2 < DEPSET_VECTOR_MAX ? vector->capacity * 2 : DEPSET_VECTOR_MAX;
+        DepVector* grown = realloc(vector, sizeof(DepVector) + capacity * sizeof(int));
+        if (!grown) return set;
+        vector = grown;
+        vector->capacity = capacity;
+    }
+    memmove(vector->keys + at + 1, vector->keys + at, (vector->count - at) * sizeof(int));
+    vector->keys[at] = key;
+    vector->count++;
+    return (DepSet)(uintptr_t)vector | TAG_VECTOR;
+}
+
+DepSet depset_insert(DepSet set, int key) {
+    if (set == 0)
+        return one_key(key);
+    switch (set & TAG_MASK) {
+    case TAG_ONE: {
+        int a = first_key(set);
+        if (key == a)
+            return set;
+        return key < a ? two_keys(key, a) : two_keys(a, key);
+    }
+    case TAG_TWO: {
+        int a = first_key(set), b = second_key(set);
+        if (key == a || key == b)
+            return set;
+        DepVector* vector = new_vector(4);
+        if (!vector) return set;
+        int* k = vector->keys;
+        if (key < a) { k[0] = key; k[1] = a; k[2] = b; }
+        else if (key < b) { k[0] = a; k[1] = key; k[2] = b; }
+        else { k[0] = a; k[1] = b; k[2] = key; }
+        vector->count = 3;
+        return (DepSet)(uintptr_t)vector | TAG_VECTOR;
+    }
+    case TAG_VECTOR:
+        return vector_insert(set, key);
+    default:
+        return (DepSet)(uintptr_t)avl_insert(tree_of(set), key);
+    }
+}
+
+DepSet depset_delete(DepSet set, int key) {
+    if (set == 0)
+        return set;
+    switch (set & TAG_MASK) {
+    case TAG_ONE:
+        return key == first_key(set) ? 0 : set;
+    case TAG_TWO:
+        if (key == first_key(set))
+            return one_key(second_key(set));
+        if (key == second_key(set))
+            return one_key(first_key(set));
+        return set;
+    case TAG_VECTOR: {
+        DepVector* vector = vector_of(set);
+        int at = lower_bound(vector, key);
+        if (at == vector->count || vector->keys[at] != key)
+            return set;
+        memmove(vector->keys + at, vector->keys + at + 1, (vector->count - at - 1) * sizeof(int));
+        vector->count--;
+        if (vector->count > 2)
+            return set;
+        DepSet inline_keys = two_keys(vector->keys[0], vector->keys[1]);
+        free(vector);
+        return inline_keys;
+    }
+    default:
+        return (DepSet)(uintptr_t)avl_delete(tree_of(set), key);
+    }
+}
+
+DepSet depset_build_sorted(const int* keys, int count) {
+    if (count <= 0)
+        return 0;
+    if (count == 1)
+        return one_key(keys[0]);
+    if (count == 2)
+        return two_keys(keys[0], keys[1]);
+    if (count > DEPSET_VECTOR_MAX)
+        return (DepSet)(uintptr_t)avl_build_sorted(keys, count);
+    DepVector* vector = new_vector(count);
+    if (!vector) return 0;
+    memcpy(vector->keys, keys, count * sizeof(int));
+    vector->count = count;
+    return (DepSet)(uintptr_t)vector | TAG_VECTOR;
+}
+
+// Makes room for n more keys in the dynamic array. Returns false, leaving
+// it as it was, if memory runs out.
+static bool reserve(int** keys, int count, int* capacity, int n) {
+    if (count + n <= *capacity)
+        return true;
+    int grown_capacity = *capacity > 0 ? *capacity : 1;
+    while (count + n > grown_capacity)
+        grown_capacity *= 2;
+    int* grown = realloc(*keys, grown_capacity * sizeof(int));
+    if (!grown)
+        return false;
+    *keys = grown;
+    *capacity = grown_capacity;
+    return true;
+}
+
+// Appends the keys of a run tree in-order, expanding each run.
+static bool collect_tree(AVLTree root, int** keys, int* count, int* capacity) {
+    if (root == NULL)
+        return true;
+    if (!collect_tree(root->left, keys, count, capacity) || !reserve(keys, *count, capacity, root->length))
+        return false;
+    for (int i = 0, key = root->key; i < root->length; i++, key += root->stride)
+        (*keys)[(*count)++] = key;
+    return collect_tree(root->right, keys, count, capacity);
+}
+
+bool depset_collect(DepSet set, int** keys, int* count, int* capacity) {
+    if (set == 0)
+        return true;
+    switch (set & TAG_MASK) {
+    case TAG_ONE:
+        if (!reserve(keys, *count, capacity, 1))
+            return false;
+        (*keys)[(*count)++] = first_key(set);
+        return true;
+    case TAG_TWO:
+        if (!reserve(keys, *count, capacity, 2))
+            return false;
+        (*keys)[(*count)++] = first_key(set);
+        (*keys)[(*count)++] = second_key(set);
+        return true;
+    case TAG_VECTOR: {
+        const DepVector* vector = vector_of(set);
+        if (!reserve(keys, *count, capacity, vector->count))
+            return false;
+        memcpy(*keys + *count, vector->keys, vector->count * sizeof(int));
+        *count += vector->count;
+        return true;
+    }
+    default:
+        return collect_tree(tree_of(set), keys, count, capacity);
+    }
+}
+
+// Counts the keys of a run tree.
+static int count_tree(AVLTree root) {
+    return root ? count_tree(root->left) + root->length + count_tree(root->right) : 0;
+}
+
+int depset_count(DepSet set) {
+    if (set == 0)
+        return 0;
+    switch (set & TAG_MASK) {
+    case TAG_ONE:
+        return 1;
+    case TAG_TWO:
+        return 2;
+    case TAG_VECTOR:
+        return vector_of(set)->count;
+    default:
+        return count_tree(tree_of(set));
+    }
+}
+
+void depset_free(DepSet set) {
+    switch (set & TAG_MASK) {
+    case TAG_VECTOR:
+        free(vector_of(set));
+        break;
+    case TAG_TREE:
+        avl_free(tree_of(set));
+        break;
+    }
+}
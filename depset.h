@@ -0,0 +1,42 @@
+#ifndef DEPSET_H
+#define DEPSET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "avl.h"
+
+// A set of keys sized for the dependents of a cell: most cells have none
+// or a few, and only a handful have thousands. The set is one 64-bit word
+// holding, by its low two bits,
+//   00  nothing (the word is 0), or an AVL tree of key runs,
+//   01  one key inline, in bits 2-32,
+//   11  two ascending keys inline, in bits 2-32 and 33-63,
+//   10  a sorted vector of up to DEPSET_VECTOR_MAX keys,
+// so the common case is read from the cell itself. Keys are below 2^31.
+typedef uint64_t DepSet;
+
+#define DEPSET_VECTOR_MAX 32    // keys before a vector spills to a tree
+
+// Inserts key into set, moving it to the next larger form when the current
+// one is full. Returns set unchanged if memory runs out.
+DepSet depset_insert(DepSet set, int key);
+
+// Deletes key from set, moving back to inline keys when two are left.
+DepSet depset_delete(DepSet set, int key);
+
+// Builds a set from count strictly ascending keys.
+// Returns 0 if count is 0 or allocation fails.
+DepSet depset_build_sorted(const int* keys, int count);
+
+// Appends the keys of set in ascending order to the dynamic array keys,
+// which holds count of capacity ints and is doubled as needed. Returns
+// false, with only some of the keys appended, if memory runs out.
+bool depset_collect(DepSet set, int** keys, int* count, int* capacity);
+
+// Returns the number of keys in set, without allocating.
+int depset_count(DepSet set);
+
+// Frees whatever set holds outside the word itself.
+void depset_free(DepSet set);
+
+#endif // DEPSET_H
@@ -0,0 +1,4700 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include "sheet_internal.h"
+
+/* ---------- Contiguous Grid Access ---------- */
+Cell* get_cell_check(Spreadsheet* sheet, int index){
+    return &(sheet->grid[index]);
+}
+
+void get_row_col(int index, short* row, short* col, short total_cols){
+    *col = index%total_cols;
+    *row = index/total_cols;
+}
+
+/* ---------- Published Values ---------- */
+// The plane and how it is read are described in sheet_internal.h.
+// Sizes the plane for a rows x cols sheet and marks every tile stale. On
+// failure the plane still fits its old shape.
+static bool fit_plane(ValuePlane* plane, short rows, short cols) {
+    int total = rows * cols;
+    int tiles = (total + SNAPSHOT_TILE - 1) / SNAPSHOT_TILE;
+    atomic_int* values = realloc(plane->values, total * sizeof(atomic_int));
+    if (values)
+        plane->values = values;
+    atomic_uchar* errors = realloc(plane->errors, total * sizeof(atomic_uchar));
+    if (errors)
+        plane->errors = errors;
+    uint8_t* stale = realloc(plane->stale, tiles);
+    if (stale)
+        plane->stale = stale;
+    int* stale_list = realloc(plane->stale_list, tiles * sizeof(int));
+    if (stale_list)
+        plane->stale_list = stale_list;
+    if (!values || !errors || !stale || !stale_list)
+        return false;
+    plane->rows = rows;
+    plane->cols = cols;
+    for (int tile = 0; tile < tiles; tile++) {
+        plane->stale[tile] = 1;
+        plane->stale_list[tile] = tile;
+    }
+    plane->stale_count = tiles;
+    return true;
+}
+
+static void free_plane(ValuePlane* plane) {
+    pthread_rwlock_destroy(&plane->lock);
+    free(plane->values);
+    free(plane->errors);
+    free(plane->stale);
+    free(plane->stale_list);
+    free(plane);
+}
+
+// Copies the stale tiles and the viewport for readers.
+void publish_values(Spreadsheet* sheet) {
+    ValuePlane* plane = sheet->plane;
+    int total = sheet->rows * sheet->cols;
+    unsigned sequence = atomic_load_explicit(&plane->sequence, memory_order_relaxed);
+    atomic_store_explicit(&plane->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (int i = 0; i < plane->stale_count; i++) {
+        int tile = plane->stale_list[i];
+        int end = (tile + 1) * SNAPSHOT_TILE < total ? (tile + 1) * SNAPSHOT_TILE : total;
+        for (int key = tile * SNAPSHOT_TILE; key < end; key++) {
+            atomic_store_explicit(&plane->values[key], sheet->grid[key].value, memory_order_relaxed);
+            atomic_store_explicit(&plane->errors[key], sheet->grid[key].error_state, memory_order_relaxed);
+        }
+        plane->stale[tile] = 0;
+    }
+    plane->stale_count = 0;
+    atomic_store_explicit(&plane->viewport_row, sheet->viewport_row, memory_order_relaxed);
+    atomic_store_explicit(&plane->viewport_col, sheet->viewport_col, memory_order_relaxed);
+    atomic_store_explicit(&plane->output_enabled, sheet->output_enabled, memory_order_relaxed);
+    atomic_store_explicit(&plane->sequence, sequence + 2, memory_order_release);
+}
+
+// Starts publishing sheet's values. Returns false if there is no memory.
+bool create_plane(Spreadsheet* sheet) {
+    ValuePlane* plane = calloc(1, sizeof(ValuePlane));
+    if (!plane)
+        return false;
+    // A load takes the lock ahead of waiting readers, so a stream of
+    // reads cannot hold it off.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&plane->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    atomic_init(&plane->sequence, 0);
+    if (!fit_plane(plane, sheet->rows, sheet->cols)) {
+        free_plane(plane);
+        return false;
+    }
+    sheet->plane = plane;
+    publish_values(sheet);
+    return true;
+}
+
+/* ---------- Change Tracking ---------- */
+// Whether a cell now shows something other than (value, error). The value
+// of an erroneous cell is never shown, so it does not count.
+static inline bool cell_changed(const Cell* cell, int value, bool error) {
+    return cell->error_state != error || (!error && cell->value != value);
+}
+
+// Appends key to the change list if it lies in a subscribed range.
+static void note_change(Spreadsheet* sheet, int key) {
+    if (sheet->subscription_count > 0) {
+        short row, col;
+        get_row_col(key, &row, &col, sheet->cols);
+        int i = 0;
+        while (i < sheet->subscription_count
+               && !(row >= sheet->subscriptions[i].start_row && row <= sheet->subscriptions[i].end_row
+                    && col >= sheet->subscriptions[i].start_col && col <= sheet->subscriptions[i].end_col))
+            i++;
+        if (i == sheet->subscription_count)
+            return;
+    }
+    if (sheet->change_count == sheet->change_capacity) {
+        int capacity = sheet->change_capacity ? sheet->change_capacity * 2 : 64;
+        int* grown = realloc(sheet->changes, capacity * sizeof(int));
+        if (!grown)
+            return;
+        sheet->changes = grown;
+        sheet->change_capacity = capacity;
+    }
+    sheet->changes[sheet->change_count++] = key;
+}
+
+// reevaluate_formula for one cell, recording it if its shown value changed.
+static void evaluate_cell(Spreadsheet* sheet, int key, double* sleep_time) {
+    Cell* cell = get_cell_check(sheet, key);
+    if (!sheet->track_changes) {
+        reevaluate_formula(sheet, cell, sleep_time);
+        return;
+    }
+    int value = cell->value;
+    bool error = cell->error_state;
+    reevaluate_formula(sheet, cell, sleep_time);
+    if (cell_changed(cell, value, error))
+        note_change(sheet, key);
+}
+
+// Records that the tile holding key differs from the last snapshot, and
+// from what was last published.
+static inline void mark_dirty(Spreadsheet* sheet, int key) {
+    int tile = key / SNAPSHOT_TILE;
+    if (!sheet->dirty_tiles[tile]) {
+        sheet->dirty_tiles[tile] = 1;
+        sheet->dirty_list[sheet->dirty_count++] = tile;
+    }
+    if (sheet->plane && !sheet->plane->stale[tile]) {
+        sheet->plane->stale[tile] = 1;
+        sheet->plane->stale_list[sheet->plane->stale_count++] = tile;
+    }
+}
+
+static void clear_dirty(Spreadsheet* sheet) {
+    for (int i = 0; i < sheet->dirty_count; i++)
+        sheet->dirty_tiles[sheet->dirty_list[i]] = 0;
+    sheet->dirty_count = 0;
+}
+
+/* ---------- Program Pool ---------- */
+static inline Program* get_program(Spreadsheet* sheet, int slot) {
+    return sheet->programs[slot];
+}
+
+// Copies a compiled program into the pool and returns its slot, or -1.
+int store_program(Spreadsheet* sheet, const int* code, int length) {
+    Program* prog = malloc(sizeof(Program) + length * sizeof(int));
+    if (!prog) return -1;
+    prog->length = length;
+    memcpy(prog->code, code, length * sizeof(int));
+    if (sheet->free_program_count > 0) {
+        int slot = sheet->free_programs[--sheet->free_program_count];
+        sheet->programs[slot] = prog;
+        return slot;
+    }
+    if (sheet->program_count == sheet->program_capacity) {
+        int capacity = sheet->program_capacity ? sheet->program_capacity * 2 : 64;
+        Program** programs = realloc(sheet->programs, capacity * sizeof(Program*));
+        if (!programs) { free(prog); return -1; }
+        sheet->programs = programs;
+        int* free_programs = realloc(sheet->free_programs, capacity * sizeof(int));
+        if (!free_programs) { free(prog); return -1; }
+        sheet->free_programs = free_programs;
+        sheet->program_capacity = capacity;
+    }
+    sheet->programs[sheet->program_count] = prog;
+    return sheet->program_count++;
+}
+
+void free_program(Spreadsheet* sheet, int slot) {
+    free(sheet->programs[slot]);
+    sheet->programs[slot] = NULL;
+    sheet->free_programs[sheet->free_program_count++] = slot;
+}
+
+// Releases whatever a replaced formula owned.
+static inline void discard_formula(Spreadsheet* sheet, short old_formula, int old_cell1) {
+    if (old_formula == 1)
+        free_program(sheet, old_cell1);
+}
+
+// Finds the next precedent of a program at or after position pc. A single
+// cell reference is reported as a one-cell range (start_key == end_key).
+// Returns the position after it, or -1 once the program is exhausted.
+static int program_next_precedent(const int* code, int length, int pc, int* start_key, int* end_key) {
+    while (pc < length) {
+        switch (code[pc]) {
+            case OP_REF:
+                *start_key = *end_key = code[pc + 1];
+                return pc + 2;
+            case OP_AGG_RANGE:
+                *start_key = code[pc + 1];
+                *end_key = code[pc + 2];
+                return pc + 3;
+            case OP_CONST:
+            case OP_AGG_BEGIN:
+                pc += 2;
+                break;
+            default:
+                pc += 1;
+        }
+    }
+    return -1;
+}
+
+// For children dependency, we use a DepSet: inline keys, then a vector,
+// then an AVL tree of key runs.
+// Adds a child key to the parent's children set.
+void add_child(Cell* parent, short row, short col, short total_cols) {
+    int key = encode_cell_key(row, col, total_cols);
+    parent->children = depset_insert(parent->children, key);
+}
+
+// Removes a child key from the parent's children set.
+void remove_child(Cell* parent, int key) {
+    parent->children = depset_delete(parent->children, key);
+}
+
+// Removes key from the children of every cell in the range start_key..end_key.
+static void remove_child_range(Spreadsheet* sheet, int start_key, int end_key, int key) {
+    for(int r=start_key/sheet->cols; r<=end_key/sheet->cols; r++){
+        for(int c=start_key%sheet->cols; c<=end_key%sheet->cols; c++){
+            remove_child(get_cell(sheet, r, c), key);
+        }
+    }
+}
+
+// Adds (row, col) to the children of every cell in the range start_key..end_key.
+static void add_child_range(Spreadsheet* sheet, int start_key, int end_key, short row, short col) {
+    for(int r=start_key/sheet->cols; r<=end_key/sheet->cols; r++){
+        for(int c=start_key%sheet->cols; c<=end_key%sheet->cols; c++){
+            add_child(get_cell(sheet, r, c), row, col, sheet->cols);
+        }
+    }
+}
+
+// Removes all parents from a cell and the cell from every parent's children.
+void remove_all_parents(Spreadsheet *sheet, short row, short col){
+    int key = encode_cell_key(row, col, sheet->cols);
+    Cell* child = get_cell_check(sheet, key);
+    if(child->formula==-1){
+        return;
+    }
+    short rem = (short)(child->formula%10);
+    if(is_range_formula(child->formula)){
+        remove_child_range(sheet, child->cell1, child->cell2, key);
+    }
+    else if(child->formula==1){
+        Program* prog = get_program(sheet, child->cell1);
+        int start_key, end_key;
+        for(int pc = program_next_precedent(prog->code, prog->length, 0, &start_key, &end_key); pc >= 0;
+            pc = program_next_precedent(prog->code, prog->length, pc, &start_key, &end_key)){
+            remove_child_range(sheet, start_key, end_key, key);
+        }
+    }
+    else if(rem==0){
+        Cell* ref_cell1 = get_cell(sheet, child->cell1/sheet->cols, child->cell1%sheet->cols);
+        Cell* ref_cell2 = get_cell(sheet, child->cell2/sheet->cols, child->cell2%sheet->cols);
+        remove_child(ref_cell1, key);
+        remove_child(ref_cell2, key);
+    }
+    else if(rem==2){
+        Cell* ref_cell1 = get_cell(sheet, child->cell1/sheet->cols, child->cell1%sheet->cols);
+        remove_child(ref_cell1, key);
+    }
+    else if(rem==3){
+        Cell* ref_cell2 = get_cell(sheet, child->cell2/sheet->cols, child->cell2%sheet->cols);
+        remove_child(ref_cell2, key);
+    }
+}
+
+void add_children(Spreadsheet* sheet, int cell1, int cell2, short formula, short row, short col){
+    short rem = (int)(formula%10);
+    if(formula==-1)
+        return;
+    if(rem==0){
+        Cell* ref_cell1 = get_cell_check(sheet, cell1);
+        Cell* ref_cell2 = get_cell_check(sheet, cell2);
+        add_child(ref_cell1, row, col, sheet->cols);
+        add_child(ref_cell2, row, col, sheet->cols);
+    }
+    else if(rem==2){
+        Cell* ref_cell1 = get_cell_check(sheet, cell1);
+        add_child(ref_cell1, row, col, sheet->cols);
+    }
+    else if(rem==3){
+        Cell* ref_cell2 = get_cell_check(sheet, cell2);
+        add_child(ref_cell2, row, col, sheet->cols);
+    }
+    else if(is_range_formula(formula)){
+        add_child_range(sheet, cell1, cell2, row, col);
+    }
+    else if(formula==1){
+        Program* prog = get_program(sheet, cell1);
+        int start_key, end_key;
+        for(int pc = program_next_precedent(prog->code, prog->length, 0, &start_key, &end_key); pc >= 0;
+            pc = program_next_precedent(prog->code, prog->length, pc, &start_key, &end_key)){
+            add_child_range(sheet, start_key, end_key, row, col);
+        }
+    }
+}
+
+// Every precedent of a program takes an opcode and at least one operand.
+#define MAX_PRECEDENTS (MAX_PROGRAM_LENGTH / 2)
+#define MAX_RELINK_PIECES 256   // rectangles a difference may split into
+
+static Range key_range(const Spreadsheet* sheet, int start_key, int end_key) {
+    Range range = {(short)(start_key / sheet->cols), (short)(start_key % sheet->cols),
+                   (short)(end_key / sheet->cols), (short)(end_key % sheet->cols)};
+    return range;
+}
+
+// Fills ranges with the rectangles add_children links for a formula and
+// returns how many there are (at most MAX_PRECEDENTS).
+static int formula_precedents(Spreadsheet* sheet, short formula, int cell1, int cell2, Range* ranges) {
+    short rem = (short)(formula % 10);
+    int count = 0;
+    if (formula == -1)
+        return 0;
+    if (rem == 0) {
+        ranges[count++] = key_range(sheet, cell1, cell1);
+        ranges[count++] = key_range(sheet, cell2, cell2);
+    } else if (rem == 2) {
+        ranges[count++] = key_range(sheet, cell1, cell1);
+    } else if (rem == 3) {
+        ranges[count++] = key_range(sheet, cell2, cell2);
+    } else if (is_range_formula(formula)) {
+        ranges[count++] = key_range(sheet, cell1, cell2);
+    } else if (formula == 1) {
+        Program* prog = get_program(sheet, cell1);
+        int start_key, end_key;
+        for (int pc = program_next_precedent(prog->code, prog->length, 0, &start_key, &end_key); pc >= 0;
+             pc = program_next_precedent(prog->code, prog->length, pc, &start_key, &end_key))
+            ranges[count++] = key_range(sheet, start_key, end_key);
+    }
+    return count;
+}
+
+// Writes to out what is left of the count rectangles in pieces outside
+// cut: up to four strips of each one it overlaps. Returns the number of
+// rectangles, or -1 if there would be more than MAX_RELINK_PIECES.
+static int subtract_range(const Range* pieces, int count, const Range* cut, Range* out) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        Range p = pieces[i];
+        short top = p.start_row > cut->start_row ? p.start_row : cut->start_row;
+        short bottom = p.end_row < cut->end_row ? p.end_row : cut->end_row;
+        short left = p.start_col > cut->start_col ? p.start_col : cut->start_col;
+        short right = p.end_col < cut->end_col ? p.end_col : cut->end_col;
+        if (top > bottom || left > right) {
+            if (n == MAX_RELINK_PIECES)
+                return -1;
+            out[n++] = p;
+            continue;
+        }
+        if (n + 4 > MAX_RELINK_PIECES)
+            return -1;
+        if (p.start_row < top)
+            out[n++] = (Range){p.start_row, p.start_col, (short)(top - 1), p.end_col};
+        if (bottom < p.end_row)
+            out[n++] = (Range){(short)(bottom + 1), p.start_col, p.end_row, p.end_col};
+        if (p.start_col < left)
+            out[n++] = (Range){top, p.start_col, bottom, (short)(left - 1)};
+        if (right < p.end_col)
+            out[n++] = (Range){top, (short)(right + 1), bottom, p.end_col};
+    }
+    return n;
+}
+
+// Writes to out the cells of the rectangles in from that lie outside every
+// rectangle in cuts, as rectangles. Returns their number, or -1 if there
+// would be more than MAX_RELINK_PIECES.
+static int range_difference(const Range* from, int from_count, const Range* cuts, int cut_count, Range* out) {
+    Range scratch[MAX_RELINK_PIECES];
+    Range* pieces = out;
+    Range* next = scratch;
+    memcpy(pieces, from, from_count * sizeof(Range));
+    int count = from_count;
+    for (int i = 0; i < cut_count && count > 0; i++) {
+        count = subtract_range(pieces, count, &cuts[i], next);
+        if (count < 0)
+            return -1;
+        Range* swap = pieces;
+        pieces = next;
+        next = swap;
+    }
+    if (pieces != out)
+        memcpy(out, pieces, count * sizeof(Range));
+    return count;
+}
+
+// Moves (row, col) from the children of the old formula's precedents to
+// those of the new one. Only cells in one precedent set and not the other
+// are touched, so growing SUM(A1:A10000) to A10001 links a single cell.
+// Both formulas must still be installed (their programs stored).
+static void relink_parents(Spreadsheet* sheet, short row, short col, short old_formula, int old_cell1, int old_cell2,
+                           short formula, int cell1, int cell2) {
+    int key = encode_cell_key(row, col, sheet->cols);
+    int cols = sheet->cols;
+    Range old_ranges[MAX_PRECEDENTS], new_ranges[MAX_PRECEDENTS], changed[MAX_RELINK_PIECES];
+    int old_count = formula_precedents(sheet, old_formula, old_cell1, old_cell2, old_ranges);
+    int new_count = formula_precedents(sheet, formula, cell1, cell2, new_ranges);
+    const Range* removed = changed;
+    int removed_count = range_difference(old_ranges, old_count, new_ranges, new_count, changed);
+    bool diffed = removed_count >= 0;
+    if (!diffed) {
+        // Too fragmented to diff: unlink all of the old, then link all of the new.
+        removed = old_ranges;
+        removed_count = old_count;
+    }
+    for (int i = 0; i < removed_count; i++)
+        remove_child_range(sheet, removed[i].start_row * cols + removed[i].start_col,
+                           removed[i].end_row * cols + removed[i].end_col, key);
+    const Range* added = new_ranges;
+    int added_count = new_count;
+    if (diffed) {
+        int count = range_difference(new_ranges, new_count, old_ranges, old_count, changed);
+        if (count >= 0) {
+            added = changed;
+            added_count = count;
+        }
+    }
+    for (int i = 0; i < added_count; i++)
+        add_child_range(sheet, added[i].start_row * cols + added[i].start_col,
+                        added[i].end_row * cols + added[i].end_col, row, col);
+}
+
+/* ---------- Rolling Windows ---------- */
+// A ROLL formula aggregates its window like the range formula 100 below
+// it, but append_row slides the window down a row whenever it writes the
+// row just below, so the window keeps covering the latest rows. Each one
+// keeps its aggregate between evaluations: a slide takes out the row that
+// leaves and the evaluation that follows adds the row that enters, so a
+// tick costs the window's width rather than its area. Sums and sums of
+// squares serve SUM, AVG and STDEV; MIN and MAX keep a monotonic deque of
+// row extremes, oldest first. When anything else in the window changes the
+// aggregate is rebuilt from the cells.
+struct Roll {
+    int key;            // the formula cell; sheet->rolls is sorted by key
+    int start;          // window the aggregate covers, -1 for none
+    int end;
+    int changed;        // precedents the running recalculation evaluates
+    int count;          // cells, with those in error
+    int errors;
+    long long sum;      // over the cells not in error
+    long long sum_squares;
+    short* rows;        // deque, a ring of capacity entries from head
+    int* extremes;
+    int head;
+    int length;
+    int capacity;
+};
+
+static Roll* find_roll(const Spreadsheet* sheet, int key) {
+    int lo = 0, hi = sheet->roll_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sheet->rolls[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < sheet->roll_count && sheet->rolls[lo].key == key) ? &sheet->rolls[lo] : NULL;
+}
+
+// Starts keeping state for the ROLL formula being installed on key, with
+// nothing aggregated yet. Returns NULL if memory runs out.
+static Roll* track_roll(Spreadsheet* sheet, int key) {
+    Roll* roll = find_roll(sheet, key);
+    if (!roll) {
+        if (sheet->roll_count == sheet->roll_capacity) {
+            int capacity = sheet->roll_capacity ? sheet->roll_capacity * 2 : 16;
+            Roll* grown = realloc(sheet->rolls, capacity * sizeof(Roll));
+            if (!grown)
+                return NULL;
+            sheet->rolls = grown;
+            sheet->roll_capacity = capacity;
+        }
+        int at = 0;
+        while (at < sheet->roll_count && sheet->rolls[at].key < key)
+            at++;
+        memmove(&sheet->rolls[at + 1], &sheet->rolls[at], (sheet->roll_count - at) * sizeof(Roll));
+        sheet->roll_count++;
+        roll = &sheet->rolls[at];
+        memset(roll, 0, sizeof(*roll));
+        roll->key = key;
+    }
+    roll->start = roll->end = -1;
+    return roll;
+}
+
+// Drops the state of a cell that no longer holds a ROLL formula.
+static void untrack_roll(Spreadsheet* sheet, Roll* roll) {
+    free(roll->rows);
+    free(roll->extremes);
+    int at = (int)(roll - sheet->rolls);
+    memmove(roll, roll + 1, (sheet->roll_count - at - 1) * sizeof(Roll));
+    sheet->roll_count--;
+}
+
+static void free_rolls(Spreadsheet* sheet) {
+    for (int i = 0; i < sheet->roll_count; i++) {
+        free(sheet->rolls[i].rows);
+        free(sheet->rolls[i].extremes);
+    }
+    free(sheet->rolls);
+}
+
+// Folds cells col1..col2 of row into the aggregate of a roll with formula.
+static void roll_add_row(Spreadsheet* sheet, Roll* roll, short formula, int row, int col1, int col2) {
+    bool extreme_found = false;
+    int extreme = 0;
+    for (int c = col1; c <= col2; c++) {
+        const Cell* cell = &sheet->grid[row * sheet->cols + c];
+        roll->count++;
+        if (cell->error_state) {
+            roll->errors++;
+            continue;
+        }
+        roll->sum += cell->value;
+        roll->sum_squares += (long long)cell->value * cell->value;
+        if (!extreme_found || (formula == 107 ? cell->value < extreme : cell->value > extreme))
+            extreme = cell->value;
+        extreme_found = true;
+    }
+    if ((formula != 107 && formula != 108) || !extreme_found)
+        return;
+    // Older rows that can no longer be the extreme leave from the back.
+    while (roll->length > 0) {
+        int back = roll->extremes[(roll->head + roll->length - 1) % roll->capacity];
+        if (formula == 107 ? back < extreme : back > extreme)
+            break;
+        roll->length--;
+    }
+    int at = (roll->head + roll->length++) % roll->capacity;
+    roll->rows[at] = (short)row;
+    roll->extremes[at] = extreme;
+}
+
+// Takes cells col1..col2 of row, the oldest of the window, back out.
+static void roll_drop_row(Spreadsheet* sheet, Roll* roll, int row, int col1, int col2) {
+    for (int c = col1; c <= col2; c++) {
+        const Cell* cell = &sheet->grid[row * sheet->cols + c];
+        roll->count--;
+        if (cell->error_state) {
+            roll->errors--;
+            continue;
+        }
+        roll->sum -= cell->value;
+        roll->sum_squares -= (long long)cell->value * cell->value;
+    }
+    if (roll->length > 0 && roll->rows[roll->head] == row) {
+        roll->head = (roll->head + 1) % roll->capacity;
+        roll->length--;
+    }
+}
+
+// Aggregates the window of cell from scratch. Returns false if memory for
+// the deque runs out, leaving the roll with no state.
+static bool roll_rebuild(Spreadsheet* sheet, Roll* roll, const Cell* cell) {
+    int cols = sheet->cols;
+    int rows = cell->cell2 / cols - cell->cell1 / cols + 1;
+    roll->start = roll->end = -1;
+    if (roll->capacity < rows) {
+        short* grown_rows = realloc(roll->rows, rows * sizeof(short));
+        if (grown_rows)
+            roll->rows = grown_rows;
+        int* grown_extremes = realloc(roll->extremes, rows * sizeof(int));
+        if (grown_extremes)
+            roll->extremes = grown_extremes;
+        if (!grown_rows || !grown_extremes)
+            return false;
+        roll->capacity = rows;
+    }
+    roll->count = roll->errors = 0;
+    roll->sum = roll->sum_squares = 0;
+    roll->head = roll->length = 0;
+    for (int r = cell->cell1 / cols; r <= cell->cell2 / cols; r++)
+        roll_add_row(sheet, roll, cell->formula, r, cell->cell1 % cols, cell->cell2 % cols);
+    roll->start = cell->cell1;
+    roll->end = cell->cell2;
+    return true;
+}
+
+// Whether sliding the windows of the slid ROLL formulas down onto row
+// would make the one at key depend on itself: whether a cell of row under
+// its window is key or depends on it, where each slid formula also counts
+// as a dependent of the row cells under its own window. Walks only what
+// depends on key, marking it in the visited scratch and clearing it again.
+// Says yes if memory runs out.
+static bool reaches_row(Spreadsheet* sheet, int key, int row, const int* slid, int slid_count) {
+    bool* visited = sheet->visited;
+    int capacity = 8, count = 0;
+    int found_capacity = 64, found_count = 0;
+    int* children = malloc(capacity * sizeof(int));
+    int* found = malloc(found_capacity * sizeof(int));
+    bool reached = !children || !found;
+    if (!reached) {
+        visited[key] = true;
+        found[found_count++] = key;
+    }
+    for (int i = 0; i < found_count && !reached; i++) {
+        int k = found[i];
+        count = 0;
+        if (k / sheet->cols == row) {
+            int col = k % sheet->cols;
+            for (int j = 0; j < slid_count; j++) {
+                const Cell* window = &sheet->grid[slid[j]];
+                if (col < window->cell1 % sheet->cols || col > window->cell2 % sheet->cols)
+                    continue;
+                if (slid[j] == key) {
+                    reached = true;
+                    break;
+                }
+                if (count == capacity) {
+                    int* grown = realloc(children, 2 * capacity * sizeof(int));
+                    if (!grown) {
+                        reached = true;
+                        break;
+                    }
+                    children = grown;
+                    capacity *= 2;
+                }
+                children[count++] = slid[j];
+            }
+            if (reached)
+                break;
+        }
+        if (!depset_collect(sheet->grid[k].children, &children, &count, &capacity)) {
+            reached = true;
+            break;
+        }
+        for (int j = 0; j < count && !reached; j++) {
+            if (visited[children[j]])
+                continue;
+            if (found_count == found_capacity) {
+                int* grown = realloc(found, 2 * found_capacity * sizeof(int));
+                if (!grown) {
+                    reached = true;
+                    break;
+                }
+                found = grown;
+                found_capacity *= 2;
+            }
+            visited[children[j]] = true;
+            found[found_count++] = children[j];
+        }
+    }
+    for (int i = 0; i < found_count; i++)
+        visited[found[i]] = false;
+    free(children);
+    free(found);
+    return reached;
+}
+
+// Records, for each roll among the keys about to be evaluated, how many of
+// its precedents are evaluated before it, its in-degree in pending.
+static void note_roll_inputs(Spreadsheet* sheet, const int* keys, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!is_roll_formula(sheet->grid[keys[i]].formula))
+            continue;
+        Roll* roll = find_roll(sheet, keys[i]);
+        if (roll)
+            roll->changed = sheet->pending[keys[i]];
+    }
+}
+
+/* ---------- Level-Batched Evaluation ---------- */
+// Levels smaller than this are evaluated cell by cell.
+#define BATCH_MIN_LEVEL 16
+
+// Scratch for one recalculation, sized to the affected set on first use.
+typedef struct {
+    int capacity;
+    int* sorted;            // level keys grouped by formula code
+    int* a;                 // gathered left operands
+    int* b;                 // gathered right operands
+    int* out;
+    unsigned char* err;
+} BatchScratch;
+
+static inline bool formula_is_batchable(short formula) {
+    short rem = formula % 10;
+    return formula == 82 || (formula >= 10 && formula <= 43 && (rem == 0 || rem == 2 || rem == 3));
+}
+
+// Evaluates cells that share one arithmetic formula code: gathers their
+// operands into contiguous arrays, runs one branch-free kernel over them and
+// scatters the results. The kernels are plain loops over contiguous arrays;
+// the gathers and scatters, not the arithmetic, dominate the cost.
+static void evaluate_batch(Spreadsheet* sheet, short formula, const int* keys, int count, BatchScratch* scratch) {
+    Cell* grid = sheet->grid;
+    int* restrict a = scratch->a;
+    int* restrict b = scratch->b;
+    int* restrict out = scratch->out;
+    unsigned char* restrict err = scratch->err;
+
+    // Gather.
+    switch (formula % 10) {
+        case 0:
+            for (int i = 0; i < count; i++) {
+                const Cell* cell = &grid[keys[i]];
+                const Cell* ref_cell1 = &grid[cell->cell1];
+                const Cell* ref_cell2 = &grid[cell->cell2];
+                a[i] = ref_cell1->value;
+                b[i] = ref_cell2->value;
+                err[i] = ref_cell1->error_state | ref_cell2->error_state;
+            }
+            break;
+        case 2:
+            for (int i = 0; i < count; i++) {
+                const Cell* cell = &grid[keys[i]];
+                const Cell* ref_cell1 = &grid[cell->cell1];
+                a[i] = ref_cell1->value;
+                b[i] = cell->cell2;
+                err[i] = ref_cell1->error_state;
+            }
+            break;
+        default:
+            for (int i = 0; i < count; i++) {
+                const Cell* cell = &grid[keys[i]];
+                const Cell* ref_cell2 = &grid[cell->cell2];
+                a[i] = cell->cell1;
+                b[i] = ref_cell2->value;
+                err[i] = ref_cell2->error_state;
+            }
+    }
+
+    // Kernel.
+    switch (formula / 10) {
+        case 1:
+            for (int i = 0; i < count; i++)
+                out[i] = a[i] + b[i];
+            break;
+        case 2:
+            for (int i = 0; i < count; i++)
+                out[i] = a[i] - b[i];
+            break;
+        case 3:
+            for (int i = 0; i < count; i++) {
+                err[i] |= (b[i] == 0);
+                out[i] = a[i] / (b[i] ? b[i] : 1);
+            }
+            break;
+        case 4:
+            for (int i = 0; i < count; i++)
+                out[i] = a[i] * b[i];
+            break;
+        default:    // 82: plain reference
+            for (int i = 0; i < count; i++)
+                out[i] = a[i];
+    }
+
+    // Scatter. An erroneous cell keeps its old value, as in the handlers.
+    for (int i = 0; i < count; i++) {
+        Cell* cell = &grid[keys[i]];
+        if (sheet->track_changes && cell_changed(cell, out[i], err[i]))
+            note_change(sheet, keys[i]);
+        if (err[i]) {
+            cell->error_state = 1;
+        } else {
+            cell->value = out[i];
+            cell->error_state = 0;
+        }
+    }
+}
+
+// Evaluates one topological level. Cells of a level never depend on each
+// other, so they can be regrouped by formula code freely.
+static void evaluate_level(Spreadsheet* sheet, const int* keys, int count, BatchScratch* scratch, double* sleep_time) {
+    if (count < BATCH_MIN_LEVEL || !scratch->sorted) {
+        for (int i = 0; i < count; i++)
+            evaluate_cell(sheet, keys[i], sleep_time);
+        return;
+    }
+    // Counting sort on formula code + 1, the same index as formula_evals.
+    int bucket[112] = {0};
+    for (int i = 0; i < count; i++)
+        bucket[sheet->grid[keys[i]].formula + 2]++;
+    for (int k = 1; k < 112; k++)
+        bucket[k] += bucket[k - 1];
+    int fill[111];
+    memcpy(fill, bucket, sizeof(fill));
+    for (int i = 0; i < count; i++)
+        scratch->sorted[fill[sheet->grid[keys[i]].formula + 1]++] = keys[i];
+
+    for (int k = 0; k < 111; k++) {
+        int start = bucket[k], n = bucket[k + 1] - bucket[k];
+        if (n == 0)
+            continue;
+        short formula = (short)(k - 1);
+        if (n > 1 && formula_is_batchable(formula)) {
+            evaluate_batch(sheet, formula, scratch->sorted + start, n, scratch);
+        } else {
+            for (int i = start; i < start + n; i++)
+                evaluate_cell(sheet, scratch->sorted[i], sleep_time);
+        }
+    }
+}
+
+static bool batch_scratch_init(BatchScratch* scratch, int capacity) {
+    scratch->capacity = capacity;
+    scratch->sorted = malloc(capacity * sizeof(int));
+    scratch->a = malloc(capacity * sizeof(int));
+    scratch->b = malloc(capacity * sizeof(int));
+    scratch->out = malloc(capacity * sizeof(int));
+    scratch->err = malloc(capacity);
+    if (scratch->sorted && scratch->a && scratch->b && scratch->out && scratch->err)
+        return true;
+    free(scratch->sorted); free(scratch->a); free(scratch->b); free(scratch->out); free(scratch->err);
+    scratch->sorted = NULL;
+    return false;
+}
+
+static void batch_scratch_free(BatchScratch* scratch) {
+    if (!scratch->sorted)
+        return;
+    free(scratch->sorted); free(scratch->a); free(scratch->b); free(scratch->out); free(scratch->err);
+}
+
+// Revised reevaluate_topologically using in-degree (Kahn’s algorithm) and encoded keys.
+// In-degrees are counted over the children sets, so a parent referenced more
+// than once by the same formula (A1+A1, SUM(A1:A3)+A2) is a single edge.
+// Ready cells are released one level at a time and each level is evaluated
+// in formula-code batches. The visited/pending arrays live in the sheet and
+// are reset before returning, so a recalc costs O(affected), not O(sheet).
+//
+// The affected set is the roots plus everything reachable from the sources
+// through children; the sources themselves are not evaluated unless they are
+// also roots. A single assignment has been cycle checked already; a bulk
+// change asks for check_cycles, which first releases the cells without
+// evaluating them and returns CMD_CIRCULAR_REF, evaluating nothing, if some
+// never are. Returns CMD_IO_ERROR, evaluating nothing, if memory runs out.
+static CommandStatus recalculate(Spreadsheet* sheet, const int* sources, int source_count,
+                        const int* roots, int root_count, bool check_cycles, double* sleep_time) {
+    bool *visited = sheet->visited;
+    int *pending = sheet->pending;
+
+    // Scratch buffer for children keys, reused for every cell.
+    int capacity = 8, count = 0;
+    int *childKeys = malloc(capacity * sizeof(int));
+    // Affected cells in discovery order; the array doubles as the BFS work list.
+    int affectedCapacity = root_count > 64 ? root_count : 64, affectedCount = 0;
+    int *affected = malloc(affectedCapacity * sizeof(int));
+    if (!childKeys || !affected) { free(childKeys); free(affected); return CMD_IO_ERROR; }
+
+    CommandStatus status = CMD_OK;
+    for (int i = 0; i < root_count; i++) {
+        visited[roots[i]] = true;
+        affected[affectedCount++] = roots[i];
+    }
+    // The sources come first, then every cell found so far. A cell is
+    // marked visited only once it is in affected, so it is cleared below.
+    for (int i = -source_count; i < affectedCount && status == CMD_OK; i++) {
+        count = 0;
+        int key = (i < 0) ? sources[i + source_count] : affected[i];
+        if (!depset_collect(get_cell_check(sheet, key)->children, &childKeys, &count, &capacity)) {
+            status = CMD_IO_ERROR;
+            break;
+        }
+        for (int j = 0; j < count; j++) {
+            int childKey = childKeys[j];
+            if (visited[childKey])
+                continue;
+            if (affectedCount == affectedCapacity) {
+                int *grown = realloc(affected, 2 * affectedCapacity * sizeof(int));
+                if (!grown) {
+                    status = CMD_IO_ERROR;
+                    break;
+                }
+                affected = grown;
+                affectedCapacity *= 2;
+            }
+            visited[childKey] = true;
+            affected[affectedCount++] = childKey;
+        }
+    }
+
+    int *queue = NULL;
+    if (status == CMD_OK && affectedCount > 0 && !(queue = malloc(affectedCount * sizeof(int))))
+        status = CMD_IO_ERROR;
+    BatchScratch scratch = { 0 };
+    // Every children set below was collected above into childKeys, so
+    // collecting it again never needs to grow the buffer and cannot fail.
+    for (int pass = check_cycles ? 0 : 1; queue && status == CMD_OK && pass < 2; pass++) {
+        // Compute in-degree for each affected cell: one per affected parent.
+        for (int i = 0; i < affectedCount; i++) {
+            count = 0;
+            depset_collect(get_cell_check(sheet, affected[i])->children, &childKeys, &count, &capacity);
+            for (int j = 0; j < count; j++)
+                pending[childKeys[j]]++;
+        }
+        if (pass == 1 && sheet->roll_count > 0)
+            note_roll_inputs(sheet, affected, affectedCount);
+
+        // Prepare queue for Kahn's algorithm.
+        int qFront = 0, qRear = 0;
+        for (int i = 0; i < affectedCount; i++) {
+            if (pending[affected[i]] == 0)
+                queue[qRear++] = affected[i];
+        }
+        if (pass == 1 && affectedCount >= BATCH_MIN_LEVEL)
+            batch_scratch_init(&scratch, affectedCount);
+
+        // Process cells in topological order, one level at a time.
+        while (qFront < qRear) {
+            int levelEnd = qRear;
+            if (pass == 1)
+                evaluate_level(sheet, queue + qFront, levelEnd - qFront, &scratch, sleep_time);
+            // Every affected child of the level loses its pending parents.
+            for (; qFront < levelEnd; qFront++) {
+                count = 0;
+                depset_collect(get_cell_check(sheet, queue[qFront])->children, &childKeys, &count, &capacity);
+                for (int j = 0; j < count; j++) {
+                    if (visited[childKeys[j]] && --pending[childKeys[j]] == 0)
+                        queue[qRear++] = childKeys[j];
+                }
+            }
+        }
+        if (pass == 0) {
+            // Cells on a cycle still wait for each other.
+            if (qRear != affectedCount)
+                status = CMD_CIRCULAR_REF;
+            for (int i = 0; i < affectedCount; i++)
+                pending[affected[i]] = 0;
+        }
+    }
+
+    // Leave the shared scratch clean for the next recalc.
+    for (int i = 0; i < affectedCount; i++) {
+        visited[affected[i]] = false;
+        pending[affected[i]] = 0;
+        if (status == CMD_OK)
+            mark_dirty(sheet, affected[i]);
+    }
+    batch_scratch_free(&scratch);
+    free(queue);
+    free(affected);
+    free(childKeys);
+    return status;
+}
+
+// Recalculates everything that depends on the modified cell, but not the
+// cell itself.
+// Prototype: CommandStatus reevaluate_topologically(Spreadsheet* sheet, short modRow, short modCol)
+CommandStatus reevaluate_topologically(Spreadsheet* sheet, short modRow, short modCol, double* sleep_time) {
+    int key = encode_cell_key(modRow, modCol, sheet->cols);
+    return recalculate(sheet, &key, 1, NULL, 0, false, sleep_time);
+}
+
+// Whether the target cell, or a cell that depends on it, lies in the range.
+// Says yes if memory runs out.
+bool detect_cycle_range(Spreadsheet *sheet, short rStart, short cStart, short rEnd, short cEnd, short tRow, short tCol) {
+    int totalCells = (int)(sheet->rows * sheet->cols);
+    // Encode the target cell (the one being updated).
+    int targetKey = encode_cell_key(tRow, tCol, sheet->cols);
+    // Allocate a DFS stack (an array of cell keys); worst-case, every cell of the sheet.
+    int *stack = malloc(totalCells * sizeof(int));
+    bool *visited = calloc(totalCells, sizeof(bool));
+    int capacity = 8, count = 0;
+    int *childKeys = malloc(capacity * sizeof(int));
+    if (!stack || !visited || !childKeys) {
+        free(stack); free(visited); free(childKeys);
+        return true;
+    }
+    int stackTop = 0;
+    stack[stackTop++] = targetKey;  // Start from the target cell.
+    visited[targetKey] = true;
+    bool cycleFound = false;
+    // Process the DFS stack; each descendant is expanded once.
+    while (stackTop > 0 && !cycleFound) {
+        int curKey = stack[--stackTop];
+        // Compute row and column of the current cell.
+        short curRow = (short)(curKey / sheet->cols);
+        short curCol = (short)(curKey % sheet->cols);
+        if(curRow <= rEnd && curRow >= rStart && curCol <= cEnd && curCol >= cStart){
+            cycleFound = true;
+            break;
+        }
+        // Get the current cell.
+        Cell* curCell = get_cell_check(sheet, curKey);
+
+        // Retrieve child dependency keys from the cell's children set.
+        count = 0;
+        if (!depset_collect(curCell->children, &childKeys, &count, &capacity)) {
+            cycleFound = true;
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            int childKey = childKeys[i];
+            if (!visited[childKey]) {
+                visited[childKey] = true;
+                stack[stackTop++] = childKey;
+            }
+        }
+    }
+    free(childKeys);
+    free(visited);
+    free(stack);
+    return cycleFound;
+}
+
+static int detect_cycle_helper(Spreadsheet *sheet, int currentKey, int sourceKey, short *visited) {
+    // If we've reached the source cell, a cycle exists.
+    if (currentKey == sourceKey)
+        return 1;
+    
+    // If this cell is already in the recursion stack, cycle detected.
+    if (visited[currentKey] == 1)
+        return 1;
+
+    // If already completely processed, no cycle from this node.
+    if (visited[currentKey] == 2)
+        return 0;
+    
+    // Mark this cell as “being processed.”
+    visited[currentKey] = 1;
+    
+    bool cycleFound = 0;
+    Cell *cell = get_cell_check(sheet, currentKey);
+    
+    // If this is a literal (no formula), there are no dependencies.
+    if (cell->formula == -1) {
+        visited[currentKey] = 2;
+        return 0;
+    }
+    
+    int rem = cell->formula % 10;
+    
+    if (rem == 0) {
+        cycleFound = detect_cycle_helper(sheet, cell->cell1, sourceKey, visited);
+        if (!cycleFound)
+            cycleFound = detect_cycle_helper(sheet, cell->cell2, sourceKey, visited);
+    }
+    else if (rem == 2) {
+        cycleFound = detect_cycle_helper(sheet, cell->cell1, sourceKey, visited);
+    }
+    else if (rem == 3) {
+        cycleFound = detect_cycle_helper(sheet, cell->cell2, sourceKey, visited);
+    }
+    // Handle range formulas (formula codes 5-9 and 105-109)
+    else if (is_range_formula(cell->formula)) {
+        int cols = sheet->cols;
+        int startKey = cell->cell1, endKey = cell->cell2;
+        short startRow = (short)(startKey / cols), startCol = (short)(startKey % cols);
+        short endRow = (short)(endKey / cols), endCol = (short)(endKey % cols);
+        for (short r = startRow; r <= endRow && !cycleFound; r++) {
+            for (short c = startCol; c <= endCol && !cycleFound; c++) {
+                cycleFound = detect_cycle_helper(sheet, (int)(r*sheet->cols + c), sourceKey, visited);
+            }
+        }
+    }
+    // Compiled expressions: every cell of every precedent.
+    else if (cell->formula == 1) {
+        Program* prog = get_program(sheet, cell->cell1);
+        int startKey, endKey;
+        for (int pc = program_next_precedent(prog->code, prog->length, 0, &startKey, &endKey); pc >= 0 && !cycleFound;
+             pc = program_next_precedent(prog->code, prog->length, pc, &startKey, &endKey)) {
+            for (int r = startKey / sheet->cols; r <= endKey / sheet->cols && !cycleFound; r++) {
+                for (int c = startKey % sheet->cols; c <= endKey % sheet->cols && !cycleFound; c++) {
+                    cycleFound = detect_cycle_helper(sheet, r * sheet->cols + c, sourceKey, visited);
+                }
+            }
+        }
+    }
+    
+    // Mark this cell as completely processed.
+    visited[currentKey] = 2;
+    return cycleFound;
+}
+
+bool detect_cycle_recursive(Spreadsheet *sheet, short srcRow, short srcCol, short targetRow, short targetCol) {
+    int totalCells = sheet->rows * sheet->cols;
+    int sourceKey = srcRow * sheet->cols + srcCol;
+    int targetKey = targetRow * sheet->cols + targetCol;
+    
+    // Allocate an array to track visited cells.
+    short *visited = (short *)calloc(totalCells, sizeof(short));
+    if (!visited) {
+        fprintf(stderr, "Failed to allocate visited array\n");
+        return false;
+    }
+    
+    bool cycle = detect_cycle_helper(sheet, sourceKey, targetKey, visited);
+    free(visited);
+    return cycle;
+}
+
+// Checks whether any precedent of a compiled expression placed on
+// (targetRow, targetCol) already depends on that cell.
+bool detect_cycle_program(Spreadsheet *sheet, const int* code, int length, short targetRow, short targetCol) {
+    int totalCells = sheet->rows * sheet->cols;
+    int targetKey = targetRow * sheet->cols + targetCol;
+    short *visited = (short *)calloc(totalCells, sizeof(short));
+    if (!visited) {
+        fprintf(stderr, "Failed to allocate visited array\n");
+        return false;
+    }
+    // One visited array serves all precedents: a finished cell cannot reach the target.
+    bool cycle = false;
+    int startKey, endKey;
+    for (int pc = program_next_precedent(code, length, 0, &startKey, &endKey); pc >= 0 && !cycle;
+         pc = program_next_precedent(code, length, pc, &startKey, &endKey)) {
+        for (int r = startKey / sheet->cols; r <= endKey / sheet->cols && !cycle; r++) {
+            for (int c = startKey % sheet->cols; c <= endKey % sheet->cols && !cycle; c++) {
+                cycle = detect_cycle_helper(sheet, r * sheet->cols + c, targetKey, visited);
+            }
+        }
+    }
+    free(visited);
+    return cycle;
+}
+
+// Writes the letters of 1-based column col into name (at least 4 bytes).
+void get_column_name(int col, char* name) {
+    int i = 0;
+    while (col > 0) {
+        name[i++] = 'A' + (col - 1) % 26;
+        col = (col - 1) / 26;
+    }
+    name[i] = '\0';
+    for (int j = 0; j < i / 2; j++) {
+        char temp = name[j];
+        name[j] = name[i - 1 - j];
+        name[i - 1 - j] = temp;
+    }
+}
+
+// Column letter digits: 1-26 for 'A'-'Z', 0 for every other byte.
+static const unsigned char column_digit[256] = {
+    ['A'] = 1,  ['B'] = 2,  ['C'] = 3,  ['D'] = 4,  ['E'] = 5,  ['F'] = 6,  ['G'] = 7,
+    ['H'] = 8,  ['I'] = 9,  ['J'] = 10, ['K'] = 11, ['L'] = 12, ['M'] = 13, ['N'] = 14,
+    ['O'] = 15, ['P'] = 16, ['Q'] = 17, ['R'] = 18, ['S'] = 19, ['T'] = 20, ['U'] = 21,
+    ['V'] = 22, ['W'] = 23, ['X'] = 24, ['Y'] = 25, ['Z'] = 26
+};
+
+// Decodes the cell name at p (one to three capital letters, then digits)
+// in one pass. Returns the position just past it, or NULL if p does not
+// start with a cell name. row and col may still lie outside the sheet.
+const char* scan_cell(const char* p, short* row, short* col) {
+    int c = 0, r = 0, letters = 0;
+    for (; column_digit[(unsigned char)*p]; p++) {
+        if (++letters > 3)
+            return NULL;
+        c = c * 26 + column_digit[(unsigned char)*p];
+    }
+    if (letters == 0 || !isdigit((unsigned char)*p))
+        return NULL;
+    for (; isdigit((unsigned char)*p); p++) {
+        if (r <= MAX_ROWS)      // saturate, anything larger is out of range
+            r = r * 10 + (*p - '0');
+    }
+    *row = (short)(r - 1);
+    *col = (short)(c - 1);
+    return p;
+}
+
+void parse_cell_reference(const char* cell, short* row, short* col) {
+    const char* end = scan_cell(cell, row, col);
+    if (!end || *end != '\0')
+        *row = *col = -1;
+}
+
+// Parses a whole "CELL:CELL" string into range.
+static CommandStatus parse_range(Spreadsheet* sheet, const char* text, Range* range) {
+    const char* colon = scan_cell(text, &range->start_row, &range->start_col);
+    if (!colon || !cell_in_sheet(sheet, range->start_row, range->start_col))
+        return CMD_INVALID_CELL;
+    if (*colon != ':')
+        return CMD_INVALID_RANGE;
+    const char* end = scan_cell(colon + 1, &range->end_row, &range->end_col);
+    if (!end || *end != '\0' || !cell_in_sheet(sheet, range->end_row, range->end_col))
+        return CMD_INVALID_CELL;
+    if (range->start_row > range->end_row || range->start_col > range->end_col)
+        return CMD_INVALID_RANGE;
+    return CMD_OK;
+}
+
+/* ---------- Expression Compiler ---------- */
+// Recursive descent over
+//   expr    := term (('+' | '-') term)*
+//   term    := unary (('*' | '/') unary)*
+//   unary   := ('-' | '+') unary | primary
+//   primary := NUMBER | CELL | FUNC '(' arg (',' arg)* ')' | '(' expr ')'
+//   arg     := CELL ':' CELL | expr
+// emitting postfix bytecode into a caller-provided buffer.
+typedef struct {
+    Spreadsheet* sheet;
+    const char* pos;
+    int* code;
+    int length;
+    int depth;          // value stack depth after the code emitted so far
+    int max_depth;
+    int aggregates;     // currently open function calls
+    int nesting;        // recursion depth, bounds hostile input
+    CommandStatus status;
+} Compiler;
+
+static const struct {
+    const char* name;
+    short formula;
+} range_functions[] = {
+    { "SUM", 5 }, { "AVG", 6 }, { "MIN", 7 }, { "MAX", 8 }, { "STDEV", 9 }
+};
+
+static void compile_expr(Compiler* cc);
+
+// Records the first error; later ones are consequences of it.
+static void compile_fail(Compiler* cc, CommandStatus status) {
+    if (cc->status == CMD_OK)
+        cc->status = status;
+}
+
+static void emit(Compiler* cc, int word) {
+    if (cc->length >= MAX_PROGRAM_LENGTH) {
+        compile_fail(cc, CMD_UNRECOGNIZED);
+        return;
+    }
+    cc->code[cc->length++] = word;
+}
+
+static void adjust_depth(Compiler* cc, int delta) {
+    cc->depth += delta;
+    if (cc->depth > cc->max_depth)
+        cc->max_depth = cc->depth;
+    if (cc->depth > MAX_PROGRAM_STACK)
+        compile_fail(cc, CMD_UNRECOGNIZED);
+}
+
+// Returns the key of the cell named by the token start..end, or -1.
+static int compile_cell_key(Compiler* cc, const char* start, const char* end) {
+    short row = -1, col = -1;
+    if (scan_cell(start, &row, &col) != end || !cell_in_sheet(cc->sheet, row, col)) {
+        compile_fail(cc, CMD_INVALID_CELL);
+        return -1;
+    }
+    return encode_cell_key(row, col, cc->sheet->cols);
+}
+
+static const char* skip_alnum(const char* p) {
+    while (isalnum((unsigned char)*p))
+        p++;
+    return p;
+}
+
+// A function argument of the form CELL:CELL. Returns false if the argument
+// is not a range, leaving the position untouched.
+static bool compile_range(Compiler* cc) {
+    const char* colon = skip_alnum(cc->pos);
+    if (*colon != ':')
+        return false;
+    const char* end = skip_alnum(colon + 1);
+    if (colon == cc->pos || end == colon + 1) {
+        compile_fail(cc, CMD_INVALID_RANGE);
+        return true;
+    }
+    int start_key = compile_cell_key(cc, cc->pos, colon);
+    int end_key = compile_cell_key(cc, colon + 1, end);
+    cc->pos = end;
+    if (start_key < 0 || end_key < 0)
+        return true;
+    int cols = cc->sheet->cols;
+    if (start_key / cols > end_key / cols || start_key % cols > end_key % cols) {
+        compile_fail(cc, CMD_INVALID_RANGE);
+        return true;
+    }
+    emit(cc, OP_AGG_RANGE);
+    emit(cc, start_key);
+    emit(cc, end_key);
+    return true;
+}
+
+static void compile_call(Compiler* cc, const char* name, const char* name_end) {
+    short formula = -1;
+    for (size_t i = 0; i < sizeof(range_functions) / sizeof(range_functions[0]); i++) {
+        if (strlen(range_functions[i].name) == (size_t)(name_end - name)
+            && strncmp(range_functions[i].name, name, name_end - name) == 0)
+            formula = range_functions[i].formula;
+    }
+    if (formula < 0 || ++cc->aggregates > MAX_AGGREGATE_DEPTH) {
+        compile_fail(cc, CMD_UNRECOGNIZED);
+        return;
+    }
+    cc->pos++;  // '('
+    emit(cc, OP_AGG_BEGIN);
+    emit(cc, formula);
+    do {
+        if (!compile_range(cc)) {
+            compile_expr(cc);
+            emit(cc, OP_AGG_VALUE);
+            adjust_depth(cc, -1);
+        }
+        if (cc->status != CMD_OK)
+            return;
+    } while (*cc->pos == ',' && cc->pos++);
+    if (*cc->pos != ')') {
+        compile_fail(cc, CMD_UNRECOGNIZED);
+        return;
+    }
+    cc->pos++;
+    cc->aggregates--;
+    emit(cc, OP_AGG_END);
+    adjust_depth(cc, 1);
+}
+
+// Whether start..end, a run of letters and digits, is all digits.
+static bool is_number(const char* start, const char* end) {
+    for (; start < end; start++) {
+        if (!isdigit((unsigned char)*start))
+            return false;
+    }
+    return true;
+}
+
+// Compiles the number start..end, negated if negative. A literal beyond
+// the range of int saturates, so -2147483648 is INT_MIN.
+static void compile_number(Compiler* cc, const char* start, const char* end, bool negative) {
+    long long limit = negative ? -(long long)INT_MIN : INT_MAX;
+    long long number = 0;
+    for (const char* p = start; p < end; p++) {
+        if (number <= limit)  // saturate overlong literals
+            number = number * 10 + (*p - '0');
+    }
+    if (number > limit)
+        number = limit;
+    cc->pos = end;
+    emit(cc, OP_CONST);
+    emit(cc, (int)(negative ? -number : number));
+    adjust_depth(cc, 1);
+}
+
+static void compile_primary(Compiler* cc) {
+    if (*cc->pos == '(') {
+        cc->pos++;
+        compile_expr(cc);
+        if (*cc->pos != ')') {
+            compile_fail(cc, CMD_UNRECOGNIZED);
+            return;
+        }
+        cc->pos++;
+        return;
+    }
+    const char* start = cc->pos;
+    const char* end = skip_alnum(start);
+    if (end == start) {
+        compile_fail(cc, CMD_UNRECOGNIZED);
+        return;
+    }
+    if (is_number(start, end)) {
+        compile_number(cc, start, end, false);
+        return;
+    }
+    cc->pos = end;
+    if (*end == '(') {
+        compile_call(cc, start, end);
+    } else {
+        int key = compile_cell_key(cc, start, end);
+        emit(cc, OP_REF);
+        emit(cc, key);
+        adjust_depth(cc, 1);
+    }
+}
+
+static void compile_unary(Compiler* cc) {
+    if (*cc->pos != '-' && *cc->pos != '+') {
+        compile_primary(cc);
+        return;
+    }
+    bool negate = (*cc->pos == '-');
+    cc->pos++;
+    const char* end = skip_alnum(cc->pos);
+    if (negate && end > cc->pos && is_number(cc->pos, end)) {
+        compile_number(cc, cc->pos, end, true);   // fold negative literals
+        return;
+    }
+    int mark = cc->length;
+    compile_unary(cc);
+    if (!negate || cc->status != CMD_OK)
+        return;
+    if (cc->length == mark + 2 && cc->code[mark] == OP_CONST && cc->code[mark + 1] != INT_MIN)
+        cc->code[mark + 1] = -cc->code[mark + 1];
+    else
+        emit(cc, OP_NEG);
+}
+
+static void compile_term(Compiler* cc) {
+    compile_unary(cc);
+    while (cc->status == CMD_OK && (*cc->pos == '*' || *cc->pos == '/')) {
+        int op = (*cc->pos == '*') ? OP_MUL : OP_DIV;
+        cc->pos++;
+        compile_unary(cc);
+        emit(cc, op);
+        adjust_depth(cc, -1);
+    }
+}
+
+static void compile_expr(Compiler* cc) {
+    if (++cc->nesting > MAX_PROGRAM_STACK) {
+        compile_fail(cc, CMD_UNRECOGNIZED);
+        return;
+    }
+    compile_term(cc);
+    while (cc->status == CMD_OK && (*cc->pos == '+' || *cc->pos == '-')) {
+        int op = (*cc->pos == '+') ? OP_ADD : OP_SUB;
+        cc->pos++;
+        compile_term(cc);
+        emit(cc, op);
+        adjust_depth(cc, -1);
+    }
+    cc->nesting--;
+}
+
+// Compiles expr into code, which must hold MAX_PROGRAM_LENGTH ints.
+CommandStatus compile_expression(Spreadsheet* sheet, const char* expr, int* code, int* length) {
+    Compiler cc = { sheet, expr, code, 0, 0, 0, 0, 0, CMD_OK };
+    compile_expr(&cc);
+    if (cc.status == CMD_OK && *cc.pos != '\0')
+        cc.status = CMD_UNRECOGNIZED;
+    *length = cc.length;
+    return cc.status;
+}
+
+CommandStatus sum_value(Spreadsheet* sheet, Cell *cell){
+        int sum = 0;
+        short row1, col1, row2, col2;
+        get_row_col(cell->cell1, &row1, &col1, sheet->cols);
+        get_row_col(cell->cell2, &row2, &col2, sheet->cols);
+        for(int i=row1; i<=row2; i++){
+            for(int j=col1; j<=col2; j++){
+                Cell* ref_cell = get_cell_check(sheet, i*sheet->cols+j);
+                if(ref_cell->error_state){
+                    cell->error_state = 1;
+                    return CMD_OK;
+                }
+                sum += ref_cell->value;
+            }
+        }
+        cell->value = sum;
+        cell->error_state = 0;
+        return CMD_OK;
+}
+
+CommandStatus variance(Spreadsheet* sheet, Cell *cell){
+    double variance = 0.0;
+    int count = 0;
+    short row1, col1, row2, col2;
+    get_row_col(cell->cell1, &row1, &col1, sheet->cols);
+    get_row_col(cell->cell2, &row2, &col2, sheet->cols);
+    count = (row2-row1+1)*(col2-col1+1);
+    sum_value(sheet, cell);
+    cell->value = cell->value / count;
+    for(int i=row1; i<=row2; i++){
+        for(int j=col1; j<=col2; j++){
+            Cell* ref_cell = get_cell_check(sheet, i*sheet->cols+j);
+            if(ref_cell->error_state){
+                cell->error_state = 1;
+                return CMD_OK;
+            }
+            variance += (ref_cell->value - cell->value) * (ref_cell->value - cell->value);
+        }
+    }
+    variance /= count;
+    cell->value = (int)round(sqrt(variance));
+    cell->error_state = 0;
+    return CMD_OK;
+}
+
+CommandStatus min_max(Spreadsheet* sheet, Cell* cell, bool is_min){
+    int max = INT_MIN;
+    int min = INT_MAX; 
+    short row1, col1, row2, col2;
+    get_row_col(cell->cell1, &row1, &col1, sheet->cols);
+    get_row_col(cell->cell2, &row2, &col2, sheet->cols);
+    for(int i=row1; i<=row2; i++){
+        for(int j=col1; j<=col2; j++){
+            Cell* ref_cell = get_cell(sheet, i, j);
+            if(ref_cell->error_state){
+                cell->error_state = 1;
+                return CMD_OK;
+            }
+            if(ref_cell->value>max){
+                max = ref_cell->value;
+            }
+            if(ref_cell->value<min){
+                min = ref_cell->value;
+            }
+        }
+    }
+    cell->value = is_min ? min : max;
+    cell->error_state = 0;
+    return CMD_OK;
+}
+
+// For Cell references only (opcode 102)
+CommandStatus sleep_prog(Spreadsheet* sheet, Cell *current, double* sleep_time){
+    Cell* ref_cell = get_cell_check(sheet, current->cell1);
+    current->value = ref_cell->value;
+    if (ref_cell->error_state){
+        current->error_state = true;
+        return CMD_OK;
+    }
+    if(ref_cell->value < 0){
+        return CMD_OK;
+    }
+    current->error_state = 0;
+    *sleep_time = +current->value;
+    return CMD_OK;
+}
+
+// Parses the argument of SLEEP(...) at expr, either a cell or an integer.
+static CommandStatus parse_sleep(Spreadsheet* sheet, const char* expr, Command* command) {
+    size_t len = strlen(expr);
+    // Must be at least "SLEEP(x)" (7 characters)
+    if (len < 7 || len > 18){
+        return CMD_UNRECOGNIZED;
+    }
+    // Verify the expression starts with "SLEEP(" and ends with ")"
+    if (expr[len - 1] != ')'){
+        return CMD_UNRECOGNIZED;
+    }
+    const char* arg = expr + 6;
+    const char* arg_end = expr + len - 1;
+    command->sleep = true;
+
+    // If the inner argument begins with an alphabetic character, treat it as a cell reference.
+    if (isalpha((unsigned char)*arg)) {
+        short ref_row = -1, ref_col = -1;
+        if (scan_cell(arg, &ref_row, &ref_col) != arg_end || !cell_in_sheet(sheet, ref_row, ref_col))
+            return CMD_INVALID_CELL;
+        command->formula = 102;
+        command->cell1 = encode_cell_key(ref_row, ref_col, sheet->cols);
+        return CMD_OK;
+    }
+    // Otherwise the whole argument must be an integer, as strtol reads it.
+    const char* p = arg;
+    while (p < arg_end && isspace((unsigned char)*p))
+        p++;
+    bool negative = (p < arg_end && *p == '-');
+    if (p < arg_end && (*p == '-' || *p == '+'))
+        p++;
+    long long value = 0;    // at most 11 digits fit in 18 characters
+    for (; p < arg_end && isdigit((unsigned char)*p); p++)
+        value = value * 10 + (*p - '0');
+    if (p != arg_end)
+        return CMD_UNRECOGNIZED;
+    command->formula = -1;
+    command->value = (int)(negative ? -value : value);
+    return CMD_OK;
+}
+
+// Installs a parsed SLEEP on (row, col). A cell argument is linked like a
+// reference; a literal argument becomes the cell value and sleeps at once.
+static CommandStatus apply_sleep(Spreadsheet* sheet, short row, short col, const Command* command, double* sleep_time) {
+    Cell* current = get_cell(sheet, row, col);
+    int value = command->value;
+    if (command->formula == 102) {
+        // Keep the old formula so it can be restored on a cycle.
+        int cell1 = current->cell1;
+        int cell2 = current->cell2;
+        short old_formula = current->formula;
+        short ref_row, ref_col;
+        get_row_col(command->cell1, &ref_row, &ref_col, sheet->cols);
+
+        Cell* ref_cell = get_cell(sheet, ref_row, ref_col);
+        // Update current cell's cell1 field to store the reference.
+        current->cell1 = command->cell1;
+        current->formula = 102;
+        
+        // *** CYCLE DETECTION ***
+        if (detect_cycle_recursive(sheet, ref_row, ref_col, row, col)){
+            // Restore the previous state and return a circular reference error.
+            current->formula = old_formula;
+            current->cell1 = cell1;
+            current->cell2 = cell2;
+            return CMD_CIRCULAR_REF;
+        }
+        // Move the dependency links to the referenced cell.
+        relink_parents(sheet, row, col, old_formula, cell1, cell2, 102, command->cell1, cell2);
+        discard_formula(sheet, old_formula, cell1);
+        value = ref_cell->value;
+        sleep_prog(sheet, current, sleep_time);
+    } else {
+        remove_all_parents(sheet, row, col);
+        discard_formula(sheet, current->formula, current->cell1);
+        current->formula = -1;
+        *sleep_time += value;
+    }
+    current->value = value;
+    return CMD_OK;
+}
+
+/* ---------- Compiled Expression Interpreter ---------- */
+// Running state of one SUM/AVG/MIN/MAX/STDEV call.
+typedef struct {
+    short formula;      // range formula code 5-9
+    int count;
+    long long sum;
+    long long sum_squares;
+    int min;
+    int max;
+} Aggregate;
+
+static inline void aggregate_add(Aggregate* agg, int value) {
+    agg->count++;
+    agg->sum += value;
+    agg->sum_squares += (long long)value * value;
+    if (value < agg->min) agg->min = value;
+    if (value > agg->max) agg->max = value;
+}
+
+// Same integer rounding as the range formulas: AVG truncates, STDEV measures
+// deviations from the truncated mean.
+static int aggregate_result(const Aggregate* agg) {
+    switch (agg->formula) {
+        case 5: return (int)agg->sum;
+        case 6: return (int)(agg->sum / agg->count);
+        case 7: return agg->min;
+        case 8: return agg->max;
+        default: {
+            long long mean = agg->sum / agg->count;
+            long long squares = agg->sum_squares - 2 * mean * agg->sum + agg->count * mean * mean;
+            return (int)round(sqrt((double)squares / agg->count));
+        }
+    }
+}
+
+// Runs a program against the current cell values. Returns false when the
+// result is an error: an erroneous operand or a division by zero.
+// Dispatch is direct-threaded: every opcode jumps straight to the next one.
+static bool run_program(Spreadsheet* sheet, const int* code, int length, int* result) {
+    static const void* const dispatch[] = {
+        [OP_CONST] = &&op_const, [OP_REF] = &&op_ref,
+        [OP_ADD] = &&op_add, [OP_SUB] = &&op_sub, [OP_MUL] = &&op_mul, [OP_DIV] = &&op_div,
+        [OP_NEG] = &&op_neg,
+        [OP_AGG_BEGIN] = &&op_agg_begin, [OP_AGG_RANGE] = &&op_agg_range,
+        [OP_AGG_VALUE] = &&op_agg_value, [OP_AGG_END] = &&op_agg_end,
+    };
+#define NEXT() do { if (pc == length) goto done; goto *dispatch[code[pc++]]; } while (0)
+    int stack[MAX_PROGRAM_STACK];
+    Aggregate aggregates[MAX_AGGREGATE_DEPTH];
+    int sp = 0, ap = 0, pc = 0;
+    NEXT();
+
+op_const:
+    stack[sp++] = code[pc++];
+    NEXT();
+op_ref: {
+    Cell* ref_cell = get_cell_check(sheet, code[pc++]);
+    if (ref_cell->error_state)
+        return false;
+    stack[sp++] = ref_cell->value;
+    NEXT();
+}
+op_add:
+    sp--;
+    stack[sp - 1] += stack[sp];
+    NEXT();
+op_sub:
+    sp--;
+    stack[sp - 1] -= stack[sp];
+    NEXT();
+op_mul:
+    sp--;
+    stack[sp - 1] *= stack[sp];
+    NEXT();
+op_div:
+    sp--;
+    if (stack[sp] == 0)
+        return false;
+    stack[sp - 1] /= stack[sp];
+    NEXT();
+op_neg:
+    stack[sp - 1] = -stack[sp - 1];
+    NEXT();
+op_agg_begin: {
+    Aggregate* agg = &aggregates[ap++];
+    agg->formula = (short)code[pc++];
+    agg->count = 0;
+    agg->sum = agg->sum_squares = 0;
+    agg->min = INT_MAX;
+    agg->max = INT_MIN;
+    NEXT();
+}
+op_agg_range: {
+    Aggregate* agg = &aggregates[ap - 1];
+    int start_key = code[pc++], end_key = code[pc++];
+    int end_row = end_key / sheet->cols, start_col = start_key % sheet->cols, end_col = end_key % sheet->cols;
+    for (int r = start_key / sheet->cols; r <= end_row; r++) {
+        Cell* row_cells = get_cell(sheet, r, 0);
+        for (int c = start_col; c <= end_col; c++) {
+            if (row_cells[c].error_state)
+                return false;
+            aggregate_add(agg, row_cells[c].value);
+        }
+    }
+    NEXT();
+}
+op_agg_value:
+    aggregate_add(&aggregates[ap - 1], stack[--sp]);
+    NEXT();
+op_agg_end:
+    ap--;
+    stack[sp++] = aggregate_result(&aggregates[ap]);
+    NEXT();
+
+done:
+    *result = stack[0];
+    return true;
+#undef NEXT
+}
+
+/* ---------- Reevaluate Formula ---------- */
+// One handler per formula code. The code already says which operands are
+// cells and which are literals, so a handler never decodes it again.
+typedef CommandStatus (*FormulaEval)(Spreadsheet* sheet, Cell* cell, double* sleep_time);
+
+// Operand loaders for the arithmetic codes: rem 0 is cell op cell, rem 2 is
+// cell op literal, rem 3 is literal op cell. They fail on an erroneous cell.
+static inline bool load_cell_cell(Spreadsheet* sheet, Cell* cell, int* a, int* b) {
+    Cell* ref_cell1 = get_cell_check(sheet, cell->cell1);
+    Cell* ref_cell2 = get_cell_check(sheet, cell->cell2);
+    *a = ref_cell1->value;
+    *b = ref_cell2->value;
+    return !(ref_cell1->error_state | ref_cell2->error_state);
+}
+
+static inline bool load_cell_value(Spreadsheet* sheet, Cell* cell, int* a, int* b) {
+    Cell* ref_cell1 = get_cell_check(sheet, cell->cell1);
+    *a = ref_cell1->value;
+    *b = cell->cell2;
+    return !ref_cell1->error_state;
+}
+
+static inline bool load_value_cell(Spreadsheet* sheet, Cell* cell, int* a, int* b) {
+    Cell* ref_cell2 = get_cell_check(sheet, cell->cell2);
+    *a = cell->cell1;
+    *b = ref_cell2->value;
+    return !ref_cell2->error_state;
+}
+
+#define ARITHMETIC_FORMULA(name, load, op)                                  \
+    static CommandStatus name(Spreadsheet* sheet, Cell* cell, double* sleep_time) { \
+        (void)sleep_time;                                                   \
+        int a, b;                                                           \
+        if (!load(sheet, cell, &a, &b)) {                                   \
+            cell->error_state = 1;                                          \
+            return CMD_OK;                                                  \
+        }                                                                   \
+        cell->value = a op b;                                               \
+        cell->error_state = 0;                                              \
+        return CMD_OK;                                                      \
+    }
+
+#define DIVISION_FORMULA(name, load)                                        \
+    static CommandStatus name(Spreadsheet* sheet, Cell* cell, double* sleep_time) { \
+        (void)sleep_time;                                                   \
+        int a, b;                                                           \
+        if (!load(sheet, cell, &a, &b) || b == 0) {                         \
+            cell->error_state = 1;                                          \
+            return CMD_OK;                                                  \
+        }                                                                   \
+        cell->value = a / b;                                                \
+        cell->error_state = 0;                                              \
+        return CMD_OK;                                                      \
+    }
+
+ARITHMETIC_FORMULA(eval_add_cells, load_cell_cell, +)
+ARITHMETIC_FORMULA(eval_add_cell_value, load_cell_value, +)
+ARITHMETIC_FORMULA(eval_add_value_cell, load_value_cell, +)
+ARITHMETIC_FORMULA(eval_sub_cells, load_cell_cell, -)
+ARITHMETIC_FORMULA(eval_sub_cell_value, load_cell_value, -)
+ARITHMETIC_FORMULA(eval_sub_value_cell, load_value_cell, -)
+ARITHMETIC_FORMULA(eval_mul_cells, load_cell_cell, *)
+ARITHMETIC_FORMULA(eval_mul_cell_value, load_cell_value, *)
+ARITHMETIC_FORMULA(eval_mul_value_cell, load_value_cell, *)
+DIVISION_FORMULA(eval_div_cells, load_cell_cell)
+DIVISION_FORMULA(eval_div_cell_value, load_cell_value)
+DIVISION_FORMULA(eval_div_value_cell, load_value_cell)
+
+static CommandStatus eval_literal(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    (void)sheet; (void)cell; (void)sleep_time;
+    return CMD_OK;
+}
+
+static CommandStatus eval_reference(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    (void)sleep_time;
+    Cell* ref_cell1 = get_cell_check(sheet, cell->cell1);
+    if (ref_cell1->error_state) {
+        cell->error_state = 1;
+        return CMD_OK;
+    }
+    cell->value = ref_cell1->value;
+    cell->error_state = 0;
+    return CMD_OK;
+}
+
+static CommandStatus eval_sleep(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    if (get_cell_check(sheet, cell->cell1)->error_state) {
+        cell->error_state = 1;
+        return CMD_OK;
+    }
+    CommandStatus status = sleep_prog(sheet, cell, sleep_time);
+    cell->error_state = 0;
+    return status;
+}
+
+static CommandStatus eval_program(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    (void)sleep_time;
+    Program* prog = get_program(sheet, cell->cell1);
+    int value;
+    if (run_program(sheet, prog->code, prog->length, &value)) {
+        cell->value = value;
+        cell->error_state = 0;
+    } else {
+        cell->error_state = 1;
+    }
+    return CMD_OK;
+}
+
+static CommandStatus eval_sum(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    (void)sleep_time;
+    return sum_value(sheet, cell);
+}
+
+static CommandStatus eval_avg(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    (void)sleep_time;
+    CommandStatus status = sum_value(sheet, cell);
+    short row1, col1, row2, col2;
+    get_row_col(cell->cell1, &row1, &col1, sheet->cols);
+    get_row_col(cell->cell2, &row2, &col2, sheet->cols);
+    cell->value = cell->value / ((row2-row1+1)*(col2-col1+1));
+    return status;
+}
+
+static CommandStatus eval_min(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    (void)sleep_time;
+    return min_max(sheet, cell, true);
+}
+
+static CommandStatus eval_max(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    (void)sleep_time;
+    return min_max(sheet, cell, false);
+}
+
+static CommandStatus eval_stdev(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    (void)sleep_time;
+    return variance(sheet, cell);
+}
+
+// A ROLL formula just after its window slid adds the entering row, unless
+// some other cell of the window changed as well: the recalculation then
+// evaluates more of its precedents than lie in that row. Any other
+// evaluation means the window changed and rebuilds the aggregate.
+static CommandStatus eval_roll(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    (void)sleep_time;
+    int cols = sheet->cols;
+    Roll* roll = find_roll(sheet, (int)(cell - sheet->grid));
+    Roll scratch = { 0 };
+    bool slid = false;
+    if (roll && roll->start == cell->cell1 && roll->end == cell->cell2 - cols) {
+        int row = cell->cell2 / cols;
+        int entering = 0;
+        for (int c = cell->cell1 % cols; c <= cell->cell2 % cols; c++)
+            entering += sheet->visited[row * cols + c];
+        if (roll->changed == entering) {
+            roll_add_row(sheet, roll, cell->formula, row, cell->cell1 % cols, cell->cell2 % cols);
+            roll->end = cell->cell2;
+            slid = true;
+        }
+    }
+    if (!slid) {
+        if (!roll || !roll_rebuild(sheet, roll, cell)) {
+            // Without state, aggregate once into a throwaway deque.
+            roll = &scratch;
+            if (!roll_rebuild(sheet, roll, cell)) {
+                cell->error_state = 1;
+                return CMD_OK;
+            }
+        }
+    }
+    Aggregate agg = { (short)(cell->formula - 100), roll->count, roll->sum, roll->sum_squares, 0, 0 };
+    if (roll->length > 0)
+        agg.min = agg.max = roll->extremes[roll->head];
+    cell->error_state = roll->errors > 0;
+    if (!cell->error_state)
+        cell->value = aggregate_result(&agg);
+    free(scratch.rows);
+    free(scratch.extremes);
+    return CMD_OK;
+}
+
+// Indexed by formula code + 1 so that -1 (no formula) is slot 0.
+static const FormulaEval formula_evals[111] = {
+    [0] = eval_literal,
+    [1 + 1] = eval_program,
+    [5 + 1] = eval_sum, [6 + 1] = eval_avg, [7 + 1] = eval_min, [8 + 1] = eval_max, [9 + 1] = eval_stdev,
+    [10 + 1] = eval_add_cells, [12 + 1] = eval_add_cell_value, [13 + 1] = eval_add_value_cell,
+    [20 + 1] = eval_sub_cells, [22 + 1] = eval_sub_cell_value, [23 + 1] = eval_sub_value_cell,
+    [30 + 1] = eval_div_cells, [32 + 1] = eval_div_cell_value, [33 + 1] = eval_div_value_cell,
+    [40 + 1] = eval_mul_cells, [42 + 1] = eval_mul_cell_value, [43 + 1] = eval_mul_value_cell,
+    [82 + 1] = eval_reference,
+    [102 + 1] = eval_sleep,
+    [105 + 1] = eval_roll, [106 + 1] = eval_roll, [107 + 1] = eval_roll, [108 + 1] = eval_roll, [109 + 1] = eval_roll,
+};
+
+CommandStatus reevaluate_formula(Spreadsheet* sheet, Cell* cell, double* sleep_time) {
+    return formula_evals[cell->formula + 1](sheet, cell, sleep_time);
+}
+
+// Maps programs that fit the fixed formula codes onto them, so simple
+// formulas keep their compact cell1/cell2 encoding and dedicated paths.
+// Returns false when the program needs the interpreter.
+static bool lower_program(const int* code, int length, short* formula, int* cell1, int* cell2) {
+    static const short operator_codes[] = { [OP_ADD] = 10, [OP_SUB] = 20, [OP_MUL] = 40, [OP_DIV] = 30 };
+    if (length == 2 && code[0] == OP_REF) {
+        *formula = 82;
+        *cell1 = code[1];
+        return true;
+    }
+    if (length == 5 && code[4] >= OP_ADD && code[4] <= OP_DIV
+        && (code[0] == OP_REF || code[0] == OP_CONST)
+        && (code[2] == OP_REF || code[2] == OP_CONST)) {
+        if (code[0] == OP_REF && code[2] == OP_REF)
+            *formula = operator_codes[code[4]];
+        else if (code[0] == OP_REF)
+            *formula = operator_codes[code[4]] + 2;
+        else
+            *formula = operator_codes[code[4]] + 3;
+        *cell1 = code[1];
+        *cell2 = code[3];
+        return true;
+    }
+    if (length == 6 && code[0] == OP_AGG_BEGIN && code[2] == OP_AGG_RANGE) {
+        *formula = (short)code[1];
+        *cell1 = code[3];
+        *cell2 = code[4];
+        return true;
+    }
+    return false;
+}
+
+// Cycle check for a formula already stored in cell (its parents not yet linked).
+static bool formula_creates_cycle(Spreadsheet* sheet, Cell* cell, short row, short col) {
+    short rem = cell->formula % 10;
+    short cols = sheet->cols;
+    if (is_range_formula(cell->formula))
+        return detect_cycle_range(sheet, cell->cell1 / cols, cell->cell1 % cols,
+                                  cell->cell2 / cols, cell->cell2 % cols, row, col);
+    if (cell->formula == 1) {
+        Program* prog = get_program(sheet, cell->cell1);
+        return detect_cycle_program(sheet, prog->code, prog->length, row, col);
+    }
+    if ((rem == 0 || rem == 2) && detect_cycle_recursive(sheet, cell->cell1 / cols, cell->cell1 % cols, row, col))
+        return true;
+    if ((rem == 0 || rem == 3) && detect_cycle_recursive(sheet, cell->cell2 / cols, cell->cell2 % cols, row, col))
+        return true;
+    return false;
+}
+
+// Parses ROLLSUM(<range>) through ROLLSTDEV(<range>), which stand alone
+// rather than inside expressions; expr is just past "ROLL".
+static CommandStatus parse_roll(Spreadsheet* sheet, const char* expr, Command* command) {
+    for (size_t i = 0; i < sizeof(range_functions) / sizeof(range_functions[0]); i++) {
+        size_t len = strlen(range_functions[i].name);
+        if (strncmp(expr, range_functions[i].name, len) != 0 || expr[len] != '(')
+            continue;
+        const char* arg = expr + len + 1;
+        size_t arg_len = strlen(arg);
+        if (arg_len < 2 || arg[arg_len - 1] != ')')
+            return CMD_UNRECOGNIZED;
+        char text[INPUT_SIZE];
+        memcpy(text, arg, arg_len - 1);
+        text[arg_len - 1] = '\0';
+        Range range;
+        CommandStatus status = parse_range(sheet, text, &range);
+        if (status != CMD_OK)
+            return status;
+        command->formula = (short)(range_functions[i].formula + 100);
+        command->cell1 = encode_cell_key(range.start_row, range.start_col, sheet->cols);
+        command->cell2 = encode_cell_key(range.end_row, range.end_col, sheet->cols);
+        return CMD_OK;
+    }
+    return CMD_UNRECOGNIZED;
+}
+
+// Parses the formula text after '=' into command. SLEEP and the ROLL
+// functions have their own syntax; everything else goes through the
+// expression compiler and is then lowered to the fixed formula codes or
+// folded to a literal where possible.
+static CommandStatus parse_formula(Spreadsheet* sheet, const char* expr, Command* command) {
+    command->sleep = false;
+    command->error = false;
+    if (expr[0] == '\0') {
+        return CMD_UNRECOGNIZED;
+    }
+    if (strncmp(expr, "SLEEP(", 6) == 0) {
+        return parse_sleep(sheet, expr, command);
+    }
+    if (strncmp(expr, "ROLL", 4) == 0) {
+        return parse_roll(sheet, expr + 4, command);
+    }
+    CommandStatus status = compile_expression(sheet, expr, command->code, &command->length);
+    if (status != CMD_OK)
+        return status;
+    int start_key, end_key;
+    if (program_next_precedent(command->code, command->length, 0, &start_key, &end_key) < 0) {
+        // No cell is referenced: fold to a literal (an error literal for 1/0).
+        command->formula = -1;
+        command->error = !run_program(sheet, command->code, command->length, &command->value);
+        return CMD_OK;
+    }
+    command->formula = 1;
+    command->cell1 = command->cell2 = 0;
+    lower_program(command->code, command->length, &command->formula, &command->cell1, &command->cell2);
+    return CMD_OK;
+}
+
+// Installs a parsed formula on (row, col): picks its storage, rewires
+// the dependency graph, rejects cycles and computes the new value.
+CommandStatus assign_formula(Spreadsheet* sheet, short row, short col, const Command* command, double* sleep_time) {
+    Cell* cell = get_cell(sheet, row, col);
+    if (command->sleep)
+        return apply_sleep(sheet, row, col, command, sleep_time);
+    if (command->formula == -1) {
+        remove_all_parents(sheet, row, col);
+        discard_formula(sheet, cell->formula, cell->cell1);
+        cell->formula = -1;
+        if (!command->error)
+            cell->value = command->value;
+        cell->error_state = command->error;
+        return CMD_OK;
+    }
+
+    short formula = command->formula;
+    int cell1 = command->cell1, cell2 = command->cell2;
+    if (formula == 1) {
+        cell1 = store_program(sheet, command->code, command->length);
+        if (cell1 < 0)
+            return CMD_UNRECOGNIZED;
+    }
+    if (is_roll_formula(formula) && !track_roll(sheet, encode_cell_key(row, col, sheet->cols)))
+        return CMD_UNRECOGNIZED;
+
+    // Back up old dependency info, then swap in the new formula. The cycle
+    // checks follow formulas and the cell's children, not its own parent
+    // links, so those are only rewired once the formula is accepted.
+    int old_cell1 = cell->cell1;
+    int old_cell2 = cell->cell2;
+    short old_formula = cell->formula;
+    cell->formula = formula;
+    cell->cell1 = cell1;
+    cell->cell2 = cell2;
+
+    // *** CYCLE DETECTION ***
+    if (formula_creates_cycle(sheet, cell, row, col)) {
+        cell->formula = old_formula;
+        cell->cell1 = old_cell1;
+        cell->cell2 = old_cell2;
+        if (formula == 1)
+            free_program(sheet, cell1);
+        return CMD_CIRCULAR_REF;
+    }
+    relink_parents(sheet, row, col, old_formula, old_cell1, old_cell2, formula, cell1, cell2);
+    discard_formula(sheet, old_formula, old_cell1);
+    return reevaluate_formula(sheet, cell, sleep_time);
+}
+
+// Function to scroll the viewport
+void scroll_viewport(Spreadsheet* sheet, char direction) {
+    switch (direction) {
+        case 'w': // up
+            sheet->viewport_row = (sheet->viewport_row > 10) ? sheet->viewport_row - 10 : 0;
+            break;
+        case 's': // down
+            if (sheet->viewport_row + VIEWPORT_SIZE < sheet->rows) {
+                sheet->viewport_row = (sheet->viewport_row + 10 + VIEWPORT_SIZE <= sheet->rows) ? sheet->viewport_row + 10 : sheet->rows - VIEWPORT_SIZE;
+            }
+            break;
+        case 'a': // left 
+            sheet->viewport_col = (sheet->viewport_col > 10) ? sheet->viewport_col - 10 : 0;
+            break;
+        case 'd': // right
+            if (sheet->viewport_col + VIEWPORT_SIZE < sheet->cols) {
+                sheet->viewport_col = (sheet->viewport_col + 10 + VIEWPORT_SIZE <= sheet->cols) ? sheet->viewport_col + 10 : sheet->cols - VIEWPORT_SIZE;
+            }
+            break;
+    }
+}
+
+/* ---------- Command Parsing ---------- */
+// Parses the space separated integers of append_row into code[0..length).
+static CommandStatus parse_values(const char* p, Command* command) {
+    command->length = 0;
+    for (;;) {
+        while (*p == ' ')
+            p++;
+        if (*p == '\0')
+            break;
+        bool negative = (*p == '-');
+        if (*p == '-' || *p == '+')
+            p++;
+        long long value = 0;
+        int digits = 0;
+        for (; isdigit((unsigned char)*p) && digits <= 10; p++, digits++)
+            value = value * 10 + (*p - '0');
+        if (negative)
+            value = -value;
+        if (digits == 0 || (*p != ' ' && *p != '\0') || value < INT_MIN || value > INT_MAX
+            || command->length == MAX_PROGRAM_LENGTH)
+            return CMD_UNRECOGNIZED;
+        command->code[command->length++] = (int)value;
+    }
+    return command->length > 0 ? CMD_OK : CMD_UNRECOGNIZED;
+}
+
+// Tokenizes cmd in a single left-to-right pass into command. Nothing is
+// copied or allocated; formula text is compiled straight from cmd.
+CommandStatus parse_command(Spreadsheet* sheet, const char* cmd, Command* command) {
+    if (strcmp(cmd, "disable_output") == 0 || strcmp(cmd, "enable_output") == 0) {
+        command->kind = COMMAND_OUTPUT;
+        command->output_enabled = (cmd[0] == 'e');
+        return CMD_OK;
+    }
+    if (cmd[0] != '\0' && cmd[1] == '\0' && strchr("wasd", cmd[0])) {
+        command->kind = COMMAND_SCROLL;
+        command->direction = cmd[0];
+        return CMD_OK;
+    }
+    if (strncmp(cmd, "scroll_to ", 10) == 0) {
+        command->kind = COMMAND_SCROLL_TO;
+        parse_cell_reference(cmd + 10, &command->row, &command->col);
+        return cell_in_sheet(sheet, command->row, command->col) ? CMD_OK : CMD_INVALID_CELL;
+    }
+    if (strncmp(cmd, "subscribe ", 10) == 0) {
+        command->kind = COMMAND_SUBSCRIBE;
+        return parse_range(sheet, cmd + 10, &command->range);
+    }
+    if (strcmp(cmd, "unsubscribe") == 0) {
+        command->kind = COMMAND_UNSUBSCRIBE;
+        return CMD_OK;
+    }
+    if (strncmp(cmd, "save ", 5) == 0 || strncmp(cmd, "load ", 5) == 0) {
+        command->kind = (cmd[0] == 's') ? COMMAND_SAVE : COMMAND_LOAD;
+        size_t len = strlen(cmd + 5);
+        if (len == 0 || len >= sizeof(command->path))
+            return CMD_UNRECOGNIZED;
+        memcpy(command->path, cmd + 5, len + 1);
+        return CMD_OK;
+    }
+    if (strcmp(cmd, "checkpoint") == 0 || strncmp(cmd, "checkpoint ", 11) == 0) {
+        command->kind = COMMAND_CHECKPOINT;
+        const char* path = (cmd[10] == ' ') ? cmd + 11 : "";
+        size_t len = strlen(path);
+        if ((cmd[10] == ' ' && len == 0) || len >= sizeof(command->path))
+            return CMD_UNRECOGNIZED;
+        memcpy(command->path, path, len + 1);
+        return CMD_OK;
+    }
+    if (strncmp(cmd, "import ", 7) == 0) {
+        command->kind = COMMAND_IMPORT;
+        // The last " AT " ends the file name, which may contain spaces.
+        const char* at = NULL;
+        for (const char* p = strstr(cmd + 6, " AT "); p; p = strstr(p + 1, " AT "))
+            at = p;
+        if (!at || at <= cmd + 7 || (size_t)(at - (cmd + 7)) >= sizeof(command->path))
+            return CMD_UNRECOGNIZED;
+        memcpy(command->path, cmd + 7, at - (cmd + 7));
+        command->path[at - (cmd + 7)] = '\0';
+        const char* end = scan_cell(at + 4, &command->row, &command->col);
+        if (!end || *end != '\0' || !cell_in_sheet(sheet, command->row, command->col))
+            return CMD_INVALID_CELL;
+        return CMD_OK;
+    }
+    if (strncmp(cmd, "append_row ", 11) == 0) {
+        command->kind = COMMAND_APPEND;
+        return parse_values(cmd + 11, command);
+    }
+    if (strncmp(cmd, "export ", 7) == 0) {
+        command->kind = COMMAND_EXPORT;
+        const char* space = strchr(cmd + 7, ' ');
+        char range[INPUT_SIZE];
+        if (!space || (size_t)(space - (cmd + 7)) >= sizeof(range))
+            return CMD_UNRECOGNIZED;
+        size_t len = strlen(space + 1);
+        if (len == 0 || len >= sizeof(command->path))
+            return CMD_UNRECOGNIZED;
+        memcpy(command->path, space + 1, len + 1);
+        memcpy(range, cmd + 7, space - (cmd + 7));
+        range[space - (cmd + 7)] = '\0';
+        return parse_range(sheet, range, &command->range);
+    }
+    // Handle cell assignments: <cell>=<formula>
+    command->kind = COMMAND_ASSIGN;
+    const char* eq = scan_cell(cmd, &command->row, &command->col);
+    if (!eq || *eq != '=' || !cell_in_sheet(sheet, command->row, command->col))
+        return strchr(cmd, '=') ? CMD_INVALID_CELL : CMD_UNRECOGNIZED;
+    return parse_formula(sheet, eq + 1, command);
+}
+
+// Sets cell key to the literal value, as the assignment key=value would
+// before its dependents are recalculated.
+static void set_literal(Spreadsheet* sheet, int key, int value) {
+    short row, col;
+    get_row_col(key, &row, &col, sheet->cols);
+    Cell* cell = get_cell_check(sheet, key);
+    int old_value = cell->value;
+    bool error = cell->error_state;
+    remove_all_parents(sheet, row, col);
+    discard_formula(sheet, cell->formula, cell->cell1);
+    cell->formula = -1;
+    cell->value = value;
+    cell->error_state = false;
+    if (sheet->track_changes && cell_changed(cell, old_value, error))
+        note_change(sheet, key);
+    mark_dirty(sheet, key);
+}
+
+// Writes values into the first columns of the append row and moves it on.
+// ROLL windows that end just above the row slide down to take it in, and
+// the row is recalculated together with everything depending on it. Fails,
+// changing nothing, once the sheet is full or if the windows, slid
+// together, would make any ROLL formula depend on itself.
+static CommandStatus append_row(Spreadsheet* sheet, const int* values, int count, double* sleep_time) {
+    int row = sheet->append_row, cols = sheet->cols;
+    if (row >= sheet->rows || count > cols)
+        return CMD_INVALID_CELL;
+    int* keys = malloc((size_t)(count + sheet->roll_count) * sizeof(int));
+    if (!keys)
+        return CMD_UNRECOGNIZED;
+    int* slid = keys + count;
+    int slid_count = 0;
+    for (int i = 0; i < sheet->roll_count;) {
+        Roll* roll = &sheet->rolls[i];
+        const Cell* cell = &sheet->grid[roll->key];
+        if (!is_roll_formula(cell->formula)) {
+            untrack_roll(sheet, roll);
+            continue;
+        }
+        i++;
+        // A formula in the part of the row being written is overwritten.
+        if (cell->cell2 / cols == row - 1 && !(roll->key / cols == row && roll->key % cols < count))
+            slid[slid_count++] = roll->key;
+    }
+    for (int i = 0; i < slid_count; i++) {
+        if (reaches_row(sheet, slid[i], row, slid, slid_count)) {
+            free(keys);
+            return CMD_CIRCULAR_REF;
+        }
+    }
+    for (int c = 0; c < count; c++) {
+        keys[c] = row * cols + c;
+        set_literal(sheet, keys[c], values[c]);
+    }
+    for (int i = 0; i < slid_count; i++) {
+        Cell* cell = &sheet->grid[slid[i]];
+        Roll* roll = find_roll(sheet, slid[i]);
+        int first = cell->cell1 / cols, col1 = cell->cell1 % cols, col2 = cell->cell2 % cols;
+        if (roll->start == cell->cell1 && roll->end == cell->cell2) {
+            roll_drop_row(sheet, roll, first, col1, col2);
+            roll->start = cell->cell1 + cols;
+        } else {
+            roll->start = roll->end = -1;
+        }
+        short r, c;
+        get_row_col(slid[i], &r, &c, cols);
+        int old_cell1 = cell->cell1, old_cell2 = cell->cell2;
+        cell->cell1 += cols;
+        cell->cell2 += cols;
+        relink_parents(sheet, r, c, cell->formula, old_cell1, old_cell2, cell->formula, cell->cell1, cell->cell2);
+    }
+    sheet->append_row++;
+    CommandStatus status = recalculate(sheet, keys, count, slid, slid_count, false, sleep_time);
+    // A window the recalculation did not get to keeps no state.
+    for (int i = 0; i < slid_count; i++) {
+        Roll* roll = find_roll(sheet, slid[i]);
+        if (roll->end != sheet->grid[slid[i]].cell2)
+            roll->start = roll->end = -1;
+    }
+    free(keys);
+    return status;
+}
+
+CommandStatus apply_command(Spreadsheet* sheet, const Command* command, double* sleep_time) {
+    switch (command->kind) {
+        case COMMAND_OUTPUT:
+            sheet->output_enabled = command->output_enabled;
+            return CMD_OK;
+        case COMMAND_SCROLL:
+            scroll_viewport(sheet, command->direction);
+            return CMD_OK;
+        case COMMAND_SCROLL_TO:
+            sheet->viewport_row = command->row;
+            sheet->viewport_col = command->col;
+            return CMD_OK;
+        case COMMAND_SUBSCRIBE: {
+            Range* grown = realloc(sheet->subscriptions, (sheet->subscription_count + 1) * sizeof(Range));
+            if (!grown)
+                return CMD_UNRECOGNIZED;
+            sheet->subscriptions = grown;
+            sheet->subscriptions[sheet->subscription_count++] = command->range;
+            return CMD_OK;
+        }
+        case COMMAND_UNSUBSCRIBE:
+            sheet->subscription_count = 0;
+            return CMD_OK;
+        case COMMAND_SAVE:
+            finish_checkpoint(sheet, true, NULL, 0);
+            return save_snapshot(sheet, command->path);
+        case COMMAND_CHECKPOINT:
+            // A running checkpoint may be about to set the snapshot path.
+            finish_checkpoint(sheet, true, NULL, 0);
+            if (command->path[0] != '\0')
+                return start_checkpoint(sheet, command->path);
+            return sheet->snapshot_path ? start_checkpoint(sheet, sheet->snapshot_path) : CMD_UNRECOGNIZED;
+        case COMMAND_LOAD: {
+            finish_checkpoint(sheet, true, NULL, 0);
+            Spreadsheet* loaded = load_snapshot(command->path);
+            if (!loaded)
+                return CMD_IO_ERROR;
+            if (!replace_spreadsheet(sheet, loaded))
+                return CMD_IO_ERROR;
+            return CMD_OK;
+        }
+        case COMMAND_IMPORT:
+            return import_csv(sheet, command->path, command->row, command->col, sleep_time);
+        case COMMAND_EXPORT:
+            return export_csv(sheet, &command->range, command->path);
+        case COMMAND_APPEND:
+            return append_row(sheet, command->code, command->length, sleep_time);
+        case COMMAND_ASSIGN:
+            break;
+    }
+    Cell* target = get_cell(sheet, command->row, command->col);
+    int value = target->value;
+    bool error = target->error_state;
+    int key = encode_cell_key(command->row, command->col, sheet->cols);
+    CommandStatus status = assign_formula(sheet, command->row, command->col, command, sleep_time);
+    if (sheet->track_changes && cell_changed(target, value, error))
+        note_change(sheet, key);
+    mark_dirty(sheet, key);
+    CommandStatus recalc = reevaluate_topologically(sheet, command->row, command->col, sleep_time);
+    return status != CMD_OK ? status : recalc;
+}
+
+// With a journal, a command is logged before it is applied, as cmd, its
+// text; once a save or load succeeds the snapshot stands in for everything
+// logged before it. A checkpoint changes nothing and does the same only
+// when it completes; an export changes nothing and is not logged at all.
+CommandStatus execute_command(Spreadsheet* sheet, const Command* command, const char* cmd, double* sleep_time) {
+    bool logged = command->kind != COMMAND_SAVE && command->kind != COMMAND_CHECKPOINT
+                  && command->kind != COMMAND_EXPORT;
+    if (sheet->journal && logged && !journal_append(sheet->journal, cmd))
+        return CMD_IO_ERROR;
+    CommandStatus status = apply_command(sheet, command, sleep_time);
+    if (sheet->journal && status == CMD_OK && (command->kind == COMMAND_SAVE || command->kind == COMMAND_LOAD))
+        journal_checkpoint(sheet->journal, command->path, journal_length(sheet->journal));
+    return status;
+}
+
+CommandStatus handle_command(Spreadsheet* sheet, const char* cmd, double* sleep_time) {
+    Command command;
+    CommandStatus status = parse_command(sheet, cmd, &command);
+    if (status == CMD_OK)
+        status = execute_command(sheet, &command, cmd, sleep_time);
+    if (sheet->plane)
+        publish_values(sheet);
+    return status;
+}
+
+/* ---------- Text Output ---------- */
+// Writes value left-aligned in a field of at least width characters, like
+// printf("%-*d"). Returns the end of the written text.
+char* format_int(char* out, int value, int width) {
+    char digits[10];
+    int n = 0;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        digits[n++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    char* p = out;
+    if (value < 0)
+        *p++ = '-';
+    while (n)
+        *p++ = digits[--n];
+    while (p < out + width)
+        *p++ = ' ';
+    return p;
+}
+
+// Writes all of buf, retrying partial writes.
+bool write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* ---------- Command Journal ---------- */
+// An append-only text file of the commands applied since the last save or
+// load, one per line exactly as typed, so replaying it through
+// handle_command rebuilds the sheet. Each command is written before it is
+// applied; a thread syncs the file once commit_every commands are waiting
+// or commit_ms have passed since the first of them, so a crash loses at
+// most that window to the disk and nothing to the page cache. A save or
+// load replaces the file with the single line "load <snapshot>"; a
+// background checkpoint does the same when it completes, keeping the
+// commands journaled since its fork. If the thread cannot be started each
+// full group is synced inline instead.
+struct Journal {
+    int fd;
+    char* path;
+    int commit_every;
+    int commit_ms;
+    bool running;
+    bool stop;
+    bool syncing;               // the thread is syncing fd without the lock
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // signalled to the thread: a group started or filled, or stop
+    pthread_cond_t idle;        // signalled when a sync finishes
+    unsigned long appended;     // commands written to fd
+    unsigned long synced;       // of those, commands known to be on disk
+    struct timespec group_start;
+};
+
+static void* journal_main(void* arg) {
+    Journal* j = arg;
+    pthread_mutex_lock(&j->lock);
+    while (!j->stop) {
+        if (j->appended == j->synced) {
+            pthread_cond_wait(&j->ready, &j->lock);
+            continue;
+        }
+        struct timespec deadline = j->group_start;
+        deadline.tv_sec += j->commit_ms / 1000;
+        deadline.tv_nsec += (long)(j->commit_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!j->stop && j->appended - j->synced < (unsigned long)j->commit_every
+               && pthread_cond_timedwait(&j->ready, &j->lock, &deadline) != ETIMEDOUT)
+            ;
+        unsigned long target = j->appended;
+        int fd = j->fd;
+        j->syncing = true;
+        pthread_mutex_unlock(&j->lock);
+        fdatasync(fd);
+        pthread_mutex_lock(&j->lock);
+        j->syncing = false;
+        j->synced = target;
+        pthread_cond_broadcast(&j->idle);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+// Runs every complete line of the journal at path through handle_command
+// and returns the length of those lines, 0 if there is no journal, or -1
+// if it cannot be read. A line torn by a crash mid-append is skipped.
+off_t replay_journal(Spreadsheet* sheet, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const char* data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise((void*)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    char input[INPUT_SIZE];
+    size_t pos = 0;
+    while (pos < size) {
+        const char* line = data + pos;
+        const char* nl = memchr(line, '\n', size - pos);
+        if (!nl)
+            break;
+        size_t len = (size_t)(nl - line);
+        pos += len + 1;
+        if (len == 0 || len >= sizeof(input))
+            continue;
+        memcpy(input, line, len);
+        input[len] = '\0';
+        double sleep_time = 0.0;    // replay does not sleep
+        handle_command(sheet, input, &sleep_time);
+    }
+    if (data)
+        munmap((void*)data, size);
+    return (off_t)pos;
+}
+
+// Opens the journal at path for appending after its first length bytes
+// and starts the sync thread. Returns NULL if the file cannot be opened.
+Journal* journal_open(const char* path, off_t length, int commit_every, int commit_ms) {
+    Journal* j = malloc(sizeof(Journal));
+    if (!j)
+        return NULL;
+    j->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    j->path = strdup(path);
+    if (j->fd < 0 || !j->path || ftruncate(j->fd, length) != 0) {
+        if (j->fd >= 0)
+            close(j->fd);
+        free(j->path);
+        free(j);
+        return NULL;
+    }
+    j->commit_every = commit_every;
+    j->commit_ms = commit_ms;
+    j->stop = j->syncing = false;
+    j->appended = j->synced = 0;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&j->ready, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&j->idle, NULL);
+    j->running = pthread_create(&j->thread, NULL, journal_main, j) == 0;
+    return j;
+}
+
+// Writes cmd to the journal. Returns false if it could not be written, in
+// which case the command must not be applied.
+bool journal_append(Journal* j, const char* cmd) {
+    char line[INPUT_SIZE + 1];
+    size_t len = strlen(cmd);
+    if (len >= sizeof(line))
+        return false;
+    memcpy(line, cmd, len);
+    line[len] = '\n';
+    if (!write_all(j->fd, line, len + 1))
+        return false;
+    if (!j->running) {
+        if (++j->appended - j->synced >= (unsigned long)j->commit_every) {
+            fdatasync(j->fd);
+            j->synced = j->appended;
+        }
+        return true;
+    }
+    pthread_mutex_lock(&j->lock);
+    if (j->appended == j->synced)
+        clock_gettime(CLOCK_MONOTONIC, &j->group_start);
+    j->appended++;
+    if (j->appended - j->synced == 1 || j->appended - j->synced == (unsigned long)j->commit_every)
+        pthread_cond_signal(&j->ready);
+    pthread_mutex_unlock(&j->lock);
+    return true;
+}
+
+// Bytes written to the journal so far.
+off_t journal_length(Journal* j) {
+    return lseek(j->fd, 0, SEEK_END);
+}
+
+// Replaces the journal with one that loads snapshot and then runs the
+// commands journaled from offset keep_from on, once snapshot holds
+// everything before them. The new file is synced before it replaces the
+// old one, so a crash leaves either. Returns false if it could not be
+// written.
+bool journal_checkpoint(Journal* j, const char* snapshot, off_t keep_from) {
+    char temp[INPUT_SIZE + 8];
+    char line[INPUT_SIZE + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", j->path);
+    int len = snprintf(line, sizeof(line), "load %s\n", snapshot);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = write_all(fd, line, (size_t)len);
+    off_t end = journal_length(j);
+    if (ok && keep_from < end) {
+        int in = open(j->path, O_RDONLY);
+        char buf[1 << 16];
+        ok = in >= 0;
+        for (off_t at = keep_from; ok && at < end;) {
+            size_t want = (end - at < (off_t)sizeof(buf)) ? (size_t)(end - at) : sizeof(buf);
+            ssize_t n = pread(in, buf, want, at);
+            ok = n > 0 && write_all(fd, buf, (size_t)n);
+            at += (n > 0) ? n : 0;
+        }
+        if (in >= 0)
+            close(in);
+    }
+    if (!ok || fsync(fd) != 0 || rename(temp, j->path) != 0) {
+        close(fd);
+        unlink(temp);
+        return false;
+    }
+    pthread_mutex_lock(&j->lock);
+    while (j->syncing)
+        pthread_cond_wait(&j->idle, &j->lock);
+    int old = j->fd;
+    j->fd = fd;
+    j->appended = j->synced = 0;
+    pthread_mutex_unlock(&j->lock);
+    close(old);
+    return true;
+}
+
+// Syncs whatever is still waiting and closes the journal.
+void journal_close(Journal* j) {
+    if (j->running) {
+        pthread_mutex_lock(&j->lock);
+        j->stop = true;
+        pthread_cond_signal(&j->ready);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->thread, NULL);
+    }
+    if (j->appended != j->synced)
+        fdatasync(j->fd);
+    close(j->fd);
+    pthread_cond_destroy(&j->ready);
+    pthread_cond_destroy(&j->idle);
+    pthread_mutex_destroy(&j->lock);
+    free(j->path);
+    free(j);
+}
+
+/* ---------- Spreadsheet Creation ---------- */
+// Asks for transparent huge pages over the page-aligned interior of a large
+// block; a full grid is hundreds of megabytes and otherwise costs one fault
+// per 4 KiB page when first written.
+static void advise_huge_pages(void* block, size_t size) {
+    uintptr_t start = ((uintptr_t)block + 4095) & ~(uintptr_t)4095;
+    uintptr_t end = ((uintptr_t)block + size) & ~(uintptr_t)4095;
+    if (end > start)
+        madvise((void*)start, end - start, MADV_HUGEPAGE);
+}
+
+// Allocates a sheet without initializing its cells; callers fill every cell.
+static Spreadsheet* allocate_spreadsheet(short rows, short cols) {
+    if (rows < 1 || rows > MAX_ROWS || cols < 1 || cols > MAX_COLS) {
+        fprintf(stderr, "Invalid spreadsheet dimensions\n");
+        return NULL;
+    }
+    Spreadsheet* sheet = (Spreadsheet*)malloc(sizeof(Spreadsheet));
+    sheet->rows = rows;
+    sheet->cols = cols;
+    sheet->viewport_row = 0;
+    sheet->viewport_col = 0;
+    sheet->output_enabled = true;
+    sheet->programs = NULL;
+    sheet->program_count = sheet->program_capacity = 0;
+    sheet->free_programs = NULL;
+    sheet->free_program_count = 0;
+    sheet->append_row = 0;
+    sheet->rolls = NULL;
+    sheet->roll_count = sheet->roll_capacity = 0;
+    sheet->track_changes = false;
+    sheet->changes = NULL;
+    sheet->change_count = sheet->change_capacity = 0;
+    sheet->subscriptions = NULL;
+    sheet->subscription_count = 0;
+    sheet->snapshot_path = NULL;
+    sheet->snapshot_generation = 0;
+    sheet->snapshot_base_size = sheet->snapshot_delta_size = 0;
+    sheet->dirty_count = 0;
+    sheet->journal = NULL;
+    sheet->checkpoint_pid = 0;
+    sheet->checkpoint_fd = -1;
+    sheet->checkpoint_path = NULL;
+    sheet->checkpoint_tiles = NULL;
+    sheet->checkpoint_tile_count = 0;
+    sheet->checkpoint_journal = 0;
+    sheet->plane = NULL;
+    int tiles = (rows * cols + SNAPSHOT_TILE - 1) / SNAPSHOT_TILE;
+    // Allocate one contiguous block for all cells.
+    sheet->grid = (Cell*)malloc(rows * cols * sizeof(Cell));
+    sheet->visited = calloc(rows * cols, sizeof(bool));
+    sheet->pending = calloc(rows * cols, sizeof(int));
+    sheet->column_labels = malloc(cols * sizeof(*sheet->column_labels));
+    sheet->dirty_tiles = calloc(tiles, sizeof(uint8_t));
+    sheet->dirty_list = malloc(tiles * sizeof(int));
+    if (sheet->grid)
+        advise_huge_pages(sheet->grid, (size_t)rows * cols * sizeof(Cell));
+    if (!sheet->grid || !sheet->visited || !sheet->pending || !sheet->column_labels
+        || !sheet->dirty_tiles || !sheet->dirty_list) {
+        fprintf(stderr, "Failed to allocate grid\n");
+        free(sheet->grid);
+        free(sheet->visited);
+        free(sheet->pending);
+        free(sheet->column_labels);
+        free(sheet->dirty_tiles);
+        free(sheet->dirty_list);
+        free(sheet);
+        return NULL;
+    }
+    // Header labels are fixed for the sheet's lifetime, so pad them once.
+    for (int j = 0; j < cols; j++) {
+        char name[4];
+        get_column_name(j + 1, name);
+        memset(sheet->column_labels[j], ' ', CELL_WIDTH);
+        memcpy(sheet->column_labels[j], name, strlen(name));
+    }
+    return sheet;
+}
+
+Spreadsheet* create_spreadsheet(short rows, short cols) {
+    Spreadsheet* sheet = allocate_spreadsheet(rows, cols);
+    if (!sheet)
+        return NULL;
+    // Initialize each cell.
+    int total = rows * cols;
+    for (int i = 0; i < total; i++) {
+            Cell* cell = sheet->grid+i;
+            cell->formula = -1;
+            cell->children = 0;
+            cell->value = 0;
+            cell->error_state = false;
+            cell->cell1 = 0;
+            cell->cell2 = 0;
+    }
+    return sheet;
+}
+
+void free_spreadsheet(Spreadsheet* sheet) {
+    if (!sheet) return;
+    int total = sheet->rows * sheet->cols;
+    for (int i = 0; i < total; i++) {
+        Cell* cell = &sheet->grid[i];
+        depset_free(cell->children);
+    }
+    for (int i = 0; i < sheet->program_count; i++)
+        free(sheet->programs[i]);
+    free(sheet->programs);
+    free(sheet->free_programs);
+    free_rolls(sheet);
+    free(sheet->visited);
+    free(sheet->pending);
+    free(sheet->column_labels);
+    free(sheet->changes);
+    free(sheet->subscriptions);
+    free(sheet->snapshot_path);
+    free(sheet->checkpoint_path);
+    free(sheet->checkpoint_tiles);
+    free(sheet->dirty_tiles);
+    free(sheet->dirty_list);
+    free(sheet->grid);
+    free(sheet);
+}
+
+/* ---------- Snapshots ---------- */
+// A snapshot is a header followed by column-wise sections, each 64-byte
+// aligned and located by the header's section table:
+//   values          int32[cells]        value of every cell
+//   errors          uint8[(cells+7)/8]  error_state bits, LSB first
+//   formula_keys    uint32[formulas]    cells that hold a formula, ascending
+//   formula_codes   int16[formulas]
+//   formula_cell1   int32[formulas]
+//   formula_cell2   int32[formulas]
+//   child_parents   uint32[parents]     cells with dependents, ascending
+//   child_offsets   uint32[parents+1]   CSR offsets into child_keys
+//   child_keys      int32[edges]        ascending within each parent
+//   program_offsets uint32[slots+1]     word offsets into program_code,
+//                                       an empty slot is a free one
+//   program_code    int32[words]
+// Everything is in the saving host's byte order, which byte_order records.
+// Literal cells are implicit, so a mostly-literal sheet costs little more
+// than its values, and loading maps the file and copies each section
+// straight into the grid, building every children set bottom-up.
+//
+// Later saves to the same path append a segment to path.delta holding the
+// tiles changed since the previous save. Each segment is a DeltaHeader and,
+// for every tile of n cells,
+//   uint32 tile, uint32 words,
+//   int32 values[n], cell1[n], cell2[n], code[words],
+//   int16 formulas[n], uint8 errors[(n+7)/8], zero padded to 4 bytes
+// where cell1 of a program cell is its length and the programs follow one
+// another in code. Children are not stored: loading rewires the edges of
+// each replaced formula. A segment names the generation of its base and
+// carries a checksum, so a stale delta or a torn last segment is ignored.
+// Once the delta would outgrow half the base, the save writes a new base.
+#define SNAPSHOT_MAGIC "SHEETSNP"
+#define SNAPSHOT_DELTA_MAGIC "SHEETDLT"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_ALIGN 64
+
+enum {
+    SECTION_VALUES,
+    SECTION_ERRORS,
+    SECTION_FORMULA_KEYS,
+    SECTION_FORMULA_CODES,
+    SECTION_FORMULA_CELL1,
+    SECTION_FORMULA_CELL2,
+    SECTION_CHILD_PARENTS,
+    SECTION_CHILD_OFFSETS,
+    SECTION_CHILD_KEYS,
+    SECTION_PROGRAM_OFFSETS,
+    SECTION_PROGRAM_CODE,
+    SECTION_COUNT
+};
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;      // bytes
+} SnapshotSection;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint16_t rows;
+    uint16_t cols;
+    uint16_t viewport_row;
+    uint16_t viewport_col;
+    uint16_t append_row;
+    uint16_t reserved[3];
+    uint64_t generation;    // matched by the segments of the delta file
+    SnapshotSection sections[SECTION_COUNT];
+} SnapshotHeader;
+
+typedef struct {
+    char magic[8];
+    uint64_t generation;    // of the base the segment applies to
+    uint64_t checksum;      // FNV-1a of the body
+    uint32_t size;          // body bytes
+    uint32_t tile_count;
+    uint16_t viewport_row;
+    uint16_t viewport_col;
+    uint16_t append_row;
+    uint16_t reserved;
+} DeltaHeader;
+
+#define SNAPSHOT_BUFFER_SIZE (1 << 20)
+
+// Everything writing a base allocates, set up beforehand: a checkpoint's
+// child is forked from a process with other threads, any of which may have
+// held a malloc or stdio lock at the fork, so it makes system calls only.
+typedef struct {
+    char temp_path[INPUT_SIZE + 8];
+    char delta_path[INPUT_SIZE + 8];
+    int32_t* cells;             // one int per cell, plus one
+    uint32_t* program_offsets;  // one per program slot, plus one
+    uint8_t* buffer;            // SNAPSHOT_BUFFER_SIZE bytes of output
+} SnapshotScratch;
+
+static bool snapshot_scratch_init(SnapshotScratch* scratch, const Spreadsheet* sheet, const char* path) {
+    snprintf(scratch->temp_path, sizeof(scratch->temp_path), "%s.tmp", path);
+    snprintf(scratch->delta_path, sizeof(scratch->delta_path), "%s.delta", path);
+    size_t total = (size_t)sheet->rows * sheet->cols;
+    scratch->cells = malloc((total + 1) * sizeof(int32_t));
+    scratch->program_offsets = malloc(((size_t)sheet->program_count + 1) * sizeof(uint32_t));
+    scratch->buffer = malloc(SNAPSHOT_BUFFER_SIZE);
+    if (scratch->cells && scratch->program_offsets && scratch->buffer)
+        return true;
+    free(scratch->cells); free(scratch->program_offsets); free(scratch->buffer);
+    return false;
+}
+
+static void snapshot_scratch_free(SnapshotScratch* scratch) {
+    free(scratch->cells);
+    free(scratch->program_offsets);
+    free(scratch->buffer);
+}
+
+// A file written through a buffer with write(2).
+typedef struct {
+    int fd;
+    uint8_t* buffer;
+    size_t used;
+    uint64_t offset;    // bytes written so far, buffered or not
+} SnapshotOutput;
+
+static bool output_flush(SnapshotOutput* out) {
+    bool ok = write_all(out->fd, (const char*)out->buffer, out->used);
+    out->used = 0;
+    return ok;
+}
+
+static bool output_write(SnapshotOutput* out, const void* data, size_t size) {
+    out->offset += size;
+    if (out->used + size > SNAPSHOT_BUFFER_SIZE) {
+        if (!output_flush(out))
+            return false;
+        if (size > SNAPSHOT_BUFFER_SIZE)
+            return write_all(out->fd, data, size);
+    }
+    memcpy(out->buffer + out->used, data, size);
+    out->used += size;
+    return true;
+}
+
+// Appends one section to out, padded to SNAPSHOT_ALIGN, and records it.
+static bool write_section(SnapshotOutput* out, SnapshotHeader* header, int section, const void* data, size_t size) {
+    static const char padding[SNAPSHOT_ALIGN];
+    size_t pad = (SNAPSHOT_ALIGN - out->offset % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+    if (!output_write(out, padding, pad))
+        return false;
+    header->sections[section].offset = out->offset;
+    header->sections[section].size = size;
+    return size == 0 || output_write(out, data, size);
+}
+
+// Builds every section in the scratch, one at a time, and writes it.
+// Returns false on write failure.
+static bool write_snapshot(const Spreadsheet* sheet, uint64_t generation, SnapshotScratch* scratch, SnapshotOutput* out) {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.rows = (uint16_t)sheet->rows;
+    header.cols = (uint16_t)sheet->cols;
+    header.viewport_row = (uint16_t)sheet->viewport_row;
+    header.viewport_col = (uint16_t)sheet->viewport_col;
+    header.append_row = (uint16_t)sheet->append_row;
+    header.generation = generation;
+    if (!output_write(out, &header, sizeof(header)))   // rewritten at the end
+        return false;
+
+    int total = sheet->rows * sheet->cols;
+    // One int per cell, plus one, holds any section built in memory.
+    int32_t* cells = scratch->cells;
+    for (int i = 0; i < total; i++)
+        cells[i] = sheet->grid[i].value;
+    bool ok = write_section(out, &header, SECTION_VALUES, cells, (size_t)total * sizeof(int32_t));
+    if (ok) {
+        uint8_t* bits = (uint8_t*)cells;
+        memset(bits, 0, (size_t)(total + 7) / 8);
+        for (int i = 0; i < total; i++)
+            bits[i >> 3] |= (uint8_t)(sheet->grid[i].error_state << (i & 7));
+        ok = write_section(out, &header, SECTION_ERRORS, bits, (size_t)(total + 7) / 8);
+    }
+    // Formula columns, one pass per column over the formula cells.
+    for (int section = SECTION_FORMULA_KEYS; ok && section <= SECTION_FORMULA_CELL2; section++) {
+        int16_t* codes = (int16_t*)cells;
+        int n = 0;
+        for (int i = 0; i < total; i++) {
+            const Cell* cell = &sheet->grid[i];
+            if (cell->formula == -1)
+                continue;
+            if (section == SECTION_FORMULA_CODES)
+                codes[n++] = cell->formula;
+            else
+                cells[n++] = (section == SECTION_FORMULA_KEYS) ? i
+                           : (section == SECTION_FORMULA_CELL1) ? cell->cell1 : cell->cell2;
+        }
+        size_t element = (section == SECTION_FORMULA_CODES) ? sizeof(int16_t) : sizeof(int32_t);
+        ok = write_section(out, &header, section, cells, (size_t)n * element);
+    }
+    // Children as CSR: parents, then offsets, then all keys streamed. A
+    // set holds distinct cells, so collecting it into cells never grows it.
+    if (ok) {
+        int n = 0;
+        for (int i = 0; i < total; i++) {
+            if (sheet->grid[i].children)
+                cells[n++] = i;
+        }
+        ok = write_section(out, &header, SECTION_CHILD_PARENTS, cells, (size_t)n * sizeof(uint32_t));
+        uint32_t* offsets = (uint32_t*)cells;
+        uint64_t edges = 0;
+        n = 0;
+        offsets[0] = 0;
+        for (int i = 0; i < total && ok; i++) {
+            if (!sheet->grid[i].children)
+                continue;
+            edges += (uint64_t)depset_count(sheet->grid[i].children);
+            ok = edges <= UINT32_MAX;
+            offsets[++n] = (uint32_t)edges;
+        }
+        ok = ok && write_section(out, &header, SECTION_CHILD_OFFSETS, offsets, ((size_t)n + 1) * sizeof(uint32_t))
+                && write_section(out, &header, SECTION_CHILD_KEYS, NULL, 0);
+        int capacity = total + 1, count = 0;
+        for (int i = 0; i < total && ok; i++) {
+            if (!sheet->grid[i].children)
+                continue;
+            count = 0;
+            ok = depset_collect(sheet->grid[i].children, &cells, &count, &capacity)
+                 && output_write(out, cells, (size_t)count * sizeof(int));
+        }
+        header.sections[SECTION_CHILD_KEYS].size = (uint64_t)edges * sizeof(int32_t);
+    }
+
+    // Program pool, slot by slot so cell1 of formula 1 cells stays valid.
+    if (ok) {
+        uint32_t* program_offsets = scratch->program_offsets;
+        uint64_t words = 0;
+        program_offsets[0] = 0;
+        for (int j = 0; j < sheet->program_count; j++) {
+            words += sheet->programs[j] ? (uint64_t)sheet->programs[j]->length : 0;
+            program_offsets[j + 1] = (uint32_t)words;
+        }
+        ok = write_section(out, &header, SECTION_PROGRAM_OFFSETS, program_offsets,
+                           ((size_t)sheet->program_count + 1) * sizeof(uint32_t))
+          && write_section(out, &header, SECTION_PROGRAM_CODE, NULL, 0);
+        for (int j = 0; j < sheet->program_count && ok; j++) {
+            const Program* prog = sheet->programs[j];
+            if (prog)
+                ok = output_write(out, prog->code, (size_t)prog->length * sizeof(int));
+        }
+        header.sections[SECTION_PROGRAM_CODE].size = words * sizeof(int32_t);
+    }
+
+    return ok && output_flush(out)
+        && pwrite(out->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+}
+
+static uint64_t checksum_bytes(const uint8_t* data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// Number of cells in a tile; only the last one can be short.
+static inline int tile_cells(int total, int tile) {
+    int n = total - tile * SNAPSHOT_TILE;
+    return n < SNAPSHOT_TILE ? n : SNAPSHOT_TILE;
+}
+
+// Bytes of a delta tile record with n cells and words of program code.
+static inline size_t delta_record_size(int n, uint64_t words) {
+    size_t size = 2 * sizeof(uint32_t) + (3 * (size_t)n + words) * sizeof(int32_t)
+                + (size_t)n * sizeof(int16_t) + (size_t)(n + 7) / 8;
+    return (size + 3) & ~(size_t)3;
+}
+
+// Builds a delta segment of every dirty tile in one buffer. Returns it with
+// its size, or NULL if it cannot be allocated.
+static uint8_t* build_delta(const Spreadsheet* sheet, size_t* size) {
+    int total = sheet->rows * sheet->cols;
+    size_t body = 0;
+    for (int t = 0; t < sheet->dirty_count; t++) {
+        int tile = sheet->dirty_list[t], first = tile * SNAPSHOT_TILE, n = tile_cells(total, tile);
+        uint64_t words = 0;
+        for (int i = first; i < first + n; i++) {
+            if (sheet->grid[i].formula == 1)
+                words += (uint64_t)sheet->programs[sheet->grid[i].cell1]->length;
+        }
+        body += delta_record_size(n, words);
+    }
+    if (body > UINT32_MAX)
+        return NULL;
+    uint8_t* segment = calloc(1, sizeof(DeltaHeader) + body);
+    if (!segment)
+        return NULL;
+    uint8_t* p = segment + sizeof(DeltaHeader);
+    for (int t = 0; t < sheet->dirty_count; t++) {
+        int tile = sheet->dirty_list[t], first = tile * SNAPSHOT_TILE, n = tile_cells(total, tile);
+        int32_t* values = (int32_t*)(p + 2 * sizeof(uint32_t));
+        int32_t* cell1 = values + n;
+        int32_t* cell2 = cell1 + n;
+        int32_t* code = cell2 + n;
+        uint32_t words = 0;
+        for (int i = 0; i < n; i++) {
+            const Cell* cell = &sheet->grid[first + i];
+            values[i] = cell->value;
+            cell1[i] = cell->cell1;
+            cell2[i] = cell->cell2;
+            if (cell->formula == 1) {
+                const Program* prog = sheet->programs[cell->cell1];
+                cell1[i] = prog->length;
+                memcpy(code + words, prog->code, (size_t)prog->length * sizeof(int));
+                words += (uint32_t)prog->length;
+            }
+        }
+        int16_t* formulas = (int16_t*)(code + words);
+        uint8_t* errors = (uint8_t*)(formulas + n);
+        for (int i = 0; i < n; i++) {
+            const Cell* cell = &sheet->grid[first + i];
+            formulas[i] = cell->formula;
+            errors[i >> 3] |= (uint8_t)(cell->error_state << (i & 7));
+        }
+        uint32_t fields[2] = { (uint32_t)tile, words };
+        memcpy(p, fields, sizeof(fields));
+        p += delta_record_size(n, words);
+    }
+    DeltaHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_DELTA_MAGIC, sizeof(header.magic));
+    header.generation = sheet->snapshot_generation;
+    header.checksum = checksum_bytes(segment + sizeof(DeltaHeader), body);
+    header.size = (uint32_t)body;
+    header.tile_count = (uint32_t)sheet->dirty_count;
+    header.viewport_row = (uint16_t)sheet->viewport_row;
+    header.viewport_col = (uint16_t)sheet->viewport_col;
+    header.append_row = (uint16_t)sheet->append_row;
+    memcpy(segment, &header, sizeof(header));
+    *size = sizeof(DeltaHeader) + body;
+    return segment;
+}
+
+// Writes segment at offset of the delta file, dropping anything after the
+// last valid segment, and syncs it. Fails if the file is shorter than offset.
+static bool append_segment(const char* delta_path, uint64_t offset, const uint8_t* segment, size_t size) {
+    int fd = open(delta_path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && (uint64_t)st.st_size >= offset && ftruncate(fd, (off_t)offset) == 0;
+    while (ok && size > 0) {
+        ssize_t n = pwrite(fd, segment, size, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+        if (ok) {
+            segment += n;
+            size -= (size_t)n;
+            offset += (uint64_t)n;
+        }
+    }
+    ok = ok && fsync(fd) == 0;
+    return (close(fd) == 0) && ok;
+}
+
+// Writes a new base snapshot of sheet to path through a temporary file
+// that replaces path only once it is complete and on disk, and removes the
+// old delta file. Returns the new generation and the file size. Makes
+// system calls only, with scratch set up for the same sheet and path.
+static CommandStatus write_base(const Spreadsheet* sheet, const char* path, SnapshotScratch* scratch,
+                                uint64_t* generation, uint64_t* size) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    *generation = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    if (*generation == sheet->snapshot_generation)
+        (*generation)++;
+    int fd = open(scratch->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return CMD_IO_ERROR;
+    SnapshotOutput out = { fd, scratch->buffer, 0, 0 };
+    bool ok = write_snapshot(sheet, *generation, scratch, &out);
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0 && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(scratch->temp_path, path) != 0) {
+        unlink(scratch->temp_path);
+        return CMD_IO_ERROR;
+    }
+    // A leftover delta names the old generation and would be ignored anyway.
+    unlink(scratch->delta_path);
+    *size = (uint64_t)st.st_size;
+    return CMD_OK;
+}
+
+// Makes the base just written to path the one later saves append to.
+static void adopt_snapshot(Spreadsheet* sheet, const char* path, uint64_t generation, uint64_t size) {
+    if (sheet->snapshot_path != path) {
+        free(sheet->snapshot_path);
+        sheet->snapshot_path = strdup(path);
+    }
+    sheet->snapshot_generation = generation;
+    sheet->snapshot_base_size = size;
+    sheet->snapshot_delta_size = 0;
+}
+
+// Saves sheet to path. Saving again to the snapshot the sheet was last
+// saved to or loaded from appends the changed tiles to its delta file;
+// otherwise, or once the delta would outgrow half the base, a new base is
+// written.
+CommandStatus save_snapshot(Spreadsheet* sheet, const char* path) {
+    if (sheet->snapshot_path && strcmp(sheet->snapshot_path, path) == 0) {
+        char delta_path[INPUT_SIZE + 8];
+        snprintf(delta_path, sizeof(delta_path), "%s.delta", path);
+        size_t size;
+        uint8_t* segment = build_delta(sheet, &size);
+        bool appended = segment && sheet->snapshot_delta_size + size <= sheet->snapshot_base_size / 2
+                     && append_segment(delta_path, sheet->snapshot_delta_size, segment, size);
+        free(segment);
+        if (appended) {
+            sheet->snapshot_delta_size += size;
+            clear_dirty(sheet);
+            return CMD_OK;
+        }
+    }
+    uint64_t generation, size;
+    SnapshotScratch scratch;
+    if (!snapshot_scratch_init(&scratch, sheet, path))
+        return CMD_IO_ERROR;
+    CommandStatus status = write_base(sheet, path, &scratch, &generation, &size);
+    snapshot_scratch_free(&scratch);
+    if (status != CMD_OK)
+        return status;
+    adopt_snapshot(sheet, path, generation, size);
+    clear_dirty(sheet);
+    return CMD_OK;
+}
+
+// Whether code is a well-formed program over keys below total: known
+// opcodes with their operands, balanced aggregates and a stack that never
+// underflows or exceeds MAX_PROGRAM_STACK and ends with one value.
+static bool program_valid(const int* code, int length, int total) {
+    int depth = 0, aggregates = 0, pc = 0;
+    if (length <= 0 || length > MAX_PROGRAM_LENGTH)
+        return false;
+    while (pc < length) {
+        int op = code[pc++];
+        switch (op) {
+            case OP_CONST:
+            case OP_REF:
+                if (pc >= length || (op == OP_REF && (code[pc] < 0 || code[pc] >= total)))
+                    return false;
+                pc++;
+                depth++;
+                break;
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+                if (depth < 2)
+                    return false;
+                depth--;
+                break;
+            case OP_NEG:
+                if (depth < 1)
+                    return false;
+                break;
+            case OP_AGG_BEGIN:
+                if (pc >= length || code[pc] < 5 || code[pc] > 9 || ++aggregates > MAX_AGGREGATE_DEPTH)
+                    return false;
+                pc++;
+                break;
+            case OP_AGG_RANGE:
+                if (pc + 1 >= length || aggregates == 0 || code[pc] < 0 || code[pc + 1] < code[pc]
+                    || code[pc + 1] >= total)
+                    return false;
+                pc += 2;
+                break;
+            case OP_AGG_VALUE:
+                if (aggregates == 0 || depth < 1)
+                    return false;
+                depth--;
+                break;
+            case OP_AGG_END:
+                if (aggregates-- == 0)
+                    return false;
+                depth++;
+                break;
+            default:
+                return false;
+        }
+        if (depth > MAX_PROGRAM_STACK)
+            return false;
+    }
+    return depth == 1 && aggregates == 0;
+}
+
+// Whether (formula, cell1, cell2) is a formula the evaluator can run on a
+// sheet of total cells with program_count pool slots.
+static bool formula_valid(short formula, int cell1, int cell2, int total, const Spreadsheet* sheet) {
+    short rem = formula % 10;
+    if (formula == 1)
+        return cell1 >= 0 && cell1 < sheet->program_count && sheet->programs[cell1];
+    if (is_range_formula(formula))
+        return cell1 >= 0 && cell1 <= cell2 && cell2 < total
+            && cell1 % sheet->cols <= cell2 % sheet->cols;
+    if (formula == 82 || formula == 102)
+        return cell1 >= 0 && cell1 < total;
+    if (formula >= 10 && formula <= 43 && (rem == 0 || rem == 2 || rem == 3))
+        return (rem == 3 || (cell1 >= 0 && cell1 < total)) && (rem == 2 || (cell2 >= 0 && cell2 < total));
+    return false;
+}
+
+// Fills a freshly allocated sheet from a mapped snapshot. Returns false if
+// the contents are inconsistent.
+static bool read_snapshot(Spreadsheet* sheet, const char* data, const SnapshotHeader* header) {
+    int total = sheet->rows * sheet->cols;
+    const SnapshotSection* sec = header->sections;
+    size_t formulas = sec[SECTION_FORMULA_KEYS].size / sizeof(uint32_t);
+    size_t parents = sec[SECTION_CHILD_PARENTS].size / sizeof(uint32_t);
+    size_t edges = sec[SECTION_CHILD_KEYS].size / sizeof(int32_t);
+    size_t slots = sec[SECTION_PROGRAM_OFFSETS].size / sizeof(uint32_t);
+    size_t words = sec[SECTION_PROGRAM_CODE].size / sizeof(int32_t);
+    const int32_t* values = (const int32_t*)(data + sec[SECTION_VALUES].offset);
+    const uint8_t* errors = (const uint8_t*)(data + sec[SECTION_ERRORS].offset);
+    // One pass writes every cell, so the grid is only touched once.
+    for (int i = 0; i < total; i++) {
+        Cell* cell = &sheet->grid[i];
+        cell->children = 0;
+        cell->cell1 = 0;
+        cell->cell2 = 0;
+        cell->value = values[i];
+        cell->formula = -1;
+        cell->error_state = (errors[i >> 3] >> (i & 7)) & 1;
+    }
+    if (sec[SECTION_FORMULA_CODES].size != formulas * sizeof(int16_t)
+        || sec[SECTION_FORMULA_CELL1].size != formulas * sizeof(int32_t)
+        || sec[SECTION_FORMULA_CELL2].size != formulas * sizeof(int32_t)
+        || sec[SECTION_CHILD_OFFSETS].size != (parents + 1) * sizeof(uint32_t)
+        || slots == 0)
+        return false;
+    const uint32_t* formula_keys = (const uint32_t*)(data + sec[SECTION_FORMULA_KEYS].offset);
+    const int16_t* formula_codes = (const int16_t*)(data + sec[SECTION_FORMULA_CODES].offset);
+    const int32_t* formula_cell1 = (const int32_t*)(data + sec[SECTION_FORMULA_CELL1].offset);
+    const int32_t* formula_cell2 = (const int32_t*)(data + sec[SECTION_FORMULA_CELL2].offset);
+    const uint32_t* child_parents = (const uint32_t*)(data + sec[SECTION_CHILD_PARENTS].offset);
+    const uint32_t* child_offsets = (const uint32_t*)(data + sec[SECTION_CHILD_OFFSETS].offset);
+    const int32_t* child_keys = (const int32_t*)(data + sec[SECTION_CHILD_KEYS].offset);
+    const uint32_t* program_offsets = (const uint32_t*)(data + sec[SECTION_PROGRAM_OFFSETS].offset);
+    const int32_t* program_code = (const int32_t*)(data + sec[SECTION_PROGRAM_CODE].offset);
+
+    // Program pool first: formula 1 cells are checked against it.
+    if (program_offsets[0] != 0 || program_offsets[slots - 1] != words)
+        return false;
+    for (size_t j = 0; j + 1 < slots; j++) {
+        if (program_offsets[j + 1] < program_offsets[j])
+            return false;
+        int length = (int)(program_offsets[j + 1] - program_offsets[j]);
+        const int* code = program_code + program_offsets[j];
+        // Empty slots are stored too, to keep the numbering, and freed below.
+        if ((length != 0 && !program_valid(code, length, total)) || store_program(sheet, code, length) < 0)
+            return false;
+    }
+    for (int j = 0; j < sheet->program_count; j++) {
+        if (sheet->programs[j]->length == 0)
+            free_program(sheet, j);
+    }
+
+    for (size_t f = 0; f < formulas; f++) {
+        uint32_t key = formula_keys[f];
+        if (key >= (uint32_t)total || (f > 0 && key <= formula_keys[f - 1])
+            || !formula_valid(formula_codes[f], formula_cell1[f], formula_cell2[f], total, sheet))
+            return false;
+        Cell* cell = &sheet->grid[key];
+        cell->formula = formula_codes[f];
+        cell->cell1 = formula_cell1[f];
+        cell->cell2 = formula_cell2[f];
+    }
+    if (child_offsets[0] != 0 || child_offsets[parents] != edges)
+        return false;
+    for (size_t e = 0; e < edges; e++) {
+        if (child_keys[e] < 0 || child_keys[e] >= total)
+            return false;
+    }
+    for (size_t n = 0; n < parents; n++) {
+        uint32_t key = child_parents[n];
+        uint32_t start = child_offsets[n], end = child_offsets[n + 1];
+        if (key >= (uint32_t)total || (n > 0 && key <= child_parents[n - 1]) || end <= start || end > edges)
+            return false;
+        for (uint32_t e = start + 1; e < end; e++) {
+            if (child_keys[e] <= child_keys[e - 1])
+                return false;
+        }
+        sheet->grid[key].children = depset_build_sorted(child_keys + start, (int)(end - start));
+        if (!sheet->grid[key].children)
+            return false;
+    }
+    return true;
+}
+
+// Checks one delta tile record of n cells starting at key first and
+// replaces the tile's cells with it, rewiring the edges of every formula.
+// Returns false if the record is malformed.
+static bool apply_delta_tile(Spreadsheet* sheet, int first, int n, const uint8_t* record, uint32_t words) {
+    int total = sheet->rows * sheet->cols;
+    const int32_t* values = (const int32_t*)(record + 2 * sizeof(uint32_t));
+    const int32_t* cell1 = values + n;
+    const int32_t* cell2 = cell1 + n;
+    const int32_t* code = cell2 + n;
+    const int16_t* formulas = (const int16_t*)(code + words);
+    const uint8_t* errors = (const uint8_t*)(formulas + n);
+    uint32_t offset = 0;
+    for (int i = 0; i < n; i++) {
+        if (formulas[i] == 1) {
+            if (cell1[i] <= 0 || (uint32_t)cell1[i] > words - offset || !program_valid(code + offset, cell1[i], total))
+                return false;
+            offset += (uint32_t)cell1[i];
+        } else if (formulas[i] != -1 && !formula_valid(formulas[i], cell1[i], cell2[i], total, sheet)) {
+            return false;
+        }
+    }
+    if (offset != words)
+        return false;
+    offset = 0;
+    for (int i = 0; i < n; i++) {
+        short row, col;
+        get_row_col(first + i, &row, &col, sheet->cols);
+        Cell* cell = &sheet->grid[first + i];
+        remove_all_parents(sheet, row, col);
+        discard_formula(sheet, cell->formula, cell->cell1);
+        cell->formula = -1;
+        cell->value = values[i];
+        cell->error_state = (errors[i >> 3] >> (i & 7)) & 1;
+        if (formulas[i] == -1)
+            continue;
+        cell->cell1 = cell1[i];
+        cell->cell2 = cell2[i];
+        if (formulas[i] == 1) {
+            cell->cell1 = store_program(sheet, code + offset, cell1[i]);
+            if (cell->cell1 < 0)
+                return false;
+            offset += (uint32_t)cell1[i];
+        }
+        cell->formula = formulas[i];
+        add_children(sheet, cell->cell1, cell->cell2, cell->formula, row, col);
+    }
+    return true;
+}
+
+// Applies the segments of the delta file at delta_path that belong to the
+// sheet's base, stopping at the first stale or torn one, and records how
+// many bytes were valid. Returns false if a segment that passes its
+// checksum is malformed.
+static bool read_deltas(Spreadsheet* sheet, const char* delta_path) {
+    sheet->snapshot_delta_size = 0;
+    int fd = open(delta_path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (!ok || st.st_size == 0) {
+        close(fd);
+        return ok;
+    }
+    size_t size = (size_t)st.st_size;
+    const uint8_t* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    madvise((void*)data, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    int total = sheet->rows * sheet->cols;
+    int tiles = (total + SNAPSHOT_TILE - 1) / SNAPSHOT_TILE;
+    size_t offset = 0;
+    while (ok && size - offset >= sizeof(DeltaHeader)) {
+        DeltaHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        const uint8_t* body = data + offset + sizeof(header);
+        if (memcmp(header.magic, SNAPSHOT_DELTA_MAGIC, sizeof(header.magic)) != 0
+            || header.generation != sheet->snapshot_generation
+            || header.size > size - offset - sizeof(header)
+            || checksum_bytes(body, header.size) != header.checksum)
+            break;
+        size_t at = 0;
+        for (uint32_t t = 0; ok && t < header.tile_count; t++) {
+            uint32_t fields[2];
+            ok = header.size - at >= sizeof(fields);
+            if (ok) {
+                memcpy(fields, body + at, sizeof(fields));
+                ok = fields[0] < (uint32_t)tiles;
+            }
+            if (ok) {
+                int n = tile_cells(total, (int)fields[0]);
+                size_t record = delta_record_size(n, fields[1]);
+                ok = record <= header.size - at
+                  && apply_delta_tile(sheet, (int)fields[0] * SNAPSHOT_TILE, n, body + at, fields[1]);
+                at += record;
+            }
+        }
+        ok = ok && at == header.size && header.viewport_row < sheet->rows && header.viewport_col < sheet->cols
+                && header.append_row <= sheet->rows;
+        if (ok) {
+            sheet->viewport_row = (short)header.viewport_row;
+            sheet->viewport_col = (short)header.viewport_col;
+            sheet->append_row = (short)header.append_row;
+            offset += sizeof(header) + header.size;
+        }
+    }
+    sheet->snapshot_delta_size = offset;
+    munmap((void*)data, size);
+    return ok;
+}
+
+// Maps a snapshot and builds a new sheet from it and its delta file, or
+// returns NULL if the files cannot be read or are not a valid snapshot.
+Spreadsheet* load_snapshot(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    madvise((void*)data, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    bool ok = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0
+           && header.version == SNAPSHOT_VERSION
+           && header.byte_order == SNAPSHOT_BYTE_ORDER
+           && header.rows >= 1 && header.rows <= MAX_ROWS
+           && header.cols >= 1 && header.cols <= MAX_COLS
+           && header.viewport_row < header.rows && header.viewport_col < header.cols
+           && header.append_row <= header.rows;
+    for (int i = 0; ok && i < SECTION_COUNT; i++) {
+        const SnapshotSection* sec = &header.sections[i];
+        ok = sec->offset % sizeof(int32_t) == 0 && sec->offset <= size && sec->size <= size - sec->offset;
+    }
+    // Checked here because read_snapshot fills every cell from these first.
+    uint64_t total = (uint64_t)header.rows * header.cols;
+    ok = ok && header.sections[SECTION_VALUES].size == total * sizeof(int32_t)
+            && header.sections[SECTION_ERRORS].size == (total + 7) / 8;
+    Spreadsheet* sheet = ok ? allocate_spreadsheet((short)header.rows, (short)header.cols) : NULL;
+    ok = sheet && read_snapshot(sheet, data, &header);
+    munmap((void*)data, size);
+    if (ok) {
+        char delta_path[INPUT_SIZE + 8];
+        snprintf(delta_path, sizeof(delta_path), "%s.delta", path);
+        sheet->viewport_row = (short)header.viewport_row;
+        sheet->viewport_col = (short)header.viewport_col;
+        sheet->append_row = (short)header.append_row;
+        sheet->snapshot_generation = header.generation;
+        sheet->snapshot_base_size = (uint64_t)size;
+        sheet->snapshot_path = strdup(path);
+        ok = read_deltas(sheet, delta_path);
+    }
+    // ROLL formulas start over with no state.
+    for (int i = 0; ok && i < sheet->rows * sheet->cols; i++) {
+        if (is_roll_formula(sheet->grid[i].formula))
+            ok = track_roll(sheet, i) != NULL;
+    }
+    if (!ok) {
+        free_spreadsheet(sheet);
+        sheet = NULL;
+    }
+    return sheet;
+}
+
+// Moves the contents of loaded into sheet and frees the old contents with
+// loaded. Session state (output and change feed settings) stays with sheet;
+// with the change feed on, every cell whose shown value differs is noted.
+// Returns false, freeing loaded and keeping sheet, if published values
+// cannot be resized for it.
+bool replace_spreadsheet(Spreadsheet* sheet, Spreadsheet* loaded) {
+    // Readers may be using the old shape and grid until they let go.
+    if (sheet->plane) {
+        pthread_rwlock_wrlock(&sheet->plane->lock);
+        if (!fit_plane(sheet->plane, loaded->rows, loaded->cols)) {
+            pthread_rwlock_unlock(&sheet->plane->lock);
+            free_spreadsheet(loaded);
+            return false;
+        }
+    }
+    Spreadsheet old = *sheet;
+    *sheet = *loaded;
+    sheet->output_enabled = old.output_enabled;
+    sheet->track_changes = old.track_changes;
+    sheet->changes = old.changes;
+    sheet->change_count = old.change_count;
+    sheet->change_capacity = old.change_capacity;
+    sheet->subscriptions = old.subscriptions;
+    sheet->subscription_count = old.subscription_count;
+    sheet->journal = old.journal;
+    sheet->plane = old.plane;
+    if (sheet->track_changes) {
+        bool same_shape = (old.rows == sheet->rows && old.cols == sheet->cols);
+        int total = sheet->rows * sheet->cols;
+        for (int i = 0; i < total; i++) {
+            if (!same_shape || cell_changed(&sheet->grid[i], old.grid[i].value, old.grid[i].error_state))
+                note_change(sheet, i);
+        }
+    }
+    old.changes = NULL;
+    old.subscriptions = NULL;
+    *loaded = old;
+    free_spreadsheet(loaded);
+    if (sheet->plane) {
+        publish_values(sheet);
+        pthread_rwlock_unlock(&sheet->plane->lock);
+    }
+    return true;
+}
+
+/* ---------- Background Checkpoints ---------- */
+// A checkpoint forks and the child writes a new base from its copy-on-write
+// image of the sheet while the parent goes on taking commands. The tiles
+// dirty at the fork are set aside: once the child reports success they are
+// covered by the new base, otherwise they are marked dirty again. Saves,
+// loads and further checkpoints wait for a running one first, so only one
+// writer ever touches a snapshot and its delta.
+typedef struct {
+    int status;                 // CommandStatus of the write
+    uint64_t generation;
+    uint64_t size;
+} CheckpointResult;
+
+// Forks a child that writes sheet's base snapshot to path. Returns once
+// the child is running. The child only makes system calls, into memory
+// allocated here before the fork.
+CommandStatus start_checkpoint(Spreadsheet* sheet, const char* path) {
+    // Copied first: path may be the snapshot path that finishing replaces.
+    char* owned_path = strdup(path);
+    finish_checkpoint(sheet, true, NULL, 0);
+    int* tiles = malloc(((size_t)sheet->dirty_count + 1) * sizeof(int));
+    SnapshotScratch scratch;
+    bool scratch_ready = owned_path && snapshot_scratch_init(&scratch, sheet, owned_path);
+    int fds[2];
+    if (!scratch_ready || !tiles || pipe(fds) != 0) {
+        if (scratch_ready)
+            snapshot_scratch_free(&scratch);
+        free(owned_path);
+        free(tiles);
+        return CMD_IO_ERROR;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        CheckpointResult result;
+        memset(&result, 0, sizeof(result));
+        result.status = write_base(sheet, owned_path, &scratch, &result.generation, &result.size);
+        write_all(fds[1], (const char*)&result, sizeof(result));
+        _exit(0);
+    }
+    snapshot_scratch_free(&scratch);
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        free(owned_path);
+        free(tiles);
+        return CMD_IO_ERROR;
+    }
+    memcpy(tiles, sheet->dirty_list, (size_t)sheet->dirty_count * sizeof(int));
+    sheet->checkpoint_pid = pid;
+    sheet->checkpoint_fd = fds[0];
+    sheet->checkpoint_path = owned_path;
+    sheet->checkpoint_tiles = tiles;
+    sheet->checkpoint_tile_count = sheet->dirty_count;
+    sheet->checkpoint_journal = sheet->journal ? journal_length(sheet->journal) : 0;
+    clear_dirty(sheet);
+    return CMD_OK;
+}
+
+// Collects a finished checkpoint, or waits for a running one if wait is
+// set. Returns false if none finished; otherwise describes the outcome in
+// message, if given.
+bool finish_checkpoint(Spreadsheet* sheet, bool wait, char* message, size_t size) {
+    if (sheet->checkpoint_pid == 0)
+        return false;
+    struct pollfd ready = { sheet->checkpoint_fd, POLLIN, 0 };
+    if (!wait && poll(&ready, 1, 0) <= 0)
+        return false;
+    CheckpointResult result;
+    ssize_t n;
+    do
+        n = read(sheet->checkpoint_fd, &result, sizeof(result));
+    while (n < 0 && errno == EINTR);
+    int child_status;
+    while (waitpid(sheet->checkpoint_pid, &child_status, 0) < 0 && errno == EINTR)
+        ;
+    close(sheet->checkpoint_fd);
+    bool ok = n == (ssize_t)sizeof(result) && result.status == CMD_OK;
+    if (ok) {
+        adopt_snapshot(sheet, sheet->checkpoint_path, result.generation, result.size);
+        if (sheet->journal)
+            journal_checkpoint(sheet->journal, sheet->checkpoint_path, sheet->checkpoint_journal);
+    } else {
+        for (int i = 0; i < sheet->checkpoint_tile_count; i++)
+            mark_dirty(sheet, sheet->checkpoint_tiles[i] * SNAPSHOT_TILE);
+    }
+    if (message) {
+        if (ok)
+            snprintf(message, size, "checkpoint %llu bytes", (unsigned long long)result.size);
+        else
+            snprintf(message, size, "checkpoint failed");
+    }
+    free(sheet->checkpoint_path);
+    free(sheet->checkpoint_tiles);
+    sheet->checkpoint_pid = 0;
+    sheet->checkpoint_path = NULL;
+    sheet->checkpoint_tiles = NULL;
+    sheet->checkpoint_tile_count = 0;
+    return true;
+}
+
+/* ---------- CSV Import ---------- */
+// import <file> AT <cell> loads a table whose top left field lands on the
+// cell. A field holds what may follow '=' in an assignment, optionally with
+// its own leading '='; an empty field leaves its cell alone. Fields are
+// separated by commas and may be double-quoted, with "" for a quote; every
+// line is one row.
+//
+// The file is mapped and cut into line-aligned chunks parsed on their own
+// threads. The parsed cells are then installed in one go: edges are grouped
+// by parent and each parent's children set is rebuilt once from a sorted
+// list, and a single recalculation covers the imported cells and their
+// dependents. An import that would close a cycle is undone as a whole.
+#define IMPORT_CHUNK_MIN (1 << 20)  // bytes of file per parsing thread, at least
+#define IMPORT_MAX_THREADS 16
+
+// One non-empty field, parsed into cell encoding.
+typedef struct {
+    int row;            // line number from the top of the import
+    short col;          // field number
+    short formula;
+    int cell1;          // formula 1: offset of the program in the chunk's code
+    int cell2;          // formula 1: program length
+    int value;
+    bool error;
+} ImportCell;
+
+typedef struct {
+    Spreadsheet* sheet;     // only read while parsing
+    const char* start;      // whole lines of the mapped file
+    const char* end;
+    int max_cols;           // fields that fit right of the import column
+    int rows;               // lines parsed
+    ImportCell* cells;
+    int count;
+    int capacity;
+    int* code;              // programs of the chunk's cells, back to back
+    int code_length;
+    int code_capacity;
+    CommandStatus status;
+    pthread_t thread;
+    bool started;
+} ImportChunk;
+
+// Copies the field at p, unquoted and without surrounding blanks, into
+// field. Returns the position after it (a comma or end), or NULL if the
+// quotes do not match or the field is longer than a command could be.
+static const char* read_csv_field(const char* p, const char* end, char* field) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    size_t len = 0;
+    if (p < end && *p == '"') {
+        for (p++; ; p++) {
+            if (p == end)
+                return NULL;
+            if (*p == '"' && (p + 1 == end || p[1] != '"'))
+                break;
+            if (len == INPUT_SIZE - 1)
+                return NULL;
+            field[len++] = *p;
+            if (*p == '"')
+                p++;
+        }
+        for (p++; p < end && (*p == ' ' || *p == '\t'); p++)
+            ;
+        if (p < end && *p != ',')
+            return NULL;
+    } else {
+        const char* stop = memchr(p, ',', end - p);
+        if (!stop)
+            stop = end;
+        const char* last = stop;
+        while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+            last--;
+        len = last - p;
+        if (len >= INPUT_SIZE)
+            return NULL;
+        memcpy(field, p, len);
+        p = stop;
+    }
+    field[len] = '\0';
+    return p;
+}
+
+static CommandStatus import_field(ImportChunk* chunk, int col, const char* text) {
+    Command command;
+    CommandStatus status = parse_formula(chunk->sheet, text, &command);
+    if (status != CMD_OK)
+        return status;
+    if (command.sleep)
+        return CMD_UNRECOGNIZED;
+    if (chunk->count == chunk->capacity) {
+        int capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+        ImportCell* grown = realloc(chunk->cells, capacity * sizeof(ImportCell));
+        if (!grown)
+            return CMD_IO_ERROR;
+        chunk->cells = grown;
+        chunk->capacity = capacity;
+    }
+    ImportCell* cell = &chunk->cells[chunk->count++];
+    cell->row = chunk->rows;
+    cell->col = (short)col;
+    cell->formula = command.formula;
+    cell->cell1 = command.cell1;
+    cell->cell2 = command.cell2;
+    cell->value = command.value;
+    cell->error = command.error;
+    if (command.formula == 1) {
+        if (chunk->code_length + command.length > chunk->code_capacity) {
+            int capacity = chunk->code_capacity ? chunk->code_capacity * 2 : 4096;
+            int* grown = realloc(chunk->code, capacity * sizeof(int));
+            if (!grown)
+                return CMD_IO_ERROR;
+            chunk->code = grown;
+            chunk->code_capacity = capacity;
+        }
+        cell->cell1 = chunk->code_length;
+        cell->cell2 = command.length;
+        memcpy(chunk->code + chunk->code_length, command.code, command.length * sizeof(int));
+        chunk->code_length += command.length;
+    }
+    return CMD_OK;
+}
+
+static CommandStatus import_line(ImportChunk* chunk, const char* p, const char* end) {
+    char field[INPUT_SIZE];
+    for (int col = 0; ; col++) {
+        p = read_csv_field(p, end, field);
+        if (!p)
+            return CMD_UNRECOGNIZED;
+        if (field[0] != '\0') {
+            if (col >= chunk->max_cols)
+                return CMD_INVALID_RANGE;
+            CommandStatus status = import_field(chunk, col, field[0] == '=' ? field + 1 : field);
+            if (status != CMD_OK)
+                return status;
+        }
+        if (p == end)
+            return CMD_OK;
+        p++;    // ','
+    }
+}
+
+// Thread body: parses one chunk, stopping at its first bad field.
+static void* import_main(void* arg) {
+    ImportChunk* chunk = arg;
+    const char* p = chunk->start;
+    while (p < chunk->end && chunk->status == CMD_OK) {
+        const char* eol = memchr(p, '\n', chunk->end - p);
+        if (!eol)
+            eol = chunk->end;
+        chunk->status = import_line(chunk, p, (eol > p && eol[-1] == '\r') ? eol - 1 : eol);
+        chunk->rows++;
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+// Appends the chunks after the first to it, renumbering their rows and
+// program offsets.
+static bool merge_chunks(ImportChunk* chunks, int n) {
+    int count = 0, code_length = 0;
+    for (int i = 0; i < n; i++) {
+        count += chunks[i].count;
+        code_length += chunks[i].code_length;
+    }
+    ImportChunk* first = &chunks[0];
+    if (count > first->capacity) {
+        ImportCell* grown = realloc(first->cells, count * sizeof(ImportCell));
+        if (!grown)
+            return false;
+        first->cells = grown;
+        first->capacity = count;
+    }
+    if (code_length > first->code_capacity) {
+        int* grown = realloc(first->code, code_length * sizeof(int));
+        if (!grown)
+            return false;
+        first->code = grown;
+        first->code_capacity = code_length;
+    }
+    for (int i = 1; i < n; i++) {
+        ImportChunk* chunk = &chunks[i];
+        for (int k = 0; k < chunk->count; k++) {
+            ImportCell* cell = &first->cells[first->count++];
+            *cell = chunk->cells[k];
+            cell->row += first->rows;
+            if (cell->formula == 1)
+                cell->cell1 += first->code_length;
+        }
+        if (chunk->code_length > 0)
+            memcpy(first->code + first->code_length, chunk->code, chunk->code_length * sizeof(int));
+        first->code_length += chunk->code_length;
+        first->rows += chunk->rows;
+    }
+    return true;
+}
+
+// (parent, child) pairs, in the order the children were installed.
+typedef struct {
+    int* pairs;
+    size_t count;
+    size_t capacity;
+    bool failed;
+} ImportEdges;
+
+static void import_edge_range(ImportEdges* edges, int cols, int start_key, int end_key, int child) {
+    for (int r = start_key / cols; r <= end_key / cols; r++) {
+        for (int c = start_key % cols; c <= end_key % cols; c++) {
+            if (edges->count == edges->capacity) {
+                size_t capacity = edges->capacity ? edges->capacity * 2 : 4096;
+                int* grown = realloc(edges->pairs, capacity * 2 * sizeof(int));
+                if (!grown) {
+                    edges->failed = true;
+                    return;
+                }
+                edges->pairs = grown;
+                edges->capacity = capacity;
+            }
+            edges->pairs[2 * edges->count] = r * cols + c;
+            edges->pairs[2 * edges->count + 1] = child;
+            edges->count++;
+        }
+    }
+}
+
+// The edges add_children would insert for the formula on child.
+static void import_edges(Spreadsheet* sheet, ImportEdges* edges, int child) {
+    Cell* cell = get_cell_check(sheet, child);
+    short rem = cell->formula % 10;
+    if (cell->formula == -1)
+        return;
+    if (is_range_formula(cell->formula)) {
+        import_edge_range(edges, sheet->cols, cell->cell1, cell->cell2, child);
+    } else if (cell->formula == 1) {
+        Program* prog = get_program(sheet, cell->cell1);
+        int start_key, end_key;
+        for (int pc = program_next_precedent(prog->code, prog->length, 0, &start_key, &end_key); pc >= 0;
+             pc = program_next_precedent(prog->code, prog->length, pc, &start_key, &end_key))
+            import_edge_range(edges, sheet->cols, start_key, end_key, child);
+    } else {
+        if (rem == 0 || rem == 2)
+            import_edge_range(edges, sheet->cols, cell->cell1, cell->cell1, child);
+        if (rem == 0 || rem == 3)
+            import_edge_range(edges, sheet->cols, cell->cell2, cell->cell2, child);
+    }
+}
+
+// Links every edge: a counting sort on the parent (using the sheet's
+// pending array, which is all zero outside a recalc) gives each parent its
+// children in installation order, which is ascending key order. Each set
+// is then rebuilt once, merged with the children it already had.
+static void link_edges(Spreadsheet* sheet, const ImportEdges* edges) {
+    int* pending = sheet->pending;
+    int* parents = malloc((edges->count + 1) * sizeof(int));
+    int* starts = malloc((edges->count + 1) * sizeof(int));
+    int* sorted = malloc((edges->count + 1) * sizeof(int));
+    int capacity = 64, existing_count = 0;
+    int* existing = malloc(capacity * sizeof(int));
+    int* merged = NULL;
+    int merged_capacity = 0;
+    if (!parents || !starts || !sorted || !existing) {
+        for (size_t e = 0; e < edges->count; e++) {
+            Cell* parent = get_cell_check(sheet, edges->pairs[2 * e]);
+            parent->children = depset_insert(parent->children, edges->pairs[2 * e + 1]);
+        }
+        free(parents); free(starts); free(sorted); free(existing);
+        return;
+    }
+
+    int parent_count = 0;
+    for (size_t e = 0; e < edges->count; e++) {
+        if (pending[edges->pairs[2 * e]]++ == 0)
+            parents[parent_count++] = edges->pairs[2 * e];
+    }
+    int offset = 0;
+    for (int i = 0; i < parent_count; i++) {
+        int n = pending[parents[i]];
+        starts[i] = pending[parents[i]] = offset;
+        offset += n;
+    }
+    for (size_t e = 0; e < edges->count; e++)
+        sorted[pending[edges->pairs[2 * e]]++] = edges->pairs[2 * e + 1];
+
+    for (int i = 0; i < parent_count; i++) {
+        Cell* parent = get_cell_check(sheet, parents[i]);
+        int* keys = sorted + starts[i];
+        int n = pending[parents[i]] - starts[i];
+        pending[parents[i]] = 0;
+        // A formula reading a cell twice lists it twice in a row.
+        int unique = 0;
+        for (int j = 0; j < n; j++) {
+            if (unique == 0 || keys[unique - 1] != keys[j])
+                keys[unique++] = keys[j];
+        }
+        if (parent->children) {
+            existing_count = 0;
+            bool room = depset_collect(parent->children, &existing, &existing_count, &capacity);
+            if (room && existing_count + unique > merged_capacity) {
+                int* grown = realloc(merged, (existing_count + unique) * sizeof(int));
+                room = grown != NULL;
+                if (grown) {
+                    merged = grown;
+                    merged_capacity = existing_count + unique;
+                }
+            }
+            if (!room) {
+                for (int j = 0; j < unique; j++)
+                    parent->children = depset_insert(parent->children, keys[j]);
+                continue;
+            }
+            int a = 0, b = 0, m = 0;
+            while (a < existing_count || b < unique) {
+                if (b == unique || (a < existing_count && existing[a] < keys[b]))
+                    merged[m++] = existing[a++];
+                else if (a == existing_count || keys[b] < existing[a])
+                    merged[m++] = keys[b++];
+                else {
+                    merged[m++] = existing[a++];
+                    b++;
+                }
+            }
+            keys = merged;
+            unique = m;
+        }
+        DepSet set = depset_build_sorted(keys, unique);
+        if (!set)
+            continue;
+        depset_free(parent->children);
+        parent->children = set;
+    }
+    free(parents);
+    free(starts);
+    free(sorted);
+    free(existing);
+    free(merged);
+}
+
+// Puts back what the imported cells held before, given the saved copies.
+static void undo_import(Spreadsheet* sheet, const int* keys, const Cell* saved, int count) {
+    for (int k = 0; k < count; k++) {
+        short r, c;
+        get_row_col(keys[k], &r, &c, sheet->cols);
+        Cell* cell = get_cell_check(sheet, keys[k]);
+        remove_all_parents(sheet, r, c);
+        discard_formula(sheet, cell->formula, cell->cell1);
+        cell->formula = saved[k].formula;
+        cell->cell1 = saved[k].cell1;
+        cell->cell2 = saved[k].cell2;
+        cell->value = saved[k].value;
+        cell->error_state = saved[k].error_state;
+    }
+    for (int k = 0; k < count; k++) {
+        short r, c;
+        get_row_col(keys[k], &r, &c, sheet->cols);
+        add_children(sheet, saved[k].cell1, saved[k].cell2, saved[k].formula, r, c);
+    }
+}
+
+// Installs the merged chunk at (row, col), or leaves the sheet as it was
+// with CMD_CIRCULAR_REF if its formulas close a cycle and CMD_IO_ERROR if
+// memory runs out.
+static CommandStatus install_import(Spreadsheet* sheet, ImportChunk* chunk, short row, short col, double* sleep_time) {
+    int count = chunk->count;
+    int* keys = malloc((count + 1) * sizeof(int));
+    int* roots = malloc((count + 1) * sizeof(int));
+    Cell* saved = malloc((count + 1) * sizeof(Cell));
+    if (!keys || !roots || !saved) {
+        free(keys); free(roots); free(saved);
+        return CMD_IO_ERROR;
+    }
+    // Programs go into the pool first, so running out of memory there
+    // leaves the sheet as it was.
+    for (int k = 0; k < count; k++) {
+        ImportCell* field = &chunk->cells[k];
+        if (field->formula != 1)
+            continue;
+        int slot = store_program(sheet, chunk->code + field->cell1, field->cell2);
+        if (slot < 0) {
+            while (k-- > 0) {
+                if (chunk->cells[k].formula == 1)
+                    free_program(sheet, chunk->cells[k].cell1);
+            }
+            free(keys); free(roots); free(saved);
+            return CMD_IO_ERROR;
+        }
+        field->cell1 = slot;
+    }
+    for (int k = 0; k < count; k++) {
+        ImportCell* field = &chunk->cells[k];
+        if (is_roll_formula(field->formula)
+            && !track_roll(sheet, encode_cell_key((short)(row + field->row), (short)(col + field->col), sheet->cols))) {
+            for (int j = 0; j < count; j++) {
+                if (chunk->cells[j].formula == 1)
+                    free_program(sheet, chunk->cells[j].cell1);
+            }
+            free(keys); free(roots); free(saved);
+            return CMD_IO_ERROR;
+        }
+    }
+
+    // Swap in the new formulas, unlinking the old ones; the old programs
+    // are kept until the import is known to stand.
+    ImportEdges edges = { NULL, 0, 0, false };
+    int root_count = 0;
+    for (int k = 0; k < count; k++) {
+        ImportCell* field = &chunk->cells[k];
+        short r = (short)(row + field->row), c = (short)(col + field->col);
+        int key = encode_cell_key(r, c, sheet->cols);
+        Cell* cell = get_cell_check(sheet, key);
+        keys[k] = key;
+        saved[k] = *cell;
+        remove_all_parents(sheet, r, c);
+        cell->formula = field->formula;
+        cell->cell1 = field->cell1;
+        cell->cell2 = field->cell2;
+        if (field->formula == -1) {
+            if (!field->error)
+                cell->value = field->value;
+            cell->error_state = field->error;
+        } else {
+            roots[root_count++] = key;
+            import_edges(sheet, &edges, key);
+        }
+    }
+    CommandStatus status = CMD_OK;
+    if (edges.failed) {
+        status = CMD_IO_ERROR;
+    } else {
+        link_edges(sheet, &edges);
+        status = recalculate(sheet, keys, count, roots, root_count, true, sleep_time);
+    }
+
+    if (status != CMD_OK) {
+        undo_import(sheet, keys, saved, count);
+    } else {
+        for (int k = 0; k < count; k++) {
+            Cell* cell = get_cell_check(sheet, keys[k]);
+            discard_formula(sheet, saved[k].formula, saved[k].cell1);
+            if (sheet->track_changes && cell->formula == -1
+                && cell_changed(cell, saved[k].value, saved[k].error_state))
+                note_change(sheet, keys[k]);
+            mark_dirty(sheet, keys[k]);
+        }
+    }
+    free(edges.pairs);
+    free(keys);
+    free(roots);
+    free(saved);
+    return status;
+}
+
+// Imports the CSV file at path with its first field on (row, col). Nothing
+// changes unless every field parses and fits in the sheet.
+CommandStatus import_csv(Spreadsheet* sheet, const char* path, short row, short col, double* sleep_time) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return CMD_IO_ERROR;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return CMD_IO_ERROR;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        return CMD_OK;
+    }
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return CMD_IO_ERROR;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n = size / IMPORT_CHUNK_MIN + 1;
+    if (cpus > 0 && n > (size_t)cpus)
+        n = (size_t)cpus;
+    if (n > IMPORT_MAX_THREADS)
+        n = IMPORT_MAX_THREADS;
+    ImportChunk chunks[IMPORT_MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    const char* p = data;
+    const char* file_end = data + size;
+    for (size_t i = 0; i < n; i++) {
+        ImportChunk* chunk = &chunks[i];
+        chunk->sheet = sheet;
+        chunk->max_cols = sheet->cols - col;
+        chunk->status = CMD_OK;
+        chunk->start = p;
+        const char* cut = data + size / n * (i + 1);
+        if (i + 1 == n || cut < p) {
+            chunk->end = (i + 1 == n) ? file_end : p;
+        } else {
+            const char* eol = memchr(cut, '\n', file_end - cut);
+            chunk->end = eol ? eol + 1 : file_end;
+        }
+        p = chunk->end;
+    }
+    for (size_t i = 1; i < n; i++)
+        chunks[i].started = pthread_create(&chunks[i].thread, NULL, import_main, &chunks[i]) == 0;
+    import_main(&chunks[0]);
+    for (size_t i = 1; i < n; i++) {
+        if (chunks[i].started)
+            pthread_join(chunks[i].thread, NULL);
+        else
+            import_main(&chunks[i]);
+    }
+    munmap(data, size);
+
+    // The first bad field in file order decides the status.
+    CommandStatus status = CMD_OK;
+    for (size_t i = 0; i < n && status == CMD_OK; i++)
+        status = chunks[i].status;
+    if (status == CMD_OK && !merge_chunks(chunks, (int)n))
+        status = CMD_IO_ERROR;
+    for (int k = 0; status == CMD_OK && k < chunks[0].count; k++) {
+        if (chunks[0].cells[k].row >= sheet->rows - row)
+            status = CMD_INVALID_RANGE;
+    }
+    if (status == CMD_OK)
+        status = install_import(sheet, &chunks[0], row, col, sleep_time);
+    for (size_t i = 0; i < n; i++) {
+        free(chunks[i].cells);
+        free(chunks[i].code);
+    }
+    return status;
+}
+
+/* ---------- CSV Export ---------- */
+#define EXPORT_BUFFER_SIZE (1 << 16)
+#define EXPORT_FIELD_SIZE 12    // "-2147483648," is the longest field
+
+// Writes the values in range to path as CSV, one line per row and ERR for
+// an erroneous cell. Fields are formatted straight into one buffer, which is
+// written out whenever it cannot take another field.
+CommandStatus export_csv(Spreadsheet* sheet, const Range* range, const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return CMD_IO_ERROR;
+    char* buf = malloc(EXPORT_BUFFER_SIZE);
+    bool ok = buf != NULL;
+    char* p = buf;
+    for (int r = range->start_row; ok && r <= range->end_row; r++) {
+        const Cell* row_cells = get_cell(sheet, r, 0);
+        for (int c = range->start_col; c <= range->end_col; c++) {
+            if (p + EXPORT_FIELD_SIZE > buf + EXPORT_BUFFER_SIZE) {
+                if (!(ok = write_all(fd, buf, p - buf)))
+                    break;
+                p = buf;
+            }
+            if (row_cells[c].error_state) {
+                memcpy(p, "ERR", 3);
+                p += 3;
+            } else {
+                p = format_int(p, row_cells[c].value, 0);
+            }
+            *p++ = (c == range->end_col) ? '\n' : ',';
+        }
+    }
+    if (ok)
+        ok = write_all(fd, buf, p - buf);
+    free(buf);
+    if (close(fd) != 0)
+        ok = false;
+    return ok ? CMD_OK : CMD_IO_ERROR;
+}
+
+// Human readable form of a command status, as shown in the prompt.
+const char* status_message(CommandStatus status) {
+    switch (status) {
+        case CMD_OK: return "ok";
+        case CMD_UNRECOGNIZED: return "unrecognized cmd";
+        case CMD_INVALID_CELL: return "invalid cell";
+        case CMD_INVALID_RANGE: return "invalid range";
+        case CMD_CIRCULAR_REF: return "circular ref";
+        case CMD_RANGE_ERROR: return "range error";
+        case CMD_IO_ERROR: return "io error";
+        default: return "error";
+    }
+}
+
+/* ---------- Binary Commands ---------- */
+// The protocol is described in sheet_internal.h.
+// Whether header describes a batch that can be run.
+bool batch_valid(const BinaryBatch* header) {
+    return header->size <= BINARY_BATCH_SIZE - sizeof(BinaryBatch)
+           && header->count <= header->size / BINARY_RECORD_MIN;
+}
+
+// Returns the size of the record at p, which has available bytes, or 0 if
+// its opcode is unknown or it is cut short.
+static size_t record_size(const uint8_t* p, size_t available) {
+    static const uint8_t sizes[] = {
+        [BINARY_LITERAL] = 1 + sizeof(BinaryCell) + 4,
+        [BINARY_REF] = 1 + 2 * sizeof(BinaryCell),
+        [BINARY_ARITH] = 2 + sizeof(BinaryCell) + 8,
+        [BINARY_RANGE] = 2 + 3 * sizeof(BinaryCell),
+        [BINARY_GET] = 1 + sizeof(BinaryCell),
+        [BINARY_TEXT] = 1 + sizeof(uint16_t)
+    };
+    if (available == 0 || p[0] < BINARY_LITERAL || p[0] > BINARY_TEXT)
+        return 0;
+    size_t size = sizes[p[0]];
+    if (p[0] == BINARY_TEXT && available >= size) {
+        uint16_t length;
+        memcpy(&length, p + 1, sizeof(length));
+        size += length;
+    }
+    return size <= available ? size : 0;
+}
+
+// Reads the cell at p, which must lie in a rows x cols sheet.
+static bool binary_cell(const uint8_t* p, short rows, short cols, short* row, short* col) {
+    BinaryCell cell;
+    memcpy(&cell, p, sizeof(cell));
+    if (cell.row >= rows || cell.col >= cols)
+        return false;
+    *row = (short)cell.row;
+    *col = (short)cell.col;
+    return true;
+}
+
+// Reads the operand at p into its cell encoding: a cell's key, or a literal.
+static bool binary_operand(const Spreadsheet* sheet, const uint8_t* p, bool is_cell, int* operand) {
+    short row, col;
+    if (!is_cell) {
+        memcpy(operand, p, sizeof(*operand));
+        return true;
+    }
+    if (!binary_cell(p, sheet->rows, sheet->cols, &row, &col))
+        return false;
+    *operand = encode_cell_key(row, col, sheet->cols);
+    return true;
+}
+
+// Decodes the record at p, of the given size, into command. A text record
+// is copied into text (INPUT_SIZE bytes) and parsed.
+static CommandStatus decode_command(Spreadsheet* sheet, const uint8_t* p, size_t size, Command* command, char* text) {
+    if (p[0] == BINARY_TEXT) {
+        size_t length = size - 1 - sizeof(uint16_t);
+        if (length >= INPUT_SIZE || memchr(p + 3, '\0', length))
+            return CMD_UNRECOGNIZED;
+        memcpy(text, p + 3, length);
+        text[length] = '\0';
+        return parse_command(sheet, text, command);
+    }
+    command->kind = COMMAND_ASSIGN;
+    command->sleep = false;
+    command->error = false;
+    // The formula code, if any, comes before the target cell.
+    const uint8_t* q = p + ((p[0] == BINARY_ARITH || p[0] == BINARY_RANGE) ? 2 : 1);
+    if (!binary_cell(q, sheet->rows, sheet->cols, &command->row, &command->col))
+        return CMD_INVALID_CELL;
+    q += sizeof(BinaryCell);
+    short formula = p[1];
+    switch (p[0]) {
+        case BINARY_LITERAL:
+            command->formula = -1;
+            memcpy(&command->value, q, sizeof(command->value));
+            return CMD_OK;
+        case BINARY_REF:
+            command->formula = 82;
+            return binary_operand(sheet, q, true, &command->cell1) ? CMD_OK : CMD_INVALID_CELL;
+        case BINARY_ARITH: {
+            short rem = formula % 10;
+            if (formula < 10 || formula > 43 || (rem != 0 && rem != 2 && rem != 3))
+                return CMD_UNRECOGNIZED;
+            command->formula = formula;
+            if (!binary_operand(sheet, q, rem != 3, &command->cell1)
+                || !binary_operand(sheet, q + 4, rem != 2, &command->cell2))
+                return CMD_INVALID_CELL;
+            return CMD_OK;
+        }
+        case BINARY_RANGE: {
+            if (formula < 5 || formula > 9)
+                return CMD_UNRECOGNIZED;
+            Range range;
+            if (!binary_cell(q, sheet->rows, sheet->cols, &range.start_row, &range.start_col)
+                || !binary_cell(q + sizeof(BinaryCell), sheet->rows, sheet->cols, &range.end_row, &range.end_col))
+                return CMD_INVALID_CELL;
+            if (range.start_row > range.end_row || range.start_col > range.end_col)
+                return CMD_INVALID_RANGE;
+            command->formula = formula;
+            command->cell1 = encode_cell_key(range.start_row, range.start_col, sheet->cols);
+            command->cell2 = encode_cell_key(range.end_row, range.end_col, sheet->cols);
+            return CMD_OK;
+        }
+    }
+    return CMD_UNRECOGNIZED;
+}
+
+// Writes the name of cell key at p and returns the end.
+static char* format_cell(const Spreadsheet* sheet, char* p, int key) {
+    short row, col;
+    get_row_col(key, &row, &col, sheet->cols);
+    get_column_name(col + 1, p);
+    return format_int(p + strlen(p), row + 1, 0);
+}
+
+// Writes the text a decoded assignment would have been sent as, for the
+// journal.
+static void format_assignment(const Spreadsheet* sheet, const Command* command, char* text) {
+    short formula = command->formula;
+    char* p = format_cell(sheet, text, encode_cell_key(command->row, command->col, sheet->cols));
+    *p++ = '=';
+    if (formula == -1) {
+        p = format_int(p, command->value, 0);
+    } else if (formula == 82) {
+        p = format_cell(sheet, p, command->cell1);
+    } else if (formula >= 5 && formula <= 9) {
+        p += sprintf(p, "%s(", range_functions[formula - 5].name);
+        p = format_cell(sheet, p, command->cell1);
+        *p++ = ':';
+        p = format_cell(sheet, p, command->cell2);
+        *p++ = ')';
+    } else {
+        short rem = formula % 10;
+        p = (rem == 3) ? format_int(p, command->cell1, 0) : format_cell(sheet, p, command->cell1);
+        *p++ = "+-/*"[formula / 10 - 1];
+        p = (rem == 2) ? format_int(p, command->cell2, 0) : format_cell(sheet, p, command->cell2);
+    }
+    *p = '\0';
+}
+
+// Whether every record of the batch is a get, so it can be answered from
+// published values.
+bool batch_reads_only(const uint8_t* records, const BinaryBatch* header) {
+    size_t pos = 0;
+    for (uint32_t i = 0; i < header->count; i++) {
+        size_t size = record_size(records + pos, header->size - pos);
+        if (size == 0 || records[pos] != BINARY_GET)
+            return false;
+        pos += size;
+    }
+    return true;
+}
+
+// Runs a batch and writes its reply into reply (BINARY_REPLY_SIZE bytes),
+// returning the reply's length. Gets see the commands before them; with
+// published values, the batch's changes are published once at its end.
+size_t run_batch(Spreadsheet* sheet, const uint8_t* records, const BinaryBatch* header, uint8_t* reply) {
+    memcpy(reply, header, sizeof(*header));
+    uint8_t* statuses = reply + sizeof(*header);
+    uint8_t* values = statuses + header->count;
+    Command command;
+    char text[INPUT_SIZE];
+    size_t pos = 0;
+    uint32_t i = 0;
+    for (; i < header->count; i++) {
+        const uint8_t* p = records + pos;
+        size_t size = record_size(p, header->size - pos);
+        if (size == 0)
+            break;
+        pos += size;
+        CommandStatus status;
+        if (p[0] == BINARY_GET) {
+            short row, col;
+            status = binary_cell(p + 1, sheet->rows, sheet->cols, &row, &col) ? CMD_OK : CMD_INVALID_CELL;
+            if (status == CMD_OK) {
+                const Cell* cell = get_cell(sheet, row, col);
+                BinaryValue value = { cell->value, cell->error_state };
+                memcpy(values, &value, sizeof(value));
+                values += sizeof(value);
+            }
+        } else {
+            double sleep_time = 0.0;
+            status = decode_command(sheet, p, size, &command, text);
+            if (status == CMD_OK && sheet->journal && p[0] != BINARY_TEXT)
+                format_assignment(sheet, &command, text);
+            if (status == CMD_OK)
+                status = execute_command(sheet, &command, text, &sleep_time);
+        }
+        statuses[i] = (uint8_t)status;
+    }
+    memset(statuses + i, CMD_UNRECOGNIZED, header->count - i);
+    if (sheet->plane)
+        publish_values(sheet);
+    return (size_t)(values - reply);
+}
+
+// Answers a batch of gets from sheet's published values without waiting
+// for a command; see run_batch.
+size_t read_batch(Spreadsheet* sheet, const uint8_t* records, const BinaryBatch* header, uint8_t* reply) {
+    ValuePlane* plane = sheet->plane;
+    memcpy(reply, header, sizeof(*header));
+    uint8_t* statuses = reply + sizeof(*header);
+    uint8_t* values = statuses + header->count;
+    pthread_rwlock_rdlock(&plane->lock);
+    for (uint32_t i = 0; i < header->count; i++) {
+        const uint8_t* p = records + i * BINARY_RECORD_MIN;
+        short row, col;
+        if (!binary_cell(p + 1, plane->rows, plane->cols, &row, &col)) {
+            statuses[i] = CMD_INVALID_CELL;
+            continue;
+        }
+        BinaryValue value;
+        bool error;
+        unsigned sequence;
+        do {
+            sequence = read_begin(plane);
+            value.value = shown_value(plane, row * plane->cols + col, &error);
+        } while (read_retry(plane, sequence));
+        value.error = error;
+        memcpy(values, &value, sizeof(value));
+        values += sizeof(value);
+        statuses[i] = CMD_OK;
+    }
+    pthread_rwlock_unlock(&plane->lock);
+    return (size_t)(values - reply);
+}
+
+// Sets each of the distinct cells keys[i] to the literal values[i], then
+// recalculates what depends on them together, so a cell that depends on
+// several is evaluated once. With a journal each cell is logged as its own
+// assignment.
+CommandStatus write_cells(Spreadsheet* sheet, const int* keys, const int* values, int count) {
+    if (sheet->journal) {
+        Command command;
+        command.kind = COMMAND_ASSIGN;
+        command.formula = -1;
+        char text[INPUT_SIZE];
+        for (int i = 0; i < count; i++) {
+            get_row_col(keys[i], &command.row, &command.col, sheet->cols);
+            command.value = values[i];
+            format_assignment(sheet, &command, text);
+            if (!journal_append(sheet->journal, text))
+                return CMD_IO_ERROR;
+        }
+    }
+    for (int i = 0; i < count; i++)
+        set_literal(sheet, keys[i], values[i]);
+    double sleep_time = 0.0;
+    return recalculate(sheet, keys, count, NULL, 0, false, &sleep_time);
+}
+
+
+/* ---------- Library Interface ---------- */
+// The calls of sheet.h. Writes go through the same path as commands, so a
+// sheet with a journal or published values behaves as if they were typed.
+Spreadsheet* sheet_create(int rows, int cols) {
+    if (rows < 1 || rows > MAX_ROWS || cols < 1 || cols > MAX_COLS)
+        return NULL;
+    return create_spreadsheet((short)rows, (short)cols);
+}
+
+Spreadsheet* sheet_load(const char* path) {
+    return load_snapshot(path);
+}
+
+void sheet_free(Spreadsheet* sheet) {
+    if (!sheet)
+        return;
+    finish_checkpoint(sheet, true, NULL, 0);
+    if (sheet->journal)
+        journal_close(sheet->journal);
+    if (sheet->plane)
+        free_plane(sheet->plane);
+    free_spreadsheet(sheet);
+}
+
+int sheet_rows(const Spreadsheet* sheet) {
+    return sheet->rows;
+}
+
+int sheet_cols(const Spreadsheet* sheet) {
+    return sheet->cols;
+}
+
+// Applies an assignment built by a call; text is its command, needed only
+// for the journal.
+static CommandStatus set_cell(Spreadsheet* sheet, const Command* command, const char* text) {
+    double sleep_time = 0.0;
+    CommandStatus status = execute_command(sheet, command, text, &sleep_time);
+    if (sheet->plane)
+        publish_values(sheet);
+    return status;
+}
+
+CommandStatus sheet_set_value(Spreadsheet* sheet, int row, int col, int value) {
+    if (!cell_in_sheet(sheet, row, col))
+        return CMD_INVALID_CELL;
+    Command command;
+    command.kind = COMMAND_ASSIGN;
+    command.row = (short)row;
+    command.col = (short)col;
+    command.formula = -1;
+    command.value = value;
+    command.error = false;
+    command.sleep = false;
+    char text[INPUT_SIZE];
+    if (sheet->journal)
+        format_assignment(sheet, &command, text);
+    return set_cell(sheet, &command, text);
+}
+
+CommandStatus sheet_set_formula(Spreadsheet* sheet, int row, int col, const char* formula) {
+    if (!cell_in_sheet(sheet, row, col))
+        return CMD_INVALID_CELL;
+    // The formula must fit a command line, as if typed.
+    char text[INPUT_SIZE];
+    char* p = format_cell(sheet, text, encode_cell_key(row, col, sheet->cols));
+    size_t len = strlen(formula);
+    if ((size_t)(p - text) + 1 + len >= sizeof(text))
+        return CMD_UNRECOGNIZED;
+    *p++ = '=';
+    memcpy(p, formula, len + 1);
+    Command command;
+    command.kind = COMMAND_ASSIGN;
+    command.row = (short)row;
+    command.col = (short)col;
+    CommandStatus status = parse_formula(sheet, p, &command);
+    if (status != CMD_OK)
+        return status;
+    return set_cell(sheet, &command, text);
+}
+
+CommandStatus sheet_get_value(const Spreadsheet* sheet, int row, int col, int* value, bool* error) {
+    if (!cell_in_sheet(sheet, row, col))
+        return CMD_INVALID_CELL;
+    const Cell* cell = &sheet->grid[encode_cell_key(row, col, sheet->cols)];
+    *value = cell->value;
+    *error = cell->error_state;
+    return CMD_OK;
+}
+
+// Checks a rows x cols rectangle at (row, col) and the stride of the
+// caller's buffer.
+static CommandStatus check_block(const Spreadsheet* sheet, int row, int col, int rows, int cols, size_t stride) {
+    if (rows < 1 || cols < 1 || stride < (size_t)cols)
+        return CMD_INVALID_RANGE;
+    if (!cell_in_sheet(sheet, row, col) || rows > sheet->rows - row || cols > sheet->cols - col)
+        return CMD_INVALID_CELL;
+    return CMD_OK;
+}
+
+CommandStatus sheet_read_range(const Spreadsheet* sheet, int row, int col, int rows, int cols,
+                               int* values, bool* errors, size_t stride) {
+    CommandStatus status = check_block(sheet, row, col, rows, cols, stride);
+    if (status != CMD_OK)
+        return status;
+    for (int r = 0; r < rows; r++) {
+        const Cell* cell = &sheet->grid[encode_cell_key(row + r, col, sheet->cols)];
+        int* out = values + r * stride;
+        for (int c = 0; c < cols; c++)
+            out[c] = cell[c].value;
+        if (errors) {
+            bool* error = errors + r * stride;
+            for (int c = 0; c < cols; c++)
+                error[c] = cell[c].error_state;
+        }
+    }
+    return CMD_OK;
+}
+
+CommandStatus sheet_write_range(Spreadsheet* sheet, int row, int col, int rows, int cols,
+                                const int* values, size_t stride) {
+    CommandStatus status = check_block(sheet, row, col, rows, cols, stride);
+    if (status != CMD_OK)
+        return status;
+    int count = rows * cols;
+    int* keys = malloc((size_t)count * sizeof(int));
+    int* block = malloc((size_t)count * sizeof(int));
+    if (!keys || !block) {
+        free(keys);
+        free(block);
+        return CMD_UNRECOGNIZED;
+    }
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            keys[r * cols + c] = encode_cell_key(row + r, col + c, sheet->cols);
+            block[r * cols + c] = values[r * stride + c];
+        }
+    }
+    status = write_cells(sheet, keys, block, count);
+    free(keys);
+    free(block);
+    if (sheet->plane)
+        publish_values(sheet);
+    return status;
+}
+
+CommandStatus sheet_command(Spreadsheet* sheet, const char* command) {
+    double sleep_time = 0.0;
+    return handle_command(sheet, command, &sleep_time);
+}
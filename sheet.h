@@ -0,0 +1,63 @@
+#ifndef SHEET_H
+#define SHEET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Status of a command or library call.
+typedef enum {
+    CMD_OK,
+    CMD_UNRECOGNIZED,
+    CMD_INVALID_CELL,
+    CMD_INVALID_RANGE,
+    CMD_CIRCULAR_REF,
+    CMD_RANGE_ERROR,
+    CMD_IO_ERROR,
+    CMD_STATUS_COUNT    // number of statuses, not a status itself
+} CommandStatus;
+
+// A spreadsheet, used only through the functions below. Cells are
+// addressed by 0-based row and column; A1 is (0, 0).
+typedef struct Spreadsheet Spreadsheet;
+
+// Creates a sheet of rows x cols cells, all 0 (1-999 rows, 1-18278
+// columns). Returns NULL if the size is out of range or memory runs out.
+Spreadsheet* sheet_create(int rows, int cols);
+
+// Loads a sheet written by the save command. Returns NULL on failure.
+Spreadsheet* sheet_load(const char* path);
+
+// Frees sheet, waiting first for a checkpoint it is writing.
+void sheet_free(Spreadsheet* sheet);
+
+int sheet_rows(const Spreadsheet* sheet);
+int sheet_cols(const Spreadsheet* sheet);
+
+// Sets cell (row, col) to value and recalculates what depends on it.
+CommandStatus sheet_set_value(Spreadsheet* sheet, int row, int col, int value);
+
+// Sets cell (row, col) to formula, written as after '=' in a command:
+// "A1+B2", "SUM(A1:C3)" or "7". SLEEP does not sleep here.
+CommandStatus sheet_set_formula(Spreadsheet* sheet, int row, int col, const char* formula);
+
+// Reads cell (row, col) into value, or sets error if it has none.
+CommandStatus sheet_get_value(const Spreadsheet* sheet, int row, int col, int* value, bool* error);
+
+// Copies the values of the rows x cols block at (row, col) into values,
+// and into errors, unless it is NULL, whether each cell is in error. Row r
+// of the block starts at values[r * stride] and errors[r * stride].
+CommandStatus sheet_read_range(const Spreadsheet* sheet, int row, int col, int rows, int cols,
+                               int* values, bool* errors, size_t stride);
+
+// Sets the rows x cols block at (row, col) to the values laid out as for
+// sheet_read_range, then recalculates what depends on them in one pass.
+CommandStatus sheet_write_range(Spreadsheet* sheet, int row, int col, int rows, int cols,
+                                const int* values, size_t stride);
+
+// Runs one command of the text language, as typed at the prompt.
+CommandStatus sheet_command(Spreadsheet* sheet, const char* command);
+
+// Human readable form of a status, as shown in the prompt.
+const char* status_message(CommandStatus status);
+
+#endif // SHEET_H
@@ -0,0 +1,343 @@
+#ifndef SHEET_INTERNAL_H
+#define SHEET_INTERNAL_H
+
+// The engine's data structures and entry points, shared by sheet.c and the
+// front end built with it. Embedders use sheet.h.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include "depset.h"
+#include "sheet.h"
+
+#define MAX_ROWS 999
+#define MAX_COLS 18278
+#define VIEWPORT_SIZE 10
+#define INPUT_SIZE 128
+#define CELL_WIDTH 8        // printed width of a column
+#define SNAPSHOT_TILE 1024  // cells per tile of dirty tracking, in key order
+
+// Range structure: 4 shorts (8 bytes total)
+typedef struct {
+    short start_row;
+    short start_col;
+    short end_row;
+    short end_col;
+} Range;
+
+// Optimized Cell structure.
+// __attribute__((packed)) minimizes padding.
+typedef struct __attribute__((packed)) Cell {
+    DepSet children;    // 8 bytes (dependents: inline keys, a vector or a tree)
+    int cell1;           // Stores parent cell key or start of range or custom value
+    int cell2;           // Stores parent cell key or end of range or custom value
+    int value;          // stores the value of the cell
+    short formula;      // stores the formula code
+    bool error_state;  // 1 byte
+} Cell;
+// Formula codes
+// -1: No formula
+// 1: Compiled expression (cell1 = slot in the sheet's program pool)
+// 82: Simple cell reference
+// 10: Add with both cells 
+// 20: Sub ''
+// 30: Div ''
+// 40: Mult ''
+// 12: Add with single cell and custom value
+// 22: Sub ''
+// 32: Div ''
+// 42: Mult ''
+// 13: Add with custom value and single cell
+// 23: Sub ''
+// 33: Div '' 
+// 43: Mult ''
+// 5: SUM in Range cell1 to cell2
+// 6: AVG
+// 7: MIN
+// 8: MAX
+// 9: STDEV
+// 102: SLEEP with cell reference
+// 105-109: ROLLSUM-ROLLSTDEV over the window cell1 to cell2, which slides
+//          down a row with each append_row just below it
+
+static inline bool is_roll_formula(short formula) {
+    return formula >= 105 && formula <= 109;
+}
+
+// Formulas whose precedents are the range cell1 to cell2.
+static inline bool is_range_formula(short formula) {
+    return (formula >= 5 && formula <= 9) || is_roll_formula(formula);
+}
+
+// Bytecode of compiled expressions. A program is a flat stream of ints: an
+// opcode followed by its inline operands. Values live on a small int stack;
+// function calls accumulate their arguments into an aggregate.
+typedef enum {
+    OP_CONST,       // <value>: push value
+    OP_REF,         // <key>: push value of cell key
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_NEG,
+    OP_AGG_BEGIN,   // <fn>: open an aggregate, fn is a range formula code 5-9
+    OP_AGG_RANGE,   // <start key> <end key>: fold every cell of the range
+    OP_AGG_VALUE,   // fold the popped value
+    OP_AGG_END      // close the aggregate and push its result
+} OpCode;
+
+#define MAX_PROGRAM_LENGTH 256
+#define MAX_PROGRAM_STACK 32
+#define MAX_AGGREGATE_DEPTH 8
+
+typedef struct {
+    int length;     // number of ints in code
+    int code[];
+} Program;
+
+typedef struct Journal Journal;
+typedef struct ValuePlane ValuePlane;
+typedef struct Roll Roll;
+
+// Spreadsheet structure now uses a contiguous array for grid.
+struct Spreadsheet {
+    Cell* grid;    // Pointer to a contiguous block of Cells.
+    short rows;
+    short cols;
+    short viewport_row;
+    short viewport_col;
+    bool output_enabled;
+    Program** programs;         // program pool, NULL entries are free slots
+    int program_count;
+    int program_capacity;
+    int* free_programs;         // stack of free slots below program_count
+    int free_program_count;
+    short append_row;           // row the next append_row writes
+    Roll* rolls;                // running state of ROLL formulas, by cell key
+    int roll_count;
+    int roll_capacity;
+    // Recalculation scratch indexed by cell key; all zero between recalcs.
+    bool* visited;
+    int* pending;               // affected parents not yet evaluated
+    char (*column_labels)[CELL_WIDTH];  // header names, space padded, no NUL
+    // Change feed: keys whose value or error state changed since the
+    // consumer last drained the list, limited to the subscribed ranges.
+    bool track_changes;
+    int* changes;
+    int change_count;
+    int change_capacity;
+    Range* subscriptions;       // none means every cell
+    int subscription_count;
+    // Snapshot the contents were last saved to or loaded from, and the
+    // SNAPSHOT_TILE-cell tiles changed since, so a save can append them.
+    char* snapshot_path;        // NULL until saved or loaded
+    uint64_t snapshot_generation;
+    uint64_t snapshot_base_size;    // bytes in the base file
+    uint64_t snapshot_delta_size;   // bytes of valid segments in the delta file
+    uint8_t* dirty_tiles;       // per tile, whether it is in dirty_list
+    int* dirty_list;
+    int dirty_count;
+    Journal* journal;           // commands are logged here first, if set
+    // Background checkpoint: a forked child writing a base snapshot of the
+    // sheet as it was at the fork, with the tiles that were dirty then.
+    pid_t checkpoint_pid;       // 0 when none is running
+    int checkpoint_fd;          // read end of the child's result pipe
+    char* checkpoint_path;
+    int* checkpoint_tiles;
+    int checkpoint_tile_count;
+    off_t checkpoint_journal;   // journal length at the fork
+    ValuePlane* plane;          // values published to other threads, if any read them
+};
+
+typedef enum {
+    COMMAND_ASSIGN,         // <cell>=<formula>
+    COMMAND_SCROLL,         // w, a, s, d
+    COMMAND_SCROLL_TO,      // scroll_to <cell>
+    COMMAND_OUTPUT,         // enable_output, disable_output
+    COMMAND_SUBSCRIBE,      // subscribe <range>
+    COMMAND_UNSUBSCRIBE,    // unsubscribe
+    COMMAND_SAVE,           // save <file>
+    COMMAND_LOAD,           // load <file>
+    COMMAND_CHECKPOINT,     // checkpoint [<file>]
+    COMMAND_IMPORT,         // import <file> AT <cell>
+    COMMAND_EXPORT,         // export <range> <file>
+    COMMAND_APPEND          // append_row <value> ...
+} CommandKind;
+
+// One parsed input line. Parsing fills it on the caller's stack without
+// touching the heap or the sheet; applying it never looks at the text again.
+typedef struct {
+    CommandKind kind;
+    short row;                  // target cell, scroll destination or import corner
+    short col;
+    char direction;             // COMMAND_SCROLL
+    bool output_enabled;        // COMMAND_OUTPUT
+    Range range;                // COMMAND_SUBSCRIBE, COMMAND_EXPORT
+    char path[INPUT_SIZE];      // COMMAND_SAVE, COMMAND_LOAD, COMMAND_CHECKPOINT, COMMAND_IMPORT, COMMAND_EXPORT
+    // COMMAND_ASSIGN: the formula in cell encoding (formula, cell1, cell2).
+    // A literal is formula -1 with value and error; formula 1 is the
+    // program in code, stored into the pool only when applied.
+    short formula;
+    int cell1;
+    int cell2;
+    int value;
+    bool error;
+    bool sleep;                 // SLEEP(...): formula 102 or a literal duration
+    int length;                 // COMMAND_APPEND: the values are code[0..length)
+    int code[MAX_PROGRAM_LENGTH];
+} Command;
+
+/* ---------- Published Values ---------- */
+// While other threads read the sheet (socket clients, or the REPL drawing
+// during a client's command) they read a copy of the values rather than
+// the grid, which a recalculation rewrites in place. A command marks the
+// tiles it changes and publishes them when it completes, under a seqlock:
+// the sequence is odd while a publish copies, and a reader that saw it odd
+// or changed reads again. Readers never wait for a recalculation, only for
+// the copy at its end.
+//
+// The lock is shared by readers and taken exclusively only when a load
+// replaces the sheet, and with it the shape of the plane.
+struct ValuePlane {
+    pthread_rwlock_t lock;
+    atomic_uint sequence;
+    short rows;                 // fixed while the lock is held
+    short cols;
+    _Atomic short viewport_row;
+    _Atomic short viewport_col;
+    atomic_bool output_enabled;
+    atomic_int* values;
+    atomic_uchar* errors;
+    uint8_t* stale;             // per tile, whether it is in stale_list
+    int* stale_list;
+    int stale_count;
+};
+
+// A read of the plane is the loads between read_begin and a read_retry
+// that returns false; loads between them must be relaxed atomics.
+static inline unsigned read_begin(ValuePlane* plane) {
+    unsigned sequence;
+    while ((sequence = atomic_load_explicit(&plane->sequence, memory_order_acquire)) & 1)
+        sched_yield();
+    return sequence;
+}
+
+static inline bool read_retry(ValuePlane* plane, unsigned sequence) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&plane->sequence, memory_order_relaxed) != sequence;
+}
+
+static inline int shown_value(ValuePlane* plane, int key, bool* error) {
+    *error = atomic_load_explicit(&plane->errors[key], memory_order_relaxed);
+    return atomic_load_explicit(&plane->values[key], memory_order_relaxed);
+}
+
+/* ---------- Binary Commands ---------- */
+// Machine clients can send commands already encoded instead of as text:
+// on stdin with --binary, or on a socket connection after the line
+// "binary". Commands come in batches and each batch is answered at once.
+// Fields are packed, in host byte order, and cells are 0-based BinaryCells
+// as in the binary feed.
+//
+// A batch is a BinaryBatch header followed by size bytes holding count
+// records, each an opcode byte and then its operands:
+//   BINARY_LITERAL  cell, int32 value               cell = value
+//   BINARY_REF      cell, source cell               cell = source
+//   BINARY_ARITH    uint8 formula, cell, a, b       formula is a cell formula
+//                   code 10-43; by its last digit, a and b are each a cell
+//                   or an int32 literal
+//   BINARY_RANGE    uint8 formula, cell, start, end formula is 5-9 (SUM-STDEV)
+//   BINARY_GET      cell
+//   BINARY_TEXT     uint16 length, that many bytes of any text command
+// The reply is a BinaryBatch header with the same count, count status
+// bytes (CommandStatus), then a BinaryValue for every get answered CMD_OK.
+// A record with an unknown opcode, or running past size, ends its batch,
+// as the records after it cannot be found: it and they are answered
+// CMD_UNRECOGNIZED. Any other record that fails to decode, such as one
+// with a formula code out of range, is answered with its own status
+// (CMD_UNRECOGNIZED, CMD_INVALID_CELL, ...) and the batch goes on.
+// A header promising more than BINARY_BATCH_SIZE bytes, or more records
+// than its size can hold, ends the stream.
+enum {
+    BINARY_LITERAL = 1,
+    BINARY_REF,
+    BINARY_ARITH,
+    BINARY_RANGE,
+    BINARY_GET,
+    BINARY_TEXT
+};
+
+typedef struct __attribute__((packed)) {
+    uint32_t size;      // bytes of records that follow
+    uint32_t count;     // records
+} BinaryBatch;
+
+typedef struct __attribute__((packed)) {
+    uint16_t row;
+    uint16_t col;
+} BinaryCell;
+
+typedef struct __attribute__((packed)) {
+    int32_t value;      // meaningless when error is set
+    uint8_t error;
+} BinaryValue;
+
+#define BINARY_RECORD_MIN (1 + sizeof(BinaryCell))      // a get
+#define BINARY_BATCH_SIZE (1 << 16)                     // header and records
+#define BINARY_REPLY_SIZE (sizeof(BinaryBatch) + BINARY_BATCH_SIZE / BINARY_RECORD_MIN * (1 + sizeof(BinaryValue)))
+
+/* ---------- Grid Access ---------- */
+// Returns pointer to cell at (row, col).
+static inline Cell* get_cell(Spreadsheet* sheet, short row, short col) {
+    return &(sheet->grid[(int)(row * sheet->cols + col)]);
+}
+
+// Helper: encode (row, col) as an integer key.
+static inline int encode_cell_key(short row, short col, short total_cols) {
+    return (int)(row * total_cols + col);
+}
+
+static inline bool cell_in_sheet(const Spreadsheet* sheet, int row, int col) {
+    return row >= 0 && row < sheet->rows && col >= 0 && col < sheet->cols;
+}
+
+// Function prototypes.
+Cell* get_cell_check(Spreadsheet* sheet, int index);
+void get_row_col(int index, short* row, short* col, short total_cols);
+void get_column_name(int col, char* name);
+const char* scan_cell(const char* p, short* row, short* col);
+void parse_cell_reference(const char* cell, short* row, short* col);
+bool create_plane(Spreadsheet* sheet);
+void publish_values(Spreadsheet* sheet);
+CommandStatus reevaluate_formula(Spreadsheet* sheet, Cell* cell, double* sleep_time);
+CommandStatus parse_command(Spreadsheet* sheet, const char* cmd, Command* command);
+CommandStatus apply_command(Spreadsheet* sheet, const Command* command, double* sleep_time);
+CommandStatus execute_command(Spreadsheet* sheet, const Command* command, const char* cmd, double* sleep_time);
+CommandStatus handle_command(Spreadsheet* sheet, const char* cmd, double* sleep_time);
+CommandStatus write_cells(Spreadsheet* sheet, const int* keys, const int* values, int count);
+char* format_int(char* out, int value, int width);
+bool write_all(int fd, const char* buf, size_t len);
+off_t replay_journal(Spreadsheet* sheet, const char* path);
+Journal* journal_open(const char* path, off_t length, int commit_every, int commit_ms);
+bool journal_append(Journal* j, const char* cmd);
+off_t journal_length(Journal* j);
+bool journal_checkpoint(Journal* j, const char* snapshot, off_t keep_from);
+void journal_close(Journal* j);
+Spreadsheet* create_spreadsheet(short rows, short cols);
+void free_spreadsheet(Spreadsheet* sheet);
+CommandStatus save_snapshot(Spreadsheet* sheet, const char* path);
+Spreadsheet* load_snapshot(const char* path);
+bool replace_spreadsheet(Spreadsheet* sheet, Spreadsheet* loaded);
+CommandStatus start_checkpoint(Spreadsheet* sheet, const char* path);
+bool finish_checkpoint(Spreadsheet* sheet, bool wait, char* message, size_t size);
+CommandStatus import_csv(Spreadsheet* sheet, const char* path, short row, short col, double* sleep_time);
+CommandStatus export_csv(Spreadsheet* sheet, const Range* range, const char* path);
+bool batch_valid(const BinaryBatch* header);
+bool batch_reads_only(const uint8_t* records, const BinaryBatch* header);
+size_t run_batch(Spreadsheet* sheet, const uint8_t* records, const BinaryBatch* header, uint8_t* reply);
+size_t read_batch(Spreadsheet* sheet, const uint8_t* records, const BinaryBatch* header, uint8_t* reply);
+
+#endif // SHEET_INTERNAL_H
@@ -0,0 +1,121 @@
+// Runs of the AVL key set: extending, splitting and joining them, with and
+// without a stride, checked against the keys expected after each step.
+#include <stdbool.h>
+#include <string.h>
+#include "avl.h"
+#include "check.h"
+
+#define MAX_KEYS 4096
+
+// Appends the keys of root in order to keys and counts its runs, checking
+// that each run lies wholly below the next.
+static void walk(AVLTree root, int* keys, int* count, int* runs) {
+    if (!root)
+        return;
+    walk(root->left, keys, count, runs);
+    CHECK(root->length >= 1 && root->stride >= 1);
+    CHECK(*count == 0 || keys[*count - 1] < root->key);
+    for (int i = 0; i < root->length; i++)
+        keys[(*count)++] = root->key + i * root->stride;
+    (*runs)++;
+    walk(root->right, keys, count, runs);
+}
+
+// Checks that root holds exactly the n ascending keys in expected, as the
+// given number of runs.
+static void expect(AVLTree root, const int* expected, int n, int runs) {
+    int keys[MAX_KEYS], count = 0, run_count = 0;
+    walk(root, keys, &count, &run_count);
+    CHECK(count == n);
+    CHECK(memcmp(keys, expected, n * sizeof(int)) == 0);
+    CHECK(run_count == runs);
+}
+
+static void test_unstrided(void) {
+    AVLTree root = NULL;
+    for (int key = 10; key < 20; key++)
+        root = avl_insert(root, key);
+    expect(root, (int[]){ 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 }, 10, 1);
+    CHECK(root->key == 10 && root->length == 10 && root->stride == 1);
+
+    root = avl_insert(root, 9);     // extends the run downwards
+    CHECK(avl_search(root, 9) && avl_search(root, 9)->length == 11);
+    root = avl_delete(root, 14);    // splits it in two
+    expect(root, (int[]){ 9, 10, 11, 12, 13, 15, 16, 17, 18, 19 }, 10, 2);
+    CHECK(!avl_search(root, 14));
+    root = avl_insert(root, 14);    // joins the halves again
+    expect(root, (int[]){ 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 }, 11, 1);
+    root = avl_delete(root, 9);     // trims either end
+    root = avl_delete(root, 19);
+    expect(root, (int[]){ 10, 11, 12, 13, 14, 15, 16, 17, 18 }, 9, 1);
+    avl_free(root);
+}
+
+static void test_strided(void) {
+    AVLTree root = NULL;
+    for (int key = 0; key <= 16; key += 4)
+        root = avl_insert(root, key);
+    expect(root, (int[]){ 0, 4, 8, 12, 16 }, 5, 1);
+    CHECK(root->stride == 4);
+    CHECK(avl_search(root, 8) && !avl_search(root, 6));
+
+    root = avl_insert(root, 6);     // between two keys: splits the run around it
+    expect(root, (int[]){ 0, 4, 6, 8, 12, 16 }, 6, 3);
+    root = avl_delete(root, 6);
+    root = avl_insert(root, 20);    // extends the upper part at its stride
+    root = avl_delete(root, 12);
+    expect(root, (int[]){ 0, 4, 8, 16, 20 }, 5, 3);
+    root = avl_insert(root, 12);    // joins the runs on either side of it
+    expect(root, (int[]){ 0, 4, 8, 12, 16, 20 }, 6, 2);
+    avl_free(root);
+
+    // A column of dependents on a 26-column sheet: one run of stride 26.
+    int keys[100];
+    for (int i = 0; i < 100; i++)
+        keys[i] = 3 + 26 * i;
+    root = avl_build_sorted(keys, 100);
+    expect(root, keys, 100, 1);
+    root = avl_delete(root, keys[50]);
+    CHECK(!avl_search(root, keys[50]) && avl_search(root, keys[51]));
+    root = avl_insert(root, keys[50]);
+    expect(root, keys, 100, 1);
+    avl_free(root);
+}
+
+// Random inserts and deletes against a bitmap, checking keys and balance.
+static void test_random(void) {
+    static bool present[MAX_KEYS];
+    int expected[MAX_KEYS];
+    AVLTree root = NULL;
+    srand(1);
+    for (int step = 0; step < 20000; step++) {
+        int key = rand() % 512 * (1 + step % 3);
+        if (rand() % 3) {
+            root = avl_insert(root, key);
+            present[key] = true;
+        } else {
+            root = avl_delete(root, key);
+            present[key] = false;
+        }
+        if (step % 97 != 0)
+            continue;
+        int n = 0;
+        for (int k = 0; k < MAX_KEYS; k++) {
+            if (present[k])
+                expected[n++] = k;
+        }
+        int keys[MAX_KEYS], count = 0, runs = 0;
+        walk(root, keys, &count, &runs);
+        CHECK(count == n && memcmp(keys, expected, n * sizeof(int)) == 0);
+        CHECK(avl_get_height(root) <= 2 * 12);
+    }
+    avl_free(root);
+}
+
+int main(void) {
+    test_unstrided();
+    test_strided();
+    test_random();
+    printf("test_avl: ok\n");
+    return 0;
+}
@@ -0,0 +1,199 @@
+// Binary command batches: each record kind decodes to the command it
+// stands for, a bad record gets its own status without stopping the batch,
+// and a record that cannot be sized ends it.
+#include <string.h>
+#include "sheet_internal.h"
+#include "check.h"
+
+#define ROWS 10
+#define COLS 10
+
+typedef struct {
+    uint8_t records[BINARY_BATCH_SIZE];
+    BinaryBatch header;
+} Batch;
+
+static uint8_t reply[BINARY_REPLY_SIZE];
+
+static void put(Batch* batch, const void* data, size_t size) {
+    memcpy(batch->records + batch->header.size, data, size);
+    batch->header.size += (uint32_t)size;
+}
+
+static void put_byte(Batch* batch, uint8_t byte) {
+    put(batch, &byte, 1);
+}
+
+static void put_cell(Batch* batch, int row, int col) {
+    BinaryCell cell = { (uint16_t)row, (uint16_t)col };
+    put(batch, &cell, sizeof(cell));
+}
+
+static void put_int(Batch* batch, int32_t value) {
+    put(batch, &value, sizeof(value));
+}
+
+static void literal(Batch* batch, int row, int col, int32_t value) {
+    put_byte(batch, BINARY_LITERAL);
+    put_cell(batch, row, col);
+    put_int(batch, value);
+    batch->header.count++;
+}
+
+static void get(Batch* batch, int row, int col) {
+    put_byte(batch, BINARY_GET);
+    put_cell(batch, row, col);
+    batch->header.count++;
+}
+
+static void text(Batch* batch, const char* cmd, size_t length) {
+    uint16_t size = (uint16_t)length;
+    put_byte(batch, BINARY_TEXT);
+    put(batch, &size, sizeof(size));
+    put(batch, cmd, length);
+    batch->header.count++;
+}
+
+// Runs batch on sheet and checks the reply's header and statuses.
+static const uint8_t* run(Spreadsheet* sheet, const Batch* batch, const uint8_t* statuses) {
+    CHECK(batch_valid(&batch->header));
+    size_t length = run_batch(sheet, batch->records, &batch->header, reply);
+    CHECK(length >= sizeof(BinaryBatch) + batch->header.count);
+    CHECK(memcmp(reply, &batch->header, sizeof(BinaryBatch)) == 0);
+    for (uint32_t i = 0; i < batch->header.count; i++)
+        CHECK(reply[sizeof(BinaryBatch) + i] == statuses[i]);
+    return reply + sizeof(BinaryBatch) + batch->header.count;
+}
+
+// Reads the value at p of the reply and returns the one after it.
+static const uint8_t* expect_value(const uint8_t* p, int32_t expected, bool error) {
+    BinaryValue value;
+    memcpy(&value, p, sizeof(value));
+    CHECK(value.error == error && (error || value.value == expected));
+    return p + sizeof(value);
+}
+
+static int value_of(Spreadsheet* sheet, int row, int col) {
+    int value;
+    bool error;
+    CHECK(sheet_get_value(sheet, row, col, &value, &error) == CMD_OK && !error);
+    return value;
+}
+
+static void test_records(void) {
+    Spreadsheet* sheet = sheet_create(ROWS, COLS);
+    CHECK(sheet);
+    static Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    literal(&batch, 0, 0, 5);                       // A1=5
+    literal(&batch, 0, 1, 7);                       // B1=7
+    put_byte(&batch, BINARY_ARITH);                 // C1=A1+B1
+    put_byte(&batch, 10);
+    put_cell(&batch, 0, 2);
+    put_cell(&batch, 0, 0);
+    put_cell(&batch, 0, 1);
+    batch.header.count++;
+    put_byte(&batch, BINARY_ARITH);                 // D1=100/B1
+    put_byte(&batch, 33);
+    put_cell(&batch, 0, 3);
+    put_int(&batch, 100);
+    put_cell(&batch, 0, 1);
+    batch.header.count++;
+    put_byte(&batch, BINARY_RANGE);                 // E1=SUM(A1:D1)
+    put_byte(&batch, 5);
+    put_cell(&batch, 0, 4);
+    put_cell(&batch, 0, 0);
+    put_cell(&batch, 0, 3);
+    batch.header.count++;
+    put_byte(&batch, BINARY_REF);                   // F1=E1
+    put_cell(&batch, 0, 5);
+    put_cell(&batch, 0, 4);
+    batch.header.count++;
+    text(&batch, "G1=F1*2", 7);
+    get(&batch, 0, 6);
+    literal(&batch, 0, 1, 0);                       // B1=0 makes D1 an error
+    get(&batch, 0, 3);
+    get(&batch, 0, 2);
+    uint8_t statuses[11] = { 0 };
+    const uint8_t* values = run(sheet, &batch, statuses);
+    values = expect_value(values, 2 * (5 + 7 + 12 + 14), false);
+    values = expect_value(values, 0, true);
+    expect_value(values, 5, false);
+    CHECK(value_of(sheet, 0, 0) == 5 && value_of(sheet, 0, 1) == 0);
+    sheet_free(sheet);
+}
+
+// Records that decode badly are answered one by one; the rest still run.
+static void test_bad_records(void) {
+    Spreadsheet* sheet = sheet_create(ROWS, COLS);
+    CHECK(sheet);
+    static Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    literal(&batch, ROWS, 0, 1);                    // no such row
+    put_byte(&batch, BINARY_ARITH);                 // no formula 11
+    put_byte(&batch, 11);
+    put_cell(&batch, 0, 2);
+    put_cell(&batch, 0, 0);
+    put_cell(&batch, 0, 1);
+    batch.header.count++;
+    put_byte(&batch, BINARY_RANGE);                 // range running backwards
+    put_byte(&batch, 6);
+    put_cell(&batch, 0, 4);
+    put_cell(&batch, 3, 0);
+    put_cell(&batch, 1, 0);
+    batch.header.count++;
+    text(&batch, "A1=1\0", 5);                      // a NUL in the text
+    text(&batch, "A1=A1", 5);                       // a cycle
+    literal(&batch, 1, 1, 42);
+    get(&batch, 1, 1);
+    get(&batch, 0, COLS);
+    uint8_t statuses[8] = {
+        CMD_INVALID_CELL, CMD_UNRECOGNIZED, CMD_INVALID_RANGE, CMD_UNRECOGNIZED,
+        CMD_CIRCULAR_REF, CMD_OK, CMD_OK, CMD_INVALID_CELL,
+    };
+    const uint8_t* values = run(sheet, &batch, statuses);
+    expect_value(values, 42, false);
+    sheet_free(sheet);
+}
+
+// An unknown opcode, or a record cut short by size, ends the batch: it and
+// every record after it are answered CMD_UNRECOGNIZED and not run.
+static void test_batch_end(void) {
+    Spreadsheet* sheet = sheet_create(ROWS, COLS);
+    CHECK(sheet);
+    static Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    literal(&batch, 0, 0, 1);
+    put_byte(&batch, 99);
+    put_cell(&batch, 0, 0);
+    batch.header.count++;
+    literal(&batch, 0, 1, 2);
+    get(&batch, 0, 0);
+    uint8_t ended[4] = { CMD_OK, CMD_UNRECOGNIZED, CMD_UNRECOGNIZED, CMD_UNRECOGNIZED };
+    run(sheet, &batch, ended);
+    CHECK(value_of(sheet, 0, 0) == 1 && value_of(sheet, 0, 1) == 0);
+
+    memset(&batch, 0, sizeof(batch));
+    literal(&batch, 0, 0, 3);
+    literal(&batch, 0, 1, 4);
+    batch.header.size -= 2;                         // the second is cut short
+    uint8_t cut[2] = { CMD_OK, CMD_UNRECOGNIZED };
+    run(sheet, &batch, cut);
+    CHECK(value_of(sheet, 0, 0) == 3 && value_of(sheet, 0, 1) == 0);
+
+    // A header that cannot be right ends the stream instead.
+    BinaryBatch header = { BINARY_BATCH_SIZE, 1 };
+    CHECK(!batch_valid(&header));
+    header.size = 2 * BINARY_RECORD_MIN;
+    header.count = 3;
+    CHECK(!batch_valid(&header));
+    sheet_free(sheet);
+}
+
+int main(void) {
+    test_records();
+    test_bad_records();
+    test_batch_end();
+    printf("test_binary: ok\n");
+    return 0;
+}
@@ -0,0 +1,118 @@
+// The forms of a dependent set: one and two keys inline, a vector, a tree,
+// and back again as keys are removed.
+#include <string.h>
+#include "depset.h"
+#include "check.h"
+
+// The form of set by its low two bits, as described in depset.h.
+#define FORM(set) ((int)((set) & 3))
+#define FORM_TREE 0
+#define FORM_ONE 1
+#define FORM_VECTOR 2
+#define FORM_TWO 3
+
+// Checks that set holds exactly the n ascending keys in expected.
+static void expect(DepSet set, const int* expected, int n) {
+    int capacity = 0, count = 0;
+    int* keys = NULL;
+    CHECK(depset_collect(set, &keys, &count, &capacity));
+    CHECK(count == n);
+    CHECK(n == 0 || memcmp(keys, expected, n * sizeof(int)) == 0);
+    free(keys);
+}
+
+static void test_spill(void) {
+    int keys[DEPSET_VECTOR_MAX + 8];
+    DepSet set = 0;
+    expect(set, NULL, 0);
+
+    set = depset_insert(set, 700);
+    CHECK(FORM(set) == FORM_ONE);
+    expect(set, (int[]){ 700 }, 1);
+    set = depset_insert(set, 5);
+    CHECK(FORM(set) == FORM_TWO);
+    expect(set, (int[]){ 5, 700 }, 2);
+    set = depset_insert(set, 5);    // already there
+    CHECK(FORM(set) == FORM_TWO);
+    set = depset_insert(set, 40);
+    CHECK(FORM(set) == FORM_VECTOR);
+    expect(set, (int[]){ 5, 40, 700 }, 3);
+    depset_free(set);
+
+    // Fill the vector up to its limit, then one more spills to a tree.
+    set = 0;
+    for (int i = 0; i < DEPSET_VECTOR_MAX; i++) {
+        keys[i] = 1000 - 10 * (DEPSET_VECTOR_MAX - i);
+        set = depset_insert(set, keys[i]);
+    }
+    CHECK(FORM(set) == FORM_VECTOR);
+    expect(set, keys, DEPSET_VECTOR_MAX);
+    keys[DEPSET_VECTOR_MAX] = 1000;
+    set = depset_insert(set, 1000);
+    CHECK(FORM(set) == FORM_TREE && set != 0);
+    expect(set, keys, DEPSET_VECTOR_MAX + 1);
+    depset_free(set);
+
+    // Keys as large as the inline fields allow survive both of them.
+    set = depset_insert(depset_insert(0, 0x7ffffffe), 0x7ffffff0);
+    CHECK(FORM(set) == FORM_TWO);
+    expect(set, (int[]){ 0x7ffffff0, 0x7ffffffe }, 2);
+}
+
+static void test_removal(void) {
+    DepSet set = 0;
+    for (int key = 1; key <= 5; key++)
+        set = depset_insert(set, key * 3);
+    CHECK(FORM(set) == FORM_VECTOR);
+    set = depset_delete(set, 4);    // not there
+    expect(set, (int[]){ 3, 6, 9, 12, 15 }, 5);
+    set = depset_delete(set, 9);
+    set = depset_delete(set, 3);
+    CHECK(FORM(set) == FORM_VECTOR);
+    set = depset_delete(set, 15);   // two left: back inline
+    CHECK(FORM(set) == FORM_TWO);
+    expect(set, (int[]){ 6, 12 }, 2);
+    set = depset_delete(set, 6);
+    CHECK(FORM(set) == FORM_ONE);
+    expect(set, (int[]){ 12 }, 1);
+    set = depset_delete(set, 12);
+    CHECK(set == 0);
+
+    // A tree shrinks key by key and stays correct throughout.
+    int keys[100];
+    for (int i = 0; i < 100; i++)
+        keys[i] = 7 + 11 * i;
+    set = depset_build_sorted(keys, 100);
+    CHECK(FORM(set) == FORM_TREE && set != 0);
+    for (int i = 99; i > 0; i -= 2) {
+        set = depset_delete(set, keys[i]);
+        memmove(keys + i, keys + i + 1, (99 - i) * sizeof(int));
+    }
+    expect(set, keys, 50);
+    depset_free(set);
+}
+
+// Collecting appends after what the array already holds, growing it from
+// any capacity, even none.
+static void test_collect(void) {
+    int keys[40];
+    for (int i = 0; i < 40; i++)
+        keys[i] = i * i;
+    DepSet set = depset_build_sorted(keys, 40);
+    int capacity = 0, count = 0;
+    int* collected = NULL;
+    CHECK(depset_collect(depset_insert(0, 99), &collected, &count, &capacity));
+    CHECK(depset_collect(set, &collected, &count, &capacity));
+    CHECK(count == 41 && capacity >= 41);
+    CHECK(collected[0] == 99 && memcmp(collected + 1, keys, sizeof(keys)) == 0);
+    free(collected);
+    depset_free(set);
+}
+
+int main(void) {
+    test_spill();
+    test_removal();
+    test_collect();
+    printf("test_depset: ok\n");
+    return 0;
+}
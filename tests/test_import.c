@@ -0,0 +1,109 @@
+// CSV import: a file that parses and fits is installed and recalculated
+// in one step; one that closes a cycle leaves the sheet as it was.
+#include <string.h>
+#include <unistd.h>
+#include "sheet.h"
+#include "check.h"
+
+#define ROWS 10
+#define COLS 6
+
+static char path[64];
+
+// Checks that a and b show the same value or error in every cell.
+static void check_same(Spreadsheet* a, Spreadsheet* b) {
+    for (int r = 0; r < ROWS; r++) {
+        for (int c = 0; c < COLS; c++) {
+            int value_a, value_b;
+            bool error_a, error_b;
+            CHECK(sheet_get_value(a, r, c, &value_a, &error_a) == CMD_OK);
+            CHECK(sheet_get_value(b, r, c, &value_b, &error_b) == CMD_OK);
+            CHECK(error_a == error_b && (error_a || value_a == value_b));
+        }
+    }
+}
+
+// Runs cmd on both sheets, checking that it succeeds.
+static void run_both(Spreadsheet* a, Spreadsheet* b, const char* cmd) {
+    CHECK(sheet_command(a, cmd) == CMD_OK);
+    CHECK(sheet_command(b, cmd) == CMD_OK);
+}
+
+// Writes text to the CSV file and imports it into sheet at cell.
+static CommandStatus import(Spreadsheet* sheet, const char* text, const char* cell) {
+    FILE* file = fopen(path, "w");
+    CHECK(file);
+    fputs(text, file);
+    fclose(file);
+    char cmd[96];
+    snprintf(cmd, sizeof(cmd), "import %s AT %s", path, cell);
+    return sheet_command(sheet, cmd);
+}
+
+// A sheet with values in A1:A5 and formulas over them.
+static Spreadsheet* new_sheet(void) {
+    Spreadsheet* sheet = sheet_create(ROWS, COLS);
+    CHECK(sheet);
+    char cmd[32];
+    for (int r = 1; r <= 5; r++) {
+        snprintf(cmd, sizeof(cmd), "A%d=%d", r, r * 10);
+        CHECK(sheet_command(sheet, cmd) == CMD_OK);
+    }
+    CHECK(sheet_command(sheet, "B1=SUM(A1:A5)") == CMD_OK);
+    CHECK(sheet_command(sheet, "C1=B1*2") == CMD_OK);
+    CHECK(sheet_command(sheet, "D1=A2-A1") == CMD_OK);
+    return sheet;
+}
+
+static void test_cycle_undone(void) {
+    Spreadsheet* sheet = new_sheet();
+    Spreadsheet* untouched = new_sheet();
+
+    // A1 would read C1, which already depends on A1.
+    CHECK(import(sheet, "C1\n7\n", "A1") == CMD_CIRCULAR_REF);
+    check_same(sheet, untouched);
+    // A cycle among the imported cells alone.
+    CHECK(import(sheet, "B3,A3\n", "A3") == CMD_CIRCULAR_REF);
+    check_same(sheet, untouched);
+
+    // The old formulas are linked as before: changes still reach them.
+    run_both(sheet, untouched, "A1=-4");
+    run_both(sheet, untouched, "A3=100");
+    check_same(sheet, untouched);
+    sheet_free(untouched);
+    sheet_free(sheet);
+}
+
+static void test_installed(void) {
+    Spreadsheet* sheet = new_sheet();
+    Spreadsheet* typed = new_sheet();
+    CHECK(import(sheet, "1, 2\n3 ,B6+A6\nMAX(A1:B6),A7/0\n", "A6") == CMD_OK);
+    CHECK(sheet_command(typed, "A6=1") == CMD_OK);
+    CHECK(sheet_command(typed, "B6=2") == CMD_OK);
+    CHECK(sheet_command(typed, "A7=3") == CMD_OK);
+    CHECK(sheet_command(typed, "B7=B6+A6") == CMD_OK);
+    CHECK(sheet_command(typed, "A8=MAX(A1:B6)") == CMD_OK);
+    CHECK(sheet_command(typed, "B8=A7/0") == CMD_OK);
+    check_same(sheet, typed);
+    run_both(sheet, typed, "A6=50");
+    check_same(sheet, typed);
+
+    // A field that does not parse or does not fit changes nothing.
+    CHECK(import(sheet, "1,2\n3,4+\n", "A1") == CMD_UNRECOGNIZED);
+    CHECK(import(sheet, "1\n2\n", "A10") == CMD_INVALID_RANGE);
+    check_same(sheet, typed);
+    sheet_free(typed);
+    sheet_free(sheet);
+}
+
+int main(void) {
+    char dir[] = "/tmp/sheet_test_XXXXXX";
+    CHECK(mkdtemp(dir));
+    snprintf(path, sizeof(path), "%s/import.csv", dir);
+    test_cycle_undone();
+    test_installed();
+    unlink(path);
+    rmdir(dir);
+    printf("test_import: ok\n");
+    return 0;
+}
@@ -0,0 +1,117 @@
+// The journal: every change made through a sheet with a journal, by
+// command or library call, is logged so that replaying the journal into a
+// fresh sheet reproduces it.
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include "sheet_internal.h"
+#include "check.h"
+
+#define ROWS 20
+#define COLS 10
+
+static char path[64];
+
+// Checks that a and b show the same value or error in every cell.
+static void check_same(Spreadsheet* a, Spreadsheet* b) {
+    for (int r = 0; r < ROWS; r++) {
+        for (int c = 0; c < COLS; c++) {
+            int value_a, value_b;
+            bool error_a, error_b;
+            CHECK(sheet_get_value(a, r, c, &value_a, &error_a) == CMD_OK);
+            CHECK(sheet_get_value(b, r, c, &value_b, &error_b) == CMD_OK);
+            CHECK(error_a == error_b && (error_a || value_a == value_b));
+        }
+    }
+}
+
+// A sheet that logs to the journal at path, after replaying what it holds.
+static Spreadsheet* open_logged(void) {
+    Spreadsheet* sheet = sheet_create(ROWS, COLS);
+    CHECK(sheet);
+    off_t length = replay_journal(sheet, path);
+    CHECK(length >= 0);
+    sheet->journal = journal_open(path, length, 1, 0);
+    CHECK(sheet->journal);
+    return sheet;
+}
+
+// Closes the journal of sheet and checks that replaying it into a fresh
+// sheet gives the same values.
+static void check_replay(Spreadsheet* sheet) {
+    journal_close(sheet->journal);
+    sheet->journal = NULL;
+    Spreadsheet* replayed = sheet_create(ROWS, COLS);
+    CHECK(replayed);
+    CHECK(replay_journal(replayed, path) > 0);
+    check_same(sheet, replayed);
+    sheet_free(replayed);
+}
+
+static void test_replay(void) {
+    unlink(path);
+    Spreadsheet* sheet = open_logged();
+    CHECK(sheet_command(sheet, "A1=5") == CMD_OK);
+    CHECK(sheet_command(sheet, "B1=A1*3+SUM(A2:A9)") == CMD_OK);
+    CHECK(sheet_command(sheet, "A1=B1") == CMD_CIRCULAR_REF);   // logged, fails again
+    CHECK(sheet_set_value(sheet, 1, 0, 17) == CMD_OK);
+    CHECK(sheet_set_formula(sheet, 2, 2, "MAX(A1:B5)/(A3-A3)") == CMD_OK);
+    int block[3][2] = { { 1, -2 }, { 30, 40 }, { -500, 600 } };
+    CHECK(sheet_write_range(sheet, 4, 0, 3, 2, &block[0][0], 2) == CMD_OK);
+    CHECK(sheet_command(sheet, "D4=C3+1") == CMD_OK);
+    check_replay(sheet);
+    sheet_free(sheet);
+
+    // Reopening replays and keeps logging after what is there.
+    sheet = open_logged();
+    CHECK(sheet_command(sheet, "A2=-9") == CMD_OK);
+    check_replay(sheet);
+
+    // A line torn by a crash mid-append is skipped.
+    int fd = open(path, O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    CHECK(write(fd, "A1=12", 5) == 5);
+    close(fd);
+    Spreadsheet* replayed = sheet_create(ROWS, COLS);
+    CHECK(replayed);
+    CHECK(replay_journal(replayed, path) > 0);
+    check_same(sheet, replayed);
+    sheet_free(replayed);
+    sheet_free(sheet);
+}
+
+// INT_MIN is logged as -2147483648, which must read back as itself.
+static void test_int_min(void) {
+    unlink(path);
+    Spreadsheet* sheet = open_logged();
+    CHECK(sheet_set_value(sheet, 0, 0, INT_MIN) == CMD_OK);
+    int block[2] = { INT_MIN, INT_MAX };
+    CHECK(sheet_write_range(sheet, 1, 0, 1, 2, block, 2) == CMD_OK);
+    CHECK(sheet_command(sheet, "C1=-2147483648") == CMD_OK);
+    CHECK(sheet_command(sheet, "C2=-2147483648+1") == CMD_OK);
+    int value;
+    bool error;
+    CHECK(sheet_get_value(sheet, 0, 2, &value, &error) == CMD_OK && value == INT_MIN);
+    CHECK(sheet_get_value(sheet, 1, 2, &value, &error) == CMD_OK && value == INT_MIN + 1);
+    check_replay(sheet);
+    Spreadsheet* replayed = sheet_create(ROWS, COLS);
+    CHECK(replayed);
+    CHECK(replay_journal(replayed, path) > 0);
+    CHECK(sheet_get_value(replayed, 0, 0, &value, &error) == CMD_OK && value == INT_MIN);
+    CHECK(sheet_get_value(replayed, 1, 0, &value, &error) == CMD_OK && value == INT_MIN);
+    sheet_free(replayed);
+    sheet_free(sheet);
+}
+
+int main(void) {
+    char dir[] = "/tmp/sheet_test_XXXXXX";
+    CHECK(mkdtemp(dir));
+    snprintf(path, sizeof(path), "%s/journal", dir);
+    test_replay();
+    test_int_min();
+    unlink(path);
+    rmdir(dir);
+    printf("test_journal: ok\n");
+    return 0;
+}
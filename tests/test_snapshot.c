@@ -0,0 +1,176 @@
+// Binary snapshots: a sheet saved and loaded again has the same values,
+// errors and formulas, and recalculates the same way afterwards, whether it
+// was saved whole or as delta segments after a base.
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sheet.h"
+#include "check.h"
+
+#define ROWS 40
+#define COLS 30
+#define DELTA_ROWS 400     // large enough that a few tiles are a small delta
+#define DELTA_COLS 100
+
+static char path[64];
+static char delta_path[80];
+
+// Runs cmd on sheet and checks that it succeeds.
+static void run(Spreadsheet* sheet, const char* cmd) {
+    CHECK(sheet_command(sheet, cmd) == CMD_OK);
+}
+
+// Checks that a and b show the same value or error in every cell.
+static void check_same(Spreadsheet* a, Spreadsheet* b) {
+    CHECK(sheet_rows(a) == sheet_rows(b) && sheet_cols(a) == sheet_cols(b));
+    for (int r = 0; r < sheet_rows(a); r++) {
+        for (int c = 0; c < sheet_cols(a); c++) {
+            int value_a, value_b;
+            bool error_a, error_b;
+            CHECK(sheet_get_value(a, r, c, &value_a, &error_a) == CMD_OK);
+            CHECK(sheet_get_value(b, r, c, &value_b, &error_b) == CMD_OK);
+            CHECK(error_a == error_b && (error_a || value_a == value_b));
+        }
+    }
+}
+
+// Fills sheet with literals and formulas of every kind, including an error.
+static void fill(Spreadsheet* sheet) {
+    char cmd[64];
+    for (int r = 1; r <= ROWS; r++) {
+        snprintf(cmd, sizeof(cmd), "A%d=%d", r, r * 7 % 23 - 5);
+        run(sheet, cmd);
+        snprintf(cmd, sizeof(cmd), "B%d=A%d*2+1", r, r);
+        run(sheet, cmd);
+    }
+    run(sheet, "C1=SUM(A1:B40)");
+    run(sheet, "C2=MAX(A1:A40)-MIN(B1:B40)");
+    run(sheet, "C3=STDEV(A1:A20)");
+    run(sheet, "C4=(A1+B2)*AVG(A3:B9)/(A4-A4)");   // an error
+    run(sheet, "C5=C4+1");
+    run(sheet, "D1=(C1+C2)*-3");
+}
+
+static void test_round_trip(void) {
+    Spreadsheet* sheet = sheet_create(ROWS, COLS);
+    CHECK(sheet);
+    fill(sheet);
+    char cmd[96];
+    snprintf(cmd, sizeof(cmd), "save %s", path);
+    run(sheet, cmd);
+    Spreadsheet* loaded = sheet_load(path);
+    CHECK(loaded);
+    check_same(sheet, loaded);
+
+    // The loaded formulas still depend on their cells.
+    run(sheet, "A3=1000");
+    run(loaded, "A3=1000");
+    run(sheet, "A4=0");
+    run(loaded, "A4=0");
+    check_same(sheet, loaded);
+    int value;
+    bool error;
+    CHECK(sheet_get_value(loaded, 3, 2, &value, &error) == CMD_OK && error);
+    sheet_free(loaded);
+    sheet_free(sheet);
+
+    CHECK(sheet_load("/nonexistent/sheet.bin") == NULL);
+}
+
+// Size of the file at name, or -1 if there is none.
+static long file_size(const char* name) {
+    struct stat st;
+    return stat(name, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// Saves sheet to the test path.
+static void save(Spreadsheet* sheet) {
+    char cmd[96];
+    snprintf(cmd, sizeof(cmd), "save %s", path);
+    run(sheet, cmd);
+}
+
+static void test_delta(void) {
+    unlink(delta_path);
+    Spreadsheet* sheet = sheet_create(DELTA_ROWS, DELTA_COLS);
+    CHECK(sheet);
+    fill(sheet);
+    save(sheet);
+    long base_size = file_size(path);
+    CHECK(base_size > 0);
+
+    // A small change goes to the delta file and leaves the base alone.
+    run(sheet, "A7=99");
+    run(sheet, "E30=C1*2");
+    save(sheet);
+    CHECK(file_size(path) == base_size);
+    long first_segment = file_size(delta_path);
+    CHECK(first_segment > 0);
+    Spreadsheet* loaded = sheet_load(path);
+    CHECK(loaded);
+    check_same(sheet, loaded);
+
+    // A torn last segment is ignored: the load stops at the one before.
+    run(sheet, "A8=-50");
+    save(sheet);
+    CHECK(file_size(delta_path) > first_segment);
+    CHECK(truncate(delta_path, file_size(delta_path) - 3) == 0);
+    Spreadsheet* torn = sheet_load(path);
+    CHECK(torn);
+    check_same(loaded, torn);
+    sheet_free(torn);
+    sheet_free(loaded);
+
+    // Once the delta would outgrow half the base, a new base is written
+    // and the delta file starts over.
+    char cmd[64];
+    bool compacted = false;
+    for (int round = 1; round <= 50 && !compacted; round++) {
+        for (int r = 1; r <= DELTA_ROWS; r += 3) {
+            snprintf(cmd, sizeof(cmd), "A%d=%d", r, r * round % 31);
+            run(sheet, cmd);
+        }
+        save(sheet);
+        compacted = file_size(delta_path) <= 0;
+    }
+    CHECK(compacted);
+    loaded = sheet_load(path);
+    CHECK(loaded);
+    check_same(sheet, loaded);
+    sheet_free(loaded);
+    sheet_free(sheet);
+}
+
+// A checkpoint writes the base from a child process while the sheet goes
+// on changing; the next save waits for it and appends what changed since.
+static void test_checkpoint(void) {
+    Spreadsheet* sheet = sheet_create(DELTA_ROWS, DELTA_COLS);
+    CHECK(sheet);
+    fill(sheet);
+    char cmd[96];
+    snprintf(cmd, sizeof(cmd), "checkpoint %s", path);
+    run(sheet, cmd);
+    run(sheet, "A9=123");
+    run(sheet, "F7=C1-A9");
+    save(sheet);
+    Spreadsheet* loaded = sheet_load(path);
+    CHECK(loaded);
+    check_same(sheet, loaded);
+    sheet_free(loaded);
+    sheet_free(sheet);
+}
+
+int main(void) {
+    char dir[] = "/tmp/sheet_test_XXXXXX";
+    CHECK(mkdtemp(dir));
+    snprintf(path, sizeof(path), "%s/sheet.bin", dir);
+    snprintf(delta_path, sizeof(delta_path), "%s.delta", path);
+    test_round_trip();
+    test_delta();
+    test_checkpoint();
+    unlink(delta_path);
+    unlink(path);
+    rmdir(dir);
+    printf("test_snapshot: ok\n");
+    return 0;
+}